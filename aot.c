@@ -0,0 +1,370 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./aot.h"
+#include "./hack.h"
+
+// aot translates an assembled program into a C file that runs it natively.
+// The ROM is cut into basic blocks, each one straight-line C over the RAM
+// array behind a case of a switch on the PC. A block starts at address 0,
+// after every jumping instruction and at every address an @k could load,
+// so jumps to labels land on a case. A jump whose target is the @k right
+// before it goes straight to that block, other jumps go back through the
+// switch and an address that starts no block runs one instruction at a
+// time on a small interpreter. The generated code keeps the emulator's
+// semantics: M and jump targets use A from before the instruction, it
+// stops on the @k, 0;JMP halt loop or past the program, and the cycle
+// budget is exact.
+
+// C expressions of the computations of the book, anything else goes
+// through alu() in the generated file.
+static const struct { uint8_t comp; const char *expr; } compExprs[] = {
+    { 0x2A, "0" }, { 0x3F, "1" }, { 0x3A, "0xFFFF" },
+    { 0x0C, "d" }, { 0x30, "a" }, { 0x70, "M" },
+    { 0x0D, "~d" }, { 0x31, "~a" }, { 0x71, "~M" },
+    { 0x0F, "-d" }, { 0x33, "-a" }, { 0x73, "-M" },
+    { 0x1F, "d + 1" }, { 0x37, "a + 1" }, { 0x77, "M + 1" },
+    { 0x0E, "d - 1" }, { 0x32, "a - 1" }, { 0x72, "M - 1" },
+    { 0x02, "d + a" }, { 0x42, "d + M" },
+    { 0x13, "d - a" }, { 0x53, "d - M" },
+    { 0x07, "a - d" }, { 0x47, "M - d" },
+    { 0x00, "d & a" }, { 0x40, "d & M" },
+    { 0x15, "d | a" }, { 0x55, "d | M" },
+};
+
+// conditions on the result t, indexed by the jump bits.
+static const char *jumpConds[8] = {
+    NULL, "(int16_t)t > 0", "t == 0", "(int16_t)t >= 0",
+    "(int16_t)t < 0", "t != 0", "(int16_t)t <= 0", "1",
+};
+
+static const char *prologue =
+    "#include<stdio.h>\n"
+    "#include<stdint.h>\n"
+    "#include<stdlib.h>\n"
+    "#include<string.h>\n"
+    "#include<time.h>\n"
+    "\n"
+    "#define RAM_SIZE %d\n"
+    "#define ROM_SIZE %d\n"
+    "#define ROM_WORDS %zu\n"
+    "#define M hack_ram[a & (RAM_SIZE - 1)]\n"
+    "\n"
+    "// the machine state, hack_run() continues from it. Build with\n"
+    "// -DHACK_NO_MAIN to drive it from another program.\n"
+    "uint16_t hack_ram[RAM_SIZE];\n"
+    "uint16_t hack_a, hack_d, hack_pc;\n"
+    "uint64_t hack_cycles;\n"
+    "\n"
+    "static const uint16_t rom[ROM_WORDS + 1] = {\n";
+
+static const char *runtime =
+    "};\n"
+    "\n"
+    "static inline uint16_t alu(uint16_t x, uint16_t y, int bits)\n"
+    "{\n"
+    "    if (bits & 0x20) x = 0;\n"
+    "    if (bits & 0x10) x = ~x;\n"
+    "    if (bits & 0x08) y = 0;\n"
+    "    if (bits & 0x04) y = ~y;\n"
+    "\n"
+    "    uint16_t out = (bits & 0x02) ? (uint16_t)(x + y) : (x & y);\n"
+    "\n"
+    "    return (bits & 0x01) ? (uint16_t)~out : out;\n"
+    "}\n"
+    "\n"
+    "// hack_halted tells if pc is past the program or on an @k, 0;JMP loop.\n"
+    "int hack_halted(void)\n"
+    "{\n"
+    "    uint16_t pc = hack_pc;\n"
+    "    if (pc >= ROM_WORDS) return 1;\n"
+    "\n"
+    "    return pc + 1 < ROM_WORDS && rom[pc] == pc && (rom[pc + 1] & 0x803F) == 0x8007;\n"
+    "}\n"
+    "\n"
+    "// hack_run executes at most max_cycles instructions and returns how\n"
+    "// many it did.\n"
+    "uint64_t hack_run(uint64_t max_cycles)\n"
+    "{\n"
+    "    uint16_t a = hack_a, d = hack_d, pc = hack_pc;\n"
+    "    uint64_t remaining = max_cycles;\n"
+    "\n"
+    "    for (;;)\n"
+    "    {\n"
+    "        switch (pc)\n"
+    "        {\n";
+
+static const char *epilogue =
+    "        default:\n"
+    "            goto step;\n"
+    "        }\n"
+    "\n"
+    "step:\n"
+    "        // one instruction on an address that starts no block, or when\n"
+    "        // the budget ends inside a block.\n"
+    "        if (pc >= ROM_WORDS || !remaining) goto done;\n"
+    "        remaining--;\n"
+    "        {\n"
+    "            uint16_t w = rom[pc];\n"
+    "            if (!(w & 0x8000))\n"
+    "            {\n"
+    "                a = w;\n"
+    "                pc = (pc + 1) & (ROM_SIZE - 1);\n"
+    "                continue;\n"
+    "            }\n"
+    "\n"
+    "            uint16_t t = alu(d, (w & 0x1000) ? M : a, (w >> 6) & 0x3F);\n"
+    "            uint16_t j = a & (ROM_SIZE - 1);\n"
+    "            int taken = (int16_t)t < 0 ? w & 4 : t == 0 ? w & 2 : w & 1;\n"
+    "            if (w & 0x08) M = t;\n"
+    "            if (w & 0x20) a = t;\n"
+    "            if (w & 0x10) d = t;\n"
+    "            pc = taken ? j : (pc + 1) & (ROM_SIZE - 1);\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "done:\n"
+    "    hack_a = a;\n"
+    "    hack_d = d;\n"
+    "    hack_pc = pc;\n"
+    "    hack_cycles += max_cycles - remaining;\n"
+    "\n"
+    "    return max_cycles - remaining;\n"
+    "}\n"
+    "\n"
+    "#ifndef HACK_NO_MAIN\n"
+    "static double now_ms(void)\n"
+    "{\n"
+    "    struct timespec ts;\n"
+    "    clock_gettime(CLOCK_MONOTONIC, &ts);\n"
+    "\n"
+    "    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;\n"
+    "}\n"
+    "\n"
+    "// main takes the options of bin/emulator that apply: -n N, --dump=FROM-TO\n"
+    "// and --time, and prints the same lines, so both can be diffed.\n"
+    "int main(int argc, char *argv[])\n"
+    "{\n"
+    "    uint64_t max_cycles = UINT64_MAX;\n"
+    "    const char *dump = NULL;\n"
+    "    int print_time = 0;\n"
+    "\n"
+    "    for (int i = 1; i < argc; i++)\n"
+    "    {\n"
+    "        if (!strcmp(argv[i], \"-n\") && i + 1 < argc) {\n"
+    "            max_cycles = strtoull(argv[++i], NULL, 10);\n"
+    "        } else if (!strncmp(argv[i], \"--cycles=\", 9)) {\n"
+    "            max_cycles = strtoull(argv[i] + 9, NULL, 10);\n"
+    "        } else if (!strncmp(argv[i], \"--dump=\", 7)) {\n"
+    "            dump = argv[i] + 7;\n"
+    "        } else if (!strcmp(argv[i], \"--time\")) {\n"
+    "            print_time = 1;\n"
+    "        } else {\n"
+    "            fprintf(stderr, \"usage: %s [-n cycles] [--dump=from-to] [--time]\\n\", argv[0]);\n"
+    "            return 1;\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    double start = now_ms();\n"
+    "    uint64_t cycles = hack_run(max_cycles);\n"
+    "    double elapsed = now_ms() - start;\n"
+    "\n"
+    "    fprintf(stderr, \"%s after %llu instructions at PC %u\\n\", hack_halted() ? \"halted\" : \"stopped\",\n"
+    "        (unsigned long long)cycles, hack_pc);\n"
+    "    if (print_time) {\n"
+    "        fprintf(stderr, \"%.3f ms, %.1f M instructions/s\\n\", elapsed, elapsed > 0 ? cycles / elapsed / 1000 : 0.0);\n"
+    "    }\n"
+    "\n"
+    "    if (dump)\n"
+    "    {\n"
+    "        char *end;\n"
+    "        long from = strtol(dump, &end, 10);\n"
+    "        long to = *end == '-' ? strtol(end + 1, &end, 10) : from;\n"
+    "        if (*end || from < 0 || to < from || to >= RAM_SIZE)\n"
+    "        {\n"
+    "            fprintf(stderr, \"bad RAM range: %s\\n\", dump);\n"
+    "            return 1;\n"
+    "        }\n"
+    "\n"
+    "        for (long i = from; i <= to; i++) {\n"
+    "            printf(\"RAM[%ld] = %d\\n\", i, (int16_t)hack_ram[i]);\n"
+    "        }\n"
+    "    }\n"
+    "\n"
+    "    return 0;\n"
+    "}\n"
+    "#endif\n";
+
+static const char* comp_expr(uint8_t comp);
+static int is_halt(const uint16_t *words, size_t count, size_t k);
+static int emit_block(FILE *out, const uint16_t *words, size_t count, size_t start, size_t end,
+    const uint8_t *leaders, const uint8_t *targeted);
+
+// aot_write writes the C translation of the count words to out, source is
+// only named in its header comment. It returns nonzero when the file could
+// not be written.
+int aot_write(FILE *out, const uint16_t *words, size_t count, const char *source)
+{
+    if (count > ROM_SIZE) count = ROM_SIZE;
+
+    // one more byte each so the block after the last word can be looked up.
+    uint8_t *leaders = calloc(count + 1, 1);
+    uint8_t *targeted = calloc(count + 1, 1);
+    if (!leaders || !targeted)
+    {
+        free(leaders);
+        free(targeted);
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    leaders[0] = 1;
+    leaders[count] = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t w = words[i];
+        if (!IS_C(w))
+        {
+            if (w < count) leaders[w] = 1;
+            continue;
+        }
+
+        if (JUMP(w)) leaders[i + 1] = 1;
+    }
+
+    // a halt loop is a block of its own, the @k stops the run.
+    for (size_t i = 0; i < count; i++)
+    {
+        if (is_halt(words, count, i)) leaders[i + 1] = 1;
+    }
+
+    // the blocks a jump goes to directly need a label.
+    for (size_t i = 1; i < count; i++)
+    {
+        if (IS_C(words[i]) && JUMP(words[i]) && !leaders[i] && !IS_C(words[i - 1]) && words[i - 1] < count) {
+            targeted[words[i - 1]] = 1;
+        }
+    }
+
+    fprintf(out, "// generated by the assembler from %s, do not edit.\n", source);
+    fprintf(out, prologue, RAM_SIZE, ROM_SIZE, count);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "%s0x%04x,%s", i % 8 ? " " : "    ", words[i], i % 8 == 7 ? "\n" : "");
+    }
+    fprintf(out, "%s    0\n", count % 8 ? "\n" : "");
+    fputs(runtime, out);
+
+    size_t start = 0;
+    int falls_through = 0;
+    while (start < count)
+    {
+        size_t end = start + 1;
+        while (!leaders[end]) end++;
+
+        if (falls_through) fprintf(out, "            // fall through\n");
+        falls_through = emit_block(out, words, count, start, end, leaders, targeted);
+        start = end;
+    }
+
+    // past the last word the run wraps around or stops.
+    if (falls_through) fprintf(out, "            pc = ROM_WORDS & (ROM_SIZE - 1);\n            continue;\n");
+
+    fputs(epilogue, out);
+
+    free(leaders);
+    free(targeted);
+
+    return ferror(out) ? 1 : 0;
+}
+
+static const char* comp_expr(uint8_t comp)
+{
+    for (size_t i = 0; i < sizeof(compExprs) / sizeof(compExprs[0]); i++)
+    {
+        if (compExprs[i].comp == comp) return compExprs[i].expr;
+    }
+
+    return NULL;
+}
+
+// is_halt matches bin/emulator: @k at address k, then an unconditional
+// jump that writes nothing.
+static int is_halt(const uint16_t *words, size_t count, size_t k)
+{
+    return k + 1 < count && words[k] == k && IS_C(words[k + 1]) && JUMP(words[k + 1]) == 0x7 && !DEST(words[k + 1]);
+}
+
+// emit_block writes the case of the block [start, end) and tells if it
+// falls through to the next one. It charges the whole block to the budget
+// up front, when the budget is shorter the interpreter takes over.
+static int emit_block(FILE *out, const uint16_t *words, size_t count, size_t start, size_t end,
+    const uint8_t *leaders, const uint8_t *targeted)
+{
+    fprintf(out, "        case %zu:\n", start);
+    if (targeted[start]) fprintf(out, "        L%zu:\n", start);
+
+    if (is_halt(words, count, start))
+    {
+        fprintf(out, "            pc = %zu;\n            goto done;\n", start);
+        return 0;
+    }
+
+    fprintf(out, "            if (remaining < %zu) { pc = %zu; goto step; }\n", end - start, start);
+    fprintf(out, "            remaining -= %zu;\n", end - start);
+
+    for (size_t i = start; i < end; i++)
+    {
+        uint16_t w = words[i];
+        if (!IS_C(w))
+        {
+            fprintf(out, "            a = %u;\n", w);
+            continue;
+        }
+
+        uint8_t comp = COMP(w), dest = DEST(w), jump = JUMP(w);
+        const char *expr = comp_expr(comp);
+        if (!dest && !jump) continue;
+
+        fprintf(out, "            {\n");
+        if (!dest && jump == 0x7) {
+            // an unconditional jump that writes nothing needs no result.
+        } else if (expr) {
+            fprintf(out, "                uint16_t t = (uint16_t)(%s);\n", expr);
+        } else {
+            fprintf(out, "                uint16_t t = alu(d, %s, 0x%02x);\n", comp & 0x40 ? "M" : "a", comp & 0x3F);
+        }
+
+        // a target known here is the @k right before the jump.
+        int target = -1;
+        if (jump && i > start && !IS_C(words[i - 1]) && words[i - 1] < count && leaders[words[i - 1]]) {
+            target = words[i - 1];
+        }
+        if (jump && target < 0) fprintf(out, "                uint16_t j = a & (ROM_SIZE - 1);\n");
+
+        if (dest & 0x1) fprintf(out, "                M = t;\n");
+        if (dest & 0x4) fprintf(out, "                a = t;\n");
+        if (dest & 0x2) fprintf(out, "                d = t;\n");
+
+        if (jump)
+        {
+            const char *cond = jumpConds[jump];
+            if (jump == 0x7) {
+                fprintf(out, "                ");
+            } else {
+                fprintf(out, "                if (%s) ", cond);
+            }
+
+            if (target >= 0) {
+                fprintf(out, "goto L%d;\n", target);
+            } else {
+                fprintf(out, "{ pc = j; continue; }\n");
+            }
+        }
+        fprintf(out, "            }\n");
+    }
+
+    uint16_t last = words[end - 1];
+
+    return !(IS_C(last) && JUMP(last) == 0x7);
+}
@@ -0,0 +1,10 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include<stdio.h>
+#include<stddef.h>
+#include<stdint.h>
+
+int aot_write(FILE *out, const uint16_t *words, size_t count, const char *source);
+
+#endif
@@ -0,0 +1,194 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./arena.h"
+
+#define ARENA_ALIGN 16
+#define ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+// Blocks form a list. A reset only rewinds to the first one, the blocks
+// after it are reused in order as the next run fills the arena again.
+typedef struct Block
+{
+    struct Block *next;
+    size_t size;
+    size_t used;
+}Block;
+
+#define BLOCK_HEADER ALIGN_UP(sizeof(Block))
+
+struct Arena
+{
+    Block *first;
+    Block *current;
+    size_t block_size;
+    size_t used;
+    size_t peak;
+    // held is the bytes of all blocks plus what was charged for memory
+    // kept elsewhere, limit caps it when nonzero.
+    size_t held;
+    size_t charged;
+    size_t limit;
+    int refused;
+};
+
+static Block* new_block(Arena *a, size_t size);
+
+Arena* arena_init(size_t block_size)
+{
+    Arena *a = malloc(sizeof(Arena));
+    if (!a) return NULL;
+
+    a->block_size = block_size ? ALIGN_UP(block_size) : 64 * 1024;
+    a->held = 0;
+    a->charged = 0;
+    a->limit = 0;
+    a->refused = 0;
+    a->first = new_block(a, a->block_size);
+    if (!a->first)
+    {
+        free(a);
+        return NULL;
+    }
+
+    a->current = a->first;
+    a->used = 0;
+    a->peak = 0;
+
+    return a;
+}
+
+// arena_alloc returns size bytes aligned to ARENA_ALIGN, or NULL when no
+// block can be had. Requests bigger than the block size get a block of
+// their own.
+void* arena_alloc(Arena *a, size_t size)
+{
+    size = ALIGN_UP(size ? size : 1);
+
+    Block *b = a->current;
+    while (b->used + size > b->size)
+    {
+        // a block kept from an earlier run, empty since the reset.
+        if (b->next && b->next->size >= size)
+        {
+            b = b->next;
+            b->used = 0;
+            continue;
+        }
+
+        Block *fresh = new_block(a, size > a->block_size ? size : a->block_size);
+        if (!fresh) return NULL;
+
+        fresh->next = b->next;
+        b->next = fresh;
+        b = fresh;
+    }
+
+    a->current = b;
+
+    void *ptr = (char*)b + BLOCK_HEADER + b->used;
+    b->used += size;
+    a->used += size;
+    if (a->used > a->peak) a->peak = a->used;
+
+    return ptr;
+}
+
+char* arena_strndup(Arena *a, const char *s, size_t len)
+{
+    char *copy = arena_alloc(a, len + 1);
+    if (!copy) return NULL;
+
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    return copy;
+}
+
+// arena_charge counts size bytes the run holds outside the arena, like
+// the IR's arrays, against the limit. It returns nonzero when they do not
+// fit.
+int arena_charge(Arena *a, size_t size)
+{
+    if (a->limit && a->held + size > a->limit)
+    {
+        a->refused = 1;
+        return 1;
+    }
+
+    a->held += size;
+    a->charged += size;
+
+    return 0;
+}
+
+// arena_set_limit caps the bytes held by the arena and charged to it, 0
+// lifts the cap. Blocks already there stay.
+void arena_set_limit(Arena *a, size_t limit)
+{
+    a->limit = limit;
+}
+
+// arena_refused tells whether an allocation or a charge failed on the
+// limit since the last reset.
+int arena_refused(Arena *a)
+{
+    return a->refused;
+}
+
+void arena_reset(Arena *a)
+{
+    a->current = a->first;
+    a->first->used = 0;
+    a->used = 0;
+    a->held -= a->charged;
+    a->charged = 0;
+    a->refused = 0;
+}
+
+// arena_used is the number of bytes handed out since the last reset.
+size_t arena_used(Arena *a)
+{
+    return a->used;
+}
+
+// arena_peak is the highest arena_used() seen over the arena's lifetime.
+size_t arena_peak(Arena *a)
+{
+    return a->peak;
+}
+
+void arena_free(Arena *a)
+{
+    if (!a) return;
+
+    Block *b = a->first;
+    while (b)
+    {
+        Block *next = b->next;
+        free(b);
+        b = next;
+    }
+
+    free(a);
+}
+
+static Block* new_block(Arena *a, size_t size)
+{
+    if (a->limit && a->held + BLOCK_HEADER + size > a->limit)
+    {
+        a->refused = 1;
+        return NULL;
+    }
+
+    Block *b = malloc(BLOCK_HEADER + size);
+    if (!b) return NULL;
+
+    a->held += BLOCK_HEADER + size;
+
+    b->next = NULL;
+    b->size = size;
+    b->used = 0;
+
+    return b;
+}
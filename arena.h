@@ -0,0 +1,22 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include<stddef.h>
+
+// Arena is a bump allocator owning everything one assembly run allocates.
+// Nothing is freed on its own: arena_reset() makes the whole arena
+// available again in O(1), keeping its blocks for the next run.
+typedef struct Arena Arena;
+
+Arena* arena_init(size_t block_size);
+void* arena_alloc(Arena *a, size_t size);
+char* arena_strndup(Arena *a, const char *s, size_t len);
+int arena_charge(Arena *a, size_t size);
+void arena_set_limit(Arena *a, size_t limit);
+int arena_refused(Arena *a);
+void arena_reset(Arena *a);
+size_t arena_used(Arena *a);
+size_t arena_peak(Arena *a);
+void arena_free(Arena *a);
+
+#endif
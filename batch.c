@@ -0,0 +1,528 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./batch.h"
+#include "./pool.h"
+
+// The batch executor runs many machines over one ROM in lockstep. Lanes
+// are packed 16 to a group, the A, D and PC of a group each filling one
+// vector of 16-bit words, so a single AVX2 register (or two SSE2 ones)
+// carries a register of all 16 machines. At every step a group executes
+// the instruction at the lowest PC among its running lanes for all the
+// lanes that are there, the divergence mask, while the others wait and
+// catch up. M is read and written lane by lane since every lane has its
+// own RAM. Every BATCH_INTERVAL steps the running lanes of a wave are
+// sorted by PC and packed into groups again, so lanes that went the same
+// way share a group and finished lanes stop taking up room. Waves of
+// BATCH_WAVE lanes run on the worker pool.
+
+#define BATCH_WIDTH 16
+#define BATCH_WAVE 256
+#define BATCH_INTERVAL 256
+
+typedef uint16_t v16 __attribute__((vector_size(BATCH_WIDTH * sizeof(uint16_t))));
+typedef int16_t s16 __attribute__((vector_size(BATCH_WIDTH * sizeof(uint16_t))));
+
+// Slot is a lane in flight and its RAM.
+typedef struct {
+    Lane *lane;
+    uint16_t *ram;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t cycles;
+}Slot;
+
+typedef struct {
+    v16 a;
+    v16 d;
+    v16 pc;
+    v16 live;       // 0xFFFF for the lanes still running
+    v16 steps;      // instructions each lane ran since the group was packed
+    v16 limit;      // steps left in the budget of each lane, capped
+    uint16_t *ram[BATCH_WIDTH];
+    Slot *slots[BATCH_WIDTH];
+    size_t count;
+}Group;
+
+typedef struct {
+    const Cpu *program;
+    const uint8_t *halts;
+    Lane *lanes;
+    size_t count;
+    const BatchOptions *options;
+    int errnum;
+}Wave;
+
+static void run_wave(void *arg);
+static int run_lockstep(Wave *wave);
+static int run_serial(Wave *wave);
+static size_t pack(Slot **live, size_t count, Group *groups, uint16_t *scratch, uint64_t max_cycles);
+static void run_group(Group *g, const uint16_t *rom, const uint8_t *halts, size_t steps);
+static int compare_pc(const void *a, const void *b);
+static int finish_lane(Lane *lane, const uint16_t *ram, const BatchOptions *options);
+static int parse_lane(char *line, Lane *lane);
+
+// batch_read_lanes reads one lane per line of filename, each a list of
+// address=value RAM presets. Empty lines and // comments are skipped.
+int batch_read_lanes(const char *filename, Lane **lanes, size_t *count)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", filename);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t line_size = 0, line_number = 0, capacity = 0;
+    int errnum = 0;
+
+    *lanes = NULL;
+    *count = 0;
+
+    while (getline(&line, &line_size, file) != -1)
+    {
+        line_number++;
+
+        char *comment = strstr(line, "//");
+        if (comment) *comment = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;
+
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            Lane *grown = realloc(*lanes, capacity * sizeof(Lane));
+            if (!grown)
+            {
+                fprintf(stderr, "Err out of memory\n");
+                errnum = 1;
+                break;
+            }
+            *lanes = grown;
+        }
+
+        Lane *lane = &(*lanes)[*count];
+        memset(lane, 0, sizeof(Lane));
+        (*count)++;
+
+        if (parse_lane(line, lane))
+        {
+            fprintf(stderr, "Err %s: bad lane input on line: %zu\n", filename, line_number);
+            errnum = 1;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(file);
+
+    if (errnum)
+    {
+        batch_free_lanes(*lanes, *count);
+        *lanes = NULL;
+        *count = 0;
+    }
+
+    return errnum;
+}
+
+// batch_run runs every lane from a zeroed RAM with its presets applied on
+// the ROM of program until it halts or runs out of options->max_cycles.
+int batch_run(const Cpu *program, Lane *lanes, size_t count, const BatchOptions *options)
+{
+    uint8_t *halts = malloc(ROM_SIZE);
+    size_t wave_count = (count + BATCH_WAVE - 1) / BATCH_WAVE;
+    Wave *waves = calloc(wave_count ? wave_count : 1, sizeof(Wave));
+    if (!halts || !waves)
+    {
+        free(halts);
+        free(waves);
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    for (size_t pc = 0; pc < ROM_SIZE; pc++) {
+        halts[pc] = cpu_halts_at(program, pc);
+    }
+
+    Pool *pool = pool_init(options->workers ? options->workers : pool_default_workers());
+    if (!pool)
+    {
+        free(halts);
+        free(waves);
+        fprintf(stderr, "Err can not start workers\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < wave_count; i++)
+    {
+        Wave *wave = &waves[i];
+        wave->program = program;
+        wave->halts = halts;
+        wave->lanes = lanes + i * BATCH_WAVE;
+        wave->count = count - i * BATCH_WAVE < BATCH_WAVE ? count - i * BATCH_WAVE : BATCH_WAVE;
+        wave->options = options;
+
+        if (pool_submit(pool, run_wave, wave)) {
+            run_wave(wave);
+        }
+    }
+
+    pool_wait(pool);
+    pool_free(pool);
+
+    int errnum = 0;
+    for (size_t i = 0; i < wave_count; i++) {
+        errnum |= waves[i].errnum;
+    }
+
+    free(halts);
+    free(waves);
+
+    return errnum;
+}
+
+void batch_free_lanes(Lane *lanes, size_t count)
+{
+    if (!lanes) return;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        free(lanes[i].inputs);
+        free(lanes[i].dump);
+    }
+    free(lanes);
+}
+
+static void run_wave(void *arg)
+{
+    Wave *wave = arg;
+
+    wave->errnum = wave->options->serial ? run_serial(wave) : run_lockstep(wave);
+}
+
+static int run_lockstep(Wave *wave)
+{
+    const BatchOptions *options = wave->options;
+    size_t group_count = (wave->count + BATCH_WIDTH - 1) / BATCH_WIDTH;
+    Slot *slots = calloc(wave->count, sizeof(Slot));
+    Slot **live = calloc(wave->count, sizeof(Slot*));
+    Group *groups = aligned_alloc(sizeof(v16), group_count * sizeof(Group));
+    // one more RAM, the scratch of the empty lanes.
+    uint16_t *ram = calloc((wave->count + 1) * RAM_SIZE, sizeof(uint16_t));
+    int errnum = 0;
+
+    if (!slots || !live || !groups || !ram)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        errnum = 1;
+        goto done;
+    }
+
+    for (size_t i = 0; i < wave->count; i++)
+    {
+        Slot *slot = &slots[i];
+        slot->lane = &wave->lanes[i];
+        slot->ram = ram + i * RAM_SIZE;
+        for (size_t k = 0; k < slot->lane->input_count; k++) {
+            slot->ram[slot->lane->inputs[k].address] = slot->lane->inputs[k].value;
+        }
+    }
+
+    // a program that starts on its halt loop never runs.
+    size_t live_count = 0;
+    for (size_t i = 0; i < wave->count && !wave->halts[0]; i++) {
+        live[live_count++] = &slots[i];
+    }
+
+    while (live_count)
+    {
+        size_t used = pack(live, live_count, groups, ram + wave->count * RAM_SIZE, options->max_cycles);
+        if (!used) break;
+
+        for (size_t g = 0; g < used; g++) {
+            run_group(&groups[g], wave->program->rom, wave->halts, BATCH_INTERVAL);
+        }
+
+        // write the registers back and drop the lanes that finished.
+        live_count = 0;
+        for (size_t g = 0; g < used; g++)
+        {
+            Group *group = &groups[g];
+            for (size_t i = 0; i < group->count; i++)
+            {
+                Slot *slot = group->slots[i];
+                slot->a = group->a[i];
+                slot->d = group->d[i];
+                slot->pc = group->pc[i];
+                slot->cycles += group->steps[i];
+                if (group->live[i]) live[live_count++] = slot;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < wave->count && !errnum; i++)
+    {
+        Slot *slot = &slots[i];
+        Lane *lane = slot->lane;
+        lane->a = slot->a;
+        lane->d = slot->d;
+        lane->pc = slot->pc;
+        lane->cycles = slot->cycles;
+        lane->halted = wave->halts[slot->pc];
+        errnum = finish_lane(lane, slot->ram, options);
+    }
+
+done:
+    free(slots);
+    free(live);
+    free(groups);
+    free(ram);
+
+    return errnum;
+}
+
+// run_serial is the reference the lockstep executor is measured against:
+// each lane on its own on the interpreter.
+static int run_serial(Wave *wave)
+{
+    Cpu *cpu = malloc(sizeof(Cpu));
+    if (!cpu)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    memcpy(cpu, wave->program, sizeof(Cpu));
+    cpu->stop_at_halt = 1;
+
+    int errnum = 0;
+    for (size_t i = 0; i < wave->count && !errnum; i++)
+    {
+        Lane *lane = &wave->lanes[i];
+
+        memset(cpu->ram, 0, sizeof(cpu->ram));
+        for (size_t k = 0; k < lane->input_count; k++) {
+            cpu->ram[lane->inputs[k].address] = lane->inputs[k].value;
+        }
+        cpu_reset(cpu);
+        cpu_run(cpu, wave->options->max_cycles);
+
+        lane->a = cpu->a;
+        lane->d = cpu->d;
+        lane->pc = cpu->pc;
+        lane->cycles = cpu->cycles;
+        lane->halted = cpu_halted(cpu);
+        errnum = finish_lane(lane, cpu->ram, wave->options);
+    }
+
+    free(cpu);
+
+    return errnum;
+}
+
+// pack sorts the running lanes by PC and deals them out to groups in that
+// order, lanes out of budget are left out. It returns the number of
+// groups used.
+static size_t pack(Slot **live, size_t count, Group *groups, uint16_t *scratch, uint64_t max_cycles)
+{
+    size_t kept = 0;
+
+    qsort(live, count, sizeof(Slot*), compare_pc);
+
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        Slot *slot = live[i];
+        if (slot->cycles >= max_cycles) continue;
+
+        if (kept % BATCH_WIDTH == 0)
+        {
+            Group *g = &groups[used++];
+            memset(g, 0, sizeof(Group));
+            for (size_t k = 0; k < BATCH_WIDTH; k++) {
+                g->ram[k] = scratch;
+            }
+        }
+
+        Group *g = &groups[used - 1];
+        size_t lane = g->count++;
+        uint64_t left = max_cycles - slot->cycles;
+
+        g->a[lane] = slot->a;
+        g->d[lane] = slot->d;
+        g->pc[lane] = slot->pc;
+        g->live[lane] = 0xFFFF;
+        g->limit[lane] = left < 0xFFFF ? left : 0xFFFF;
+        g->ram[lane] = slot->ram;
+        g->slots[lane] = slot;
+        kept++;
+    }
+
+    return used;
+}
+
+// VMIN is the lanewise unsigned minimum, a macro so it ends up in each
+// clone of run_group.
+#define VMIN(x, y) ((y) ^ (((x) ^ (y)) & (v16)((x) < (y))))
+
+// run_group executes up to steps instructions of the group, each one for
+// the running lanes at the lowest PC. Lanes of a partly filled group point
+// at a scratch RAM, so M is loaded and stored on all 16 lanes without
+// branches and the mask picks what is kept.
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target_clones("avx2", "default")))
+#endif
+static void run_group(Group *g, const uint16_t *rom, const uint8_t *halts, size_t steps)
+{
+    static const v16 rotate8 = { 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 };
+    static const v16 rotate4 = { 4, 5, 6, 7, 0, 1, 2, 3, 12, 13, 14, 15, 8, 9, 10, 11 };
+    static const v16 rotate2 = { 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13 };
+    static const v16 rotate1 = { 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 };
+    v16 a = g->a, d = g->d, pc = g->pc, live = g->live, count = g->steps, limit = g->limit;
+
+    for (size_t step = 0; step < steps; step++)
+    {
+        v16 lowest = (pc & live) | ~live;
+        v16 rotated8 = __builtin_shuffle(lowest, rotate8);
+        lowest = VMIN(lowest, rotated8);
+        v16 rotated4 = __builtin_shuffle(lowest, rotate4);
+        lowest = VMIN(lowest, rotated4);
+        v16 rotated2 = __builtin_shuffle(lowest, rotate2);
+        lowest = VMIN(lowest, rotated2);
+        v16 rotated1 = __builtin_shuffle(lowest, rotate1);
+        lowest = VMIN(lowest, rotated1);
+        uint16_t at = lowest[0];
+        if (at == 0xFFFF) break;
+
+        v16 mask = (v16)(pc == at) & live;
+        uint16_t word = rom[at];
+        uint16_t next = (at + 1) & (ROM_SIZE - 1);
+        v16 finished;
+
+        if (!IS_C(word))
+        {
+            a = (a & ~mask) | (word & mask);
+            pc = (pc & ~mask) | (next & mask);
+            finished = halts[next] ? mask : (v16){ 0 };
+        }
+        else
+        {
+            uint8_t bits = (word >> 6) & 0x3F, dest = DEST(word), jump = JUMP(word);
+            v16 address = a & (RAM_SIZE - 1);
+            v16 y = a;
+
+            if (word & 0x1000)
+            {
+                for (int i = 0; i < BATCH_WIDTH; i++) {
+                    y[i] = g->ram[i][address[i]];
+                }
+            }
+
+            v16 x = d;
+            if (bits & 0x20) x = (v16){ 0 };
+            if (bits & 0x10) x = ~x;
+            if (bits & 0x08) y = (v16){ 0 };
+            if (bits & 0x04) y = ~y;
+            v16 out = (bits & 0x02) ? x + y : x & y;
+            if (bits & 0x01) out = ~out;
+
+            v16 taken = { 0 };
+            if (jump)
+            {
+                s16 value = (s16)out;
+                if (jump & JUMP_LT) taken |= (v16)(value < 0);
+                if (jump & JUMP_EQ) taken |= (v16)(value == 0);
+                if (jump & JUMP_GT) taken |= (v16)(value > 0);
+                taken &= mask;
+            }
+
+            if (dest & DEST_M)
+            {
+                for (int i = 0; i < BATCH_WIDTH; i++)
+                {
+                    uint16_t *m = &g->ram[i][address[i]];
+                    *m = (*m & ~mask[i]) | (out[i] & mask[i]);
+                }
+            }
+
+            v16 moved = ((a & (ROM_SIZE - 1)) & taken) | (next & ~taken);
+            pc = (pc & ~mask) | (moved & mask);
+            if (dest & DEST_A) a = (a & ~mask) | (out & mask);
+            if (dest & DEST_D) d = (d & ~mask) | (out & mask);
+
+            finished = halts[next] ? mask & ~taken : (v16){ 0 };
+            if (jump)
+            {
+                for (int i = 0; i < BATCH_WIDTH; i++) {
+                    finished[i] |= taken[i] & -(uint16_t)halts[pc[i]];
+                }
+            }
+        }
+
+        count += mask & 1;
+        finished |= (v16)(count == limit) & mask;
+        live &= ~finished;
+    }
+
+    g->a = a;
+    g->d = d;
+    g->pc = pc;
+    g->live = live;
+    g->steps = count;
+}
+
+static int compare_pc(const void *a, const void *b)
+{
+    const Slot *sa = *(Slot* const*)a, *sb = *(Slot* const*)b;
+
+    return (sa->pc > sb->pc) - (sa->pc < sb->pc);
+}
+
+static int finish_lane(Lane *lane, const uint16_t *ram, const BatchOptions *options)
+{
+    if (!options->dump_count) return 0;
+
+    lane->dump = malloc(options->dump_count * sizeof(uint16_t));
+    if (!lane->dump)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    memcpy(lane->dump, ram + options->dump_from, options->dump_count * sizeof(uint16_t));
+
+    return 0;
+}
+
+static int parse_lane(char *line, Lane *lane)
+{
+    size_t capacity = 0;
+
+    for (char *token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+    {
+        char *end;
+        long address = strtol(token, &end, 10);
+        if (end == token || *end != '=' || address < 0 || address >= RAM_SIZE) return 1;
+
+        char *digits = end + 1;
+        long value = strtol(digits, &end, 10);
+        if (*end || end == digits || value < -32768 || value > 65535) return 1;
+
+        if (lane->input_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 8;
+            LaneInput *grown = realloc(lane->inputs, capacity * sizeof(LaneInput));
+            if (!grown) return 1;
+            lane->inputs = grown;
+        }
+
+        lane->inputs[lane->input_count].address = address;
+        lane->inputs[lane->input_count].value = (uint16_t)value;
+        lane->input_count++;
+    }
+
+    return 0;
+}
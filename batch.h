@@ -0,0 +1,41 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include<stddef.h>
+#include<stdint.h>
+#include "./cpu.h"
+
+// LaneInput presets one RAM word of a lane before it starts.
+typedef struct {
+    uint16_t address;
+    uint16_t value;
+}LaneInput;
+
+// Lane is one machine of a batch: the inputs it starts from and, once the
+// batch has run, where it ended and the RAM words asked for in the dump.
+typedef struct {
+    LaneInput *inputs;
+    size_t input_count;
+
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    int halted;
+    uint64_t cycles;
+    uint16_t *dump;
+}Lane;
+
+typedef struct {
+    size_t workers;
+    uint64_t max_cycles;
+    // run the lanes one at a time on cpu_run() instead of in lockstep.
+    int serial;
+    size_t dump_from;
+    size_t dump_count;
+}BatchOptions;
+
+int batch_read_lanes(const char *filename, Lane **lanes, size_t *count);
+int batch_run(const Cpu *program, Lane *lanes, size_t count, const BatchOptions *options);
+void batch_free_lanes(Lane *lanes, size_t count);
+
+#endif
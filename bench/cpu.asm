@@ -0,0 +1,74 @@
+// cpu.asm is the workload of the emulator benchmark: 20000 rounds of
+// filling a 256 word array and summing it in a subroutine called through
+// a return address, about 164 million instructions. R2 ends up holding
+// the sum of the last round.
+    @20000
+    D=A
+    @rounds
+    M=D
+(ROUND)
+    // fill RAM[1024 + i] = i + rounds
+    @256
+    D=A
+    @i
+    M=D
+(FILL)
+    @i
+    MD=M-1
+    @rounds
+    D=D+M
+    @value
+    M=D
+    @i
+    D=M
+    @1024
+    D=D+A
+    @pointer
+    M=D
+    @value
+    D=M
+    @pointer
+    A=M
+    M=D
+    @i
+    D=M
+    @FILL
+    D;JGT
+    // R2 = sum(), returning to SUMMED
+    @SUMMED
+    D=A
+    @return
+    M=D
+    @SUM
+    0;JMP
+(SUMMED)
+    @rounds
+    MD=M-1
+    @ROUND
+    D;JGT
+(END)
+    @END
+    0;JMP
+
+(SUM)
+    @R2
+    M=0
+    @256
+    D=A
+    @i
+    M=D
+(SUM_LOOP)
+    @i
+    MD=M-1
+    @1024
+    A=D+A
+    D=M
+    @R2
+    M=D+M
+    @i
+    D=M
+    @SUM_LOOP
+    D;JGT
+    @return
+    A=M
+    0;JMP
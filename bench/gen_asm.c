@@ -0,0 +1,116 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+
+// gen_asm writes a synthetic Hack program to stdout, the same arguments
+// always give the same program.
+//
+//   gen_asm instructions [label_density] [variable_density] [seed]
+//
+// label_density is the share of instructions preceded by a label and
+// variable_density the share of A-instructions naming a variable, the
+// other A-instructions are constants, labels or predefined symbols. Every
+// label is defined exactly once so the output always assembles.
+
+static const char *comps[] = {
+    "0", "1", "-1", "D", "A", "M", "!D", "!A", "!M", "-D", "-A", "-M",
+    "D+1", "A+1", "M+1", "D-1", "A-1", "M-1", "D+A", "D+M", "D-A", "D-M",
+    "A-D", "M-D", "D&A", "D&M", "D|A", "D|M"
+};
+static const char *dests[] = { "M", "D", "MD", "A", "AM", "AD", "AMD" };
+static const char *jumps[] = { "JGT", "JEQ", "JGE", "JLT", "JNE", "JLE", "JMP" };
+static const char *predefined[] = { "R0", "R13", "SP", "LCL", "ARG", "THIS", "THAT", "SCREEN", "KBD" };
+
+#define COUNT(a) (sizeof(a) / sizeof(a[0]))
+
+static uint64_t state;
+
+static uint32_t next_random(void);
+static double next_unit(void);
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: gen_asm instructions [label_density] [variable_density] [seed]\n");
+        return 1;
+    }
+
+    size_t count = strtoull(argv[1], NULL, 10);
+    double label_density = argc > 2 ? atof(argv[2]) : 0.05;
+    double variable_density = argc > 3 ? atof(argv[3]) : 0.2;
+    state = argc > 4 ? strtoull(argv[4], NULL, 10) : 1;
+    if (!state) state = 1;
+
+    size_t labels = (size_t)(count * label_density);
+    size_t variables = (size_t)(count * variable_density / 8) + 1;
+    if (labels == 0) labels = 1;
+
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    printf("// generated by gen_asm %zu %g %g\n", count, label_density, variable_density);
+
+    size_t defined = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        // spread the definitions evenly so about half the references are forward.
+        if (defined < labels && (defined + 1) * count <= (i + 1) * labels) {
+            printf("(LOOP_%zu)\n", defined++);
+        }
+
+        if (next_unit() < 0.02) {
+            printf("// comment line %zu\n", i);
+        }
+
+        if (next_random() % 2)
+        {
+            double k = next_unit();
+            if (k < variable_density) {
+                printf("@var_%zu\n", next_random() % variables);
+            } else if (k < variable_density + (1 - variable_density) / 3) {
+                printf("@LOOP_%zu\n", next_random() % labels);
+            } else if (k < variable_density + (1 - variable_density) / 2) {
+                printf("@%s\n", predefined[next_random() % COUNT(predefined)]);
+            } else {
+                printf("@%u\n", next_random() % 32768);
+            }
+            continue;
+        }
+
+        uint32_t r = next_random();
+        switch (r % 4)
+        {
+        case 0:
+            printf("%s;%s\n", comps[r / 4 % COUNT(comps)], jumps[r / 128 % COUNT(jumps)]);
+            break;
+        case 1:
+            printf("    %s=%s // indented\n", dests[r / 4 % COUNT(dests)], comps[r / 32 % COUNT(comps)]);
+            break;
+        default:
+            printf("%s=%s\n", dests[r / 4 % COUNT(dests)], comps[r / 32 % COUNT(comps)]);
+        }
+    }
+
+    while (defined < labels) {
+        printf("(LOOP_%zu)\n", defined++);
+    }
+    printf("0;JMP\n");
+
+    return 0;
+}
+
+// xorshift64*, good enough for test data and the same everywhere.
+static uint32_t next_random(void)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+
+    return (uint32_t)((state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static double next_unit(void)
+{
+    return next_random() / 4294967296.0;
+}
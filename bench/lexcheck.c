@@ -0,0 +1,146 @@
+// lexcheck lexes random buffers with lex_line() and with lex_line_scalar(),
+// the reference, and fails on the first line they mark differently. The
+// buffers mix short and long lines, so lines straddle the 64-byte windows,
+// with CRLF endings, tabs, lone '/' and "//" pairs placed on both sides of
+// a window edge, and inputs that end without a newline.
+//
+//   bin/lexcheck [buffers] [seed]
+
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "../lex.h"
+
+#define MAX_BUFFER 1024
+
+static uint64_t state;
+
+static uint32_t next_random(void);
+static size_t fill(char *buffer);
+static int check(const char *buffer, size_t len, int reload);
+
+int main(int argc, char **argv)
+{
+    size_t buffers = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    state = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+    if (!state) state = 1;
+
+    char *buffer = malloc(MAX_BUFFER);
+    if (!buffer)
+    {
+        fprintf(stderr, "lexcheck: out of memory\n");
+        return 1;
+    }
+
+    for (size_t i = 0; i < buffers; i++)
+    {
+        // exactly the buffer's bytes, so reading past limit is reading
+        // past the allocation.
+        size_t len = fill(buffer);
+        char *exact = malloc(len ? len : 1);
+        if (!exact)
+        {
+            fprintf(stderr, "lexcheck: out of memory\n");
+            return 1;
+        }
+        memcpy(exact, buffer, len);
+
+        // the mapped input keeps its window from line to line, the stdio
+        // path loads a new one for every line.
+        int failed = check(exact, len, 0) || check(exact, len, 1);
+        free(exact);
+        if (failed)
+        {
+            fprintf(stderr, "lexcheck: buffer %zu of seed %s differs:\n%.*s\n", i, argc > 2 ? argv[2] : "1", (int)len, buffer);
+            free(buffer);
+            return 1;
+        }
+    }
+
+    free(buffer);
+    printf("lexcheck: %zu buffers, lex_line agrees with lex_line_scalar\n", buffers);
+
+    return 0;
+}
+
+// xorshift64
+static uint32_t next_random(void)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+
+    return (uint32_t)(state >> 32);
+}
+
+// fill writes a random program-like buffer and returns its length.
+static size_t fill(char *buffer)
+{
+    static const char alphabet[] = "@ADM01=;/ \t\r\nJMPGTELQ()_.$:-+!&|x";
+    size_t len = 0, base = 0;
+    size_t target = next_random() % MAX_BUFFER;
+
+    while (len < target)
+    {
+        size_t line = next_random() % 8 ? next_random() % 24 : next_random() % 300;
+        for (size_t i = 0; i < line && len < target; i++)
+        {
+            buffer[len++] = alphabet[next_random() % (sizeof(alphabet) - 1)];
+        }
+
+        if (len >= target) break;
+        if (next_random() % 4 == 0 && len + 1 < target) buffer[len++] = '\r';
+        buffer[len++] = '\n';
+        if (next_random() % 4 == 0) base = len;
+    }
+
+    // a lone '/' or a "//" pair at the edge of the window a line start
+    // loads, skipped when that edge is past the end.
+    char *edge = buffer + base + 63;
+    if (base + 64 < len)
+    {
+        switch (next_random() % 6)
+        {
+        case 0:
+            edge[0] = '/';
+            break;
+        case 1:
+            edge[1] = '/';
+            break;
+        case 2:
+            edge[0] = '/';
+            edge[1] = '/';
+            break;
+        case 3:
+            edge[0] = '/';
+            edge[1] = '\n';
+            break;
+        }
+    }
+
+    return len;
+}
+
+// check lexes every line of the len bytes at buffer both ways, reload
+// drops the window before each line.
+static int check(const char *buffer, size_t len, int reload)
+{
+    LexWindow w = { 0 };
+    LineLex lex, ref;
+
+    for (const char *c = buffer; c < buffer + len; c = lex.end + 1)
+    {
+        if (reload) w.base = NULL;
+
+        lex_line(&w, c, buffer + len, &lex);
+        lex_line_scalar(c, buffer + len, &ref);
+        if (memcmp(&lex, &ref, sizeof(LineLex)))
+        {
+            fprintf(stderr, "lexcheck: lines differ at byte %zu%s\n", (size_t)(c - buffer), reload ? " with a window per line" : "");
+            return 1;
+        }
+    }
+
+    return 0;
+}
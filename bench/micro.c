@@ -0,0 +1,206 @@
+// micro times the hot inner functions of the assembler on their own. It
+// includes code.c to reach its static functions, link it with every object
+// but main.o and code.o.
+
+#define _GNU_SOURCE
+#include<time.h>
+#include "../code.c"
+#include "../mnemonics.h"
+#include "../lex.h"
+
+#define KEYS 4096
+#define ROUNDS 2000
+
+static volatile uint32_t sink;
+
+static double now_ns(void);
+static void report(const char *name, double start, size_t ops);
+static void bench_symbol_table(void);
+static void bench_encode(void);
+static void bench_to_binary(void);
+static void bench_lex(void);
+
+int main(void)
+{
+    bench_symbol_table();
+    bench_encode();
+    bench_to_binary();
+    bench_lex();
+
+    return 0;
+}
+
+// bench_symbol_table covers hashing and probing through the public API:
+// filling a table, lookups of present keys and of missing ones.
+static void bench_symbol_table(void)
+{
+    static char keys[KEYS][24];
+    static char missing[KEYS][24];
+    for (size_t i = 0; i < KEYS; i++)
+    {
+        snprintf(keys[i], sizeof(keys[i]), "LOOP_%zu", i * 7919 % KEYS);
+        snprintf(missing[i], sizeof(missing[i]), "var_%zu", i);
+    }
+
+    double start = now_ns();
+    for (size_t round = 0; round < ROUNDS / 20; round++)
+    {
+        SymbolTable *t = symbol_table_init(NULL);
+        for (size_t i = 0; i < KEYS; i++) {
+            symbol_table_set(t, keys[i], (uint16_t)i);
+        }
+        symbol_table_free(t, 1);
+    }
+    report("symbol_table_set", start, (size_t)ROUNDS / 20 * KEYS);
+
+    SymbolTable *t = symbol_table_init(NULL);
+    for (size_t i = 0; i < KEYS; i++) {
+        symbol_table_set(t, keys[i], (uint16_t)i);
+    }
+
+    uint32_t sum = 0;
+    uint16_t val;
+    start = now_ns();
+    for (size_t round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < KEYS; i++)
+        {
+            if (symbol_table_get(t, keys[(i * 31 + round) % KEYS], &val)) sum += val;
+        }
+    }
+    report("symbol_table_get hit", start, (size_t)ROUNDS * KEYS);
+
+    start = now_ns();
+    for (size_t round = 0; round < ROUNDS; round++)
+    {
+        for (size_t i = 0; i < KEYS; i++) {
+            sum += symbol_table_get(t, missing[i], &val);
+        }
+    }
+    report("symbol_table_get miss", start, (size_t)ROUNDS * KEYS);
+
+    symbol_table_free(t, 1);
+    sink = sum;
+}
+
+// bench_encode runs the C-instruction encoder, the successor of lookup(),
+// over every comp with a rotating dest and jump.
+static void bench_encode(void)
+{
+    static Slice dests[8], comps[64], jumps[8];
+    size_t dest_count = 0, comp_count = 0, jump_count = 0;
+
+    for (int i = 0; destEntityTable[i].mnemonic; i++) {
+        dests[dest_count++] = (Slice){ destEntityTable[i].mnemonic, strlen(destEntityTable[i].mnemonic) };
+    }
+    for (int i = 0; computeEntityTable[i].mnemonic && comp_count < 64; i++) {
+        comps[comp_count++] = (Slice){ computeEntityTable[i].mnemonic, strlen(computeEntityTable[i].mnemonic) };
+    }
+    for (int i = 0; jumpEntityTable[i].mnemonic; i++) {
+        jumps[jump_count++] = (Slice){ jumpEntityTable[i].mnemonic, strlen(jumpEntityTable[i].mnemonic) };
+    }
+
+    uint32_t sum = 0;
+    uint16_t word;
+    size_t ops = 0;
+    double start = now_ns();
+    for (size_t round = 0; round < ROUNDS * 20; round++)
+    {
+        for (size_t i = 0; i < comp_count; i++, ops++)
+        {
+            encode_C_instruction(dests[(i + round) % dest_count], comps[i], jumps[(i + round) % jump_count], &word, NULL, 0);
+            sum += word;
+        }
+    }
+    report("encode_C_instruction", start, ops);
+
+    sink = sum;
+}
+
+static void bench_to_binary(void)
+{
+    char line[HACK_LINE_SIZE * 64];
+    uint32_t sum = 0;
+    size_t ops = 0;
+
+    double start = now_ns();
+    for (uint32_t round = 0; round < ROUNDS * 10; round++)
+    {
+        for (uint32_t i = 0; i < 64; i++, ops++) {
+            to_binary((uint16_t)(round * 64 + i), line + i * HACK_LINE_SIZE);
+        }
+        sum += (uint8_t)line[(round % 64) * HACK_LINE_SIZE + round % 16];
+    }
+    report("to_binary", start, ops);
+
+    sink = sum;
+}
+
+// bench_lex lexes a buffer of typical lines with the vector lexer and the
+// scalar reference, which have to mark every line the same.
+static void bench_lex(void)
+{
+    static const char *lines[] = {
+        "@1234", "D=M", "(LOOP_12)", "    AM=M-1 // pop", "@var_7", "D;JGT",
+        "// a comment line", "", "  M = D + 1  ", "0;JMP",
+    };
+    static char text[1 << 16];
+    size_t len = 0, count = 0;
+    for (size_t i = 0; len + 32 < sizeof(text); i++, count++) {
+        len += sprintf(text + len, "%s\n", lines[i * 7 % (sizeof(lines) / sizeof(lines[0]))]);
+    }
+
+    LexWindow w = { 0 };
+    LineLex lex, ref;
+    for (const char *c = text; c < text + len; c = lex.end + 1)
+    {
+        lex_line(&w, c, text + len, &lex);
+        lex_line_scalar(c, text + len, &ref);
+        if (memcmp(&lex, &ref, sizeof(LineLex)))
+        {
+            fprintf(stderr, "micro: lex_line and lex_line_scalar differ at byte %zu\n", (size_t)(c - text));
+            exit(1);
+        }
+    }
+
+    uint32_t sum = 0;
+    double start = now_ns();
+    for (size_t round = 0; round < ROUNDS / 10; round++)
+    {
+        w.base = NULL;
+        for (const char *c = text; c < text + len; c = lex.end + 1)
+        {
+            lex_line(&w, c, text + len, &lex);
+            sum += lex.eq - c;
+        }
+    }
+    report("lex_line", start, ROUNDS / 10 * count);
+
+    start = now_ns();
+    for (size_t round = 0; round < ROUNDS / 10; round++)
+    {
+        for (const char *c = text; c < text + len; c = lex.end + 1)
+        {
+            lex_line_scalar(c, text + len, &lex);
+            sum += lex.eq - c;
+        }
+    }
+    report("lex_line_scalar", start, ROUNDS / 10 * count);
+
+    sink = sum;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, double start, size_t ops)
+{
+    double elapsed = now_ns() - start;
+
+    printf("%-24s %8.2f ns/op %10.1f Mops/s\n", name, elapsed / ops, ops / elapsed * 1e3);
+}
@@ -0,0 +1,19 @@
+// builds the jump target 1 from constants in D, -O must not drop the
+// dead @100 that shifts its target.
+@100
+@R5
+M=M+1
+@R2
+MD=M+1
+D=D-1
+D=D-1
+D=D-1
+@END
+D;JGE
+D=1
+(BACK)
+A=D
+0;JMP
+(END)
+@END
+0;JMP
@@ -0,0 +1,19 @@
+// carries a numeric jump target in D over a label, -O must not move code.
+@9
+D=A
+@9
+D=A
+(L)
+A=D
+0;JMP
+@5
+D=A
+@R0
+M=D
+@33
+D=A
+@R0
+M=D
+(END)
+@END
+0;JMP
@@ -0,0 +1,21 @@
+// jumps to a label address it parked in RAM plus 2, -O must not move code.
+@TARGET
+D=A
+@2
+D=D+A
+@R13
+M=D
+(GO)
+@R13
+A=M
+0;JMP
+(TARGET)
+@TARGET
+@TARGET
+@7
+D=A
+@R0
+M=D
+(END)
+@END
+0;JMP
@@ -0,0 +1,29 @@
+// sums 1..10 into R0 with loads -O drops, its RAM has to stay the same.
+@i
+M=1
+@R0
+M=0
+(LOOP)
+@i
+D=M
+@i
+D=M
+@11
+D=D-A
+@END
+D;JGE
+@i
+D=M
+@R0
+M=D+M
+@i
+M=M+1
+M=M-1
+M=M+1
+@LOOP
+0;JMP
+@R1
+M=1
+(END)
+@END
+0;JMP
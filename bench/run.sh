@@ -0,0 +1,160 @@
+#!/bin/sh
+# run.sh assembles generated programs of each given size with both modes
+# and reports throughput, after checking RectL still assembles to its
+# golden output, the vector lexer agrees with the scalar one on random
+# input and -O keeps the RAM of the programs in bench/opt, then times the
+# emulator with and without its JIT and a batch of lanes in lockstep and
+# one by one, and last assembles many small files one process each and
+# through --serve. Run it through `make bench`.
+#
+#   bench/run.sh [instructions ...]
+#
+# LABELS and VARIABLES set the densities handed to gen_asm.
+
+set -e
+
+BIN=${BIN:-bin}
+LABELS=${LABELS:-0.05}
+VARIABLES=${VARIABLES:-0.2}
+WORK=$BIN/bench
+SIZES=${*:-1000 10000 100000 1000000}
+
+mkdir -p "$WORK"
+
+cp exmaple/RectL.asm "$WORK/RectL.asm"
+"$BIN/assembler" "$WORK/RectL.asm"
+if ! cmp -s "$WORK/RectL.hack" exmaple/RectL.hack; then
+    echo "bench: RectL.hack differs from exmaple/RectL.hack" >&2
+    exit 1
+fi
+
+# lexcheck exits non-zero on the first line the two lexers split apart.
+"$BIN/lexcheck"
+
+# -O has to leave every program in bench/opt with the RAM it leaves
+# without -O, whether it optimizes it or leaves it alone.
+for asm in bench/opt/*.asm; do
+    name=$(basename "$asm" .asm)
+    "$BIN/assembler" "$asm" -o "$WORK/$name.hack"
+    "$BIN/assembler" -O "$asm" -o "$WORK/$name.O.hack" 2> /dev/null
+    "$BIN/emulator" -n 1000000 --dump=0-63 "$WORK/$name.hack" 2>&1 | grep '^RAM' > "$WORK/$name.ram"
+    "$BIN/emulator" -n 1000000 --dump=0-63 "$WORK/$name.O.hack" 2>&1 | grep '^RAM' > "$WORK/$name.O.ram"
+    if ! cmp -s "$WORK/$name.ram" "$WORK/$name.O.ram"; then
+        echo "bench: -O changed what $asm leaves in RAM" >&2
+        exit 1
+    fi
+done
+
+printf '%-10s %-12s %12s %10s %14s %10s\n' instrs mode bytes ms lines/s MB/s
+for n in $SIZES; do
+    asm="$WORK/gen_$n.asm"
+    [ -f "$asm" ] || "$BIN/gen_asm" "$n" "$LABELS" "$VARIABLES" > "$asm"
+    lines=$(wc -l < "$asm")
+    bytes=$(wc -c < "$asm")
+
+    for mode in two-pass single-pass; do
+        flag=
+        [ "$mode" = single-pass ] && flag=--single-pass
+        ms=$("$BIN/assembler" --time $flag "$asm" 2>&1 | sed -n 's/.*: \([0-9.]*\) ms.*/\1/p')
+        awk -v n="$n" -v mode="$mode" -v bytes="$bytes" -v lines="$lines" -v ms="$ms" 'BEGIN {
+            printf "%-10s %-12s %12d %10.3f %14.0f %10.1f\n", n, mode, bytes, ms, lines / ms * 1000, bytes / ms / 1000
+        }'
+    done
+done
+
+echo
+"$BIN/micro"
+
+# the emulator runs bench/cpu.asm interpreted and on the JIT, both have to
+# leave the same RAM behind.
+cp bench/cpu.asm "$WORK/cpu.asm"
+printf '\n%-12s %14s %10s %14s\n' emulator instrs ms "M instrs/s"
+for mode in interpreter jit; do
+    flag=
+    [ "$mode" = jit ] && flag=--jit
+    "$BIN/emulator" --time $flag --dump=0-2047 "$WORK/cpu.asm" > "$WORK/cpu_$mode.ram" 2> "$WORK/cpu_$mode.log"
+    instrs=$(sed -n 's/.* after \([0-9]*\) instructions.*/\1/p' "$WORK/cpu_$mode.log")
+    ms=$(sed -n 's/^\([0-9.]*\) ms.*/\1/p' "$WORK/cpu_$mode.log")
+    awk -v mode="$mode" -v instrs="$instrs" -v ms="$ms" 'BEGIN {
+        printf "%-12s %14d %10.3f %14.1f\n", mode, instrs, ms, instrs / ms / 1000
+    }'
+done
+
+if ! cmp -s "$WORK/cpu_interpreter.ram" "$WORK/cpu_jit.ram"; then
+    echo "bench: the JIT left a different RAM than the interpreter" >&2
+    exit 1
+fi
+
+# bench/sort.asm sorts a vector of 150 to 200 random words in each of 1000
+# lanes, once in lockstep and once lane by lane; the dumps have to match.
+cp bench/sort.asm "$WORK/sort.asm"
+[ -f "$WORK/sort.lanes" ] || awk 'BEGIN {
+    srand(1)
+    for (lane = 0; lane < 1000; lane++) {
+        n = 150 + int(rand() * 51)
+        line = "0=" n
+        for (i = 0; i < n; i++) line = line " " 1024 + i "=" int(rand() * 32768) - 16384
+        print line
+    }
+}' > "$WORK/sort.lanes"
+printf '\n%-12s %14s %10s %14s\n' lanes instrs ms "M instrs/s"
+for mode in lockstep serial; do
+    flag=
+    [ "$mode" = serial ] && flag=--serial
+    "$BIN/emulator" --time $flag --lanes="$WORK/sort.lanes" --dump=1024-1223 "$WORK/sort.asm" > "$WORK/sort_$mode.ram" 2> "$WORK/sort_$mode.log"
+    sed -n "s/^[0-9]* lanes, \([0-9]*\) instructions, \([0-9.]*\) ms.*/\1 \2/p" "$WORK/sort_$mode.log" | awk -v mode="$mode" '{
+        printf "%-12s %14d %10.3f %14.1f\n", mode, $1, $2, $1 / $2 / 1000
+    }'
+done
+
+if ! cmp -s "$WORK/sort_lockstep.ram" "$WORK/sort_serial.ram"; then
+    echo "bench: the lockstep lanes ended differently from the serial ones" >&2
+    exit 1
+fi
+
+# 500 small programs assembled by one process each, as a build system
+# would, and then by a server started once with --serve; the outputs have
+# to match.
+FILES=500
+mkdir -p "$WORK/many/proc" "$WORK/many/serve"
+[ -f "$WORK/many/p.asm" ] || "$BIN/gen_asm" 200 "$LABELS" "$VARIABLES" > "$WORK/many/p.asm"
+i=1
+while [ $i -le $FILES ]; do
+    cp "$WORK/many/p.asm" "$WORK/many/proc/p$i.asm"
+    cp "$WORK/many/p.asm" "$WORK/many/serve/p$i.asm"
+    i=$((i + 1))
+done
+
+now_ms() {
+    date +%s%N | awk '{ printf "%.3f", $1 / 1000000 }'
+}
+
+printf '\n%-12s %10s %10s %14s\n' "$FILES files" ms "ms/file" files/s
+start=$(now_ms)
+for f in "$WORK"/many/proc/*.asm; do
+    "$BIN/assembler" "$f"
+done
+end=$(now_ms)
+awk -v s="$start" -v e="$end" -v n="$FILES" 'BEGIN { printf "%-12s %10.3f %10.3f %14.0f\n", "processes", e - s, (e - s) / n, n / (e - s) * 1000 }'
+
+SOCKET="$WORK/many/serve.sock"
+"$BIN/assembler" --serve "$SOCKET" -j 4 2> /dev/null &
+server=$!
+while [ ! -S "$SOCKET" ]; do sleep 0.05; done
+# one warm up job so the workers' buffers have grown.
+"$BIN/asmclient" "$SOCKET" "$WORK/many/serve/p1.asm"
+start=$(now_ms)
+"$BIN/asmclient" "$SOCKET" -j 4 "$WORK"/many/serve/*.asm
+end=$(now_ms)
+kill $server
+wait $server || true
+awk -v s="$start" -v e="$end" -v n="$FILES" 'BEGIN { printf "%-12s %10.3f %10.3f %14.0f\n", "server", e - s, (e - s) / n, n / (e - s) * 1000 }'
+
+i=1
+while [ $i -le $FILES ]; do
+    if ! cmp -s "$WORK/many/proc/p$i.hack" "$WORK/many/serve/p$i.hack"; then
+        echo "bench: the server wrote a different p$i.hack" >&2
+        exit 1
+    fi
+    i=$((i + 1))
+done
@@ -0,0 +1,71 @@
+// sort.asm is the workload of the batch benchmark: an insertion sort of
+// the R0 words at RAM[1024] in place, ascending. The words have to stay
+// within -16384..16383 so their differences do not overflow. Every
+// lane of a batch gets its own vector, so the lanes take different paths
+// through the inner loop.
+    @i
+    M=1
+(OUTER)
+    // while i < n
+    @i
+    D=M
+    @R0
+    D=D-M
+    @END
+    D;JGE
+    // key = a[i], j = i - 1
+    @i
+    D=M
+    @1024
+    A=D+A
+    D=M
+    @key
+    M=D
+    @i
+    D=M-1
+    @j
+    M=D
+(INNER)
+    // while j >= 0 and a[j] > key: a[j + 1] = a[j], j--
+    @j
+    D=M
+    @PLACE
+    D;JLT
+    @1024
+    A=D+A
+    D=M
+    @key
+    D=D-M
+    @PLACE
+    D;JLE
+    @j
+    D=M
+    @1024
+    A=D+A
+    D=M
+    A=A+1
+    M=D
+    @j
+    M=M-1
+    @INNER
+    0;JMP
+(PLACE)
+    // a[j + 1] = key, i++
+    @j
+    D=M
+    @1025
+    D=D+A
+    @pointer
+    M=D
+    @key
+    D=M
+    @pointer
+    A=M
+    M=D
+    @i
+    M=M+1
+    @OUTER
+    0;JMP
+(END)
+    @END
+    0;JMP
@@ -0,0 +1,288 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<limits.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include "./io.h"
+
+// asmclient sends files to an assembler started with --serve, see serve.c
+// for the protocol. By default the server reads and writes the files
+// itself; with --inline the client sends the source and writes the output
+// it gets back, for a server that can not see the client's files.
+
+typedef struct {
+    const char *name;
+    const char *ext;
+}Format;
+
+static const Format formats[] = {
+    { "hack", ".hack" }, { "bin", ".bin" }, { "ihex", ".hex" }, { "c", ".c" },
+};
+
+typedef struct {
+    const char *socket_path;
+    const Format *format;
+    int inline_source;
+    char **files;
+    size_t count;
+    size_t next;
+    size_t failed;
+    pthread_mutex_t lock;
+}Client;
+
+static void* run_client(void *arg);
+static int connect_socket(const char *socket_path);
+static int send_file(Client *client, int fd, FILE *in, const char *path);
+static int read_reply(FILE *in, const char *path, size_t *len);
+static char* read_file(const char *path, size_t *len);
+static int write_output(const char *path, const char *ext, FILE *in, size_t len);
+
+int main(int argc, char *argv[])
+{
+    Client client;
+    memset(&client, 0, sizeof(Client));
+    client.format = &formats[0];
+    pthread_mutex_init(&client.lock, NULL);
+
+    size_t connections = 1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--inline")) {
+            client.inline_source = 1;
+        } else if (!strncmp(argv[i], "--format=", 9)) {
+            client.format = NULL;
+            for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+                if (!strcmp(argv[i] + 9, formats[f].name)) client.format = &formats[f];
+            }
+            if (!client.format)
+            {
+                fprintf(stderr, "unknown output format: %s\n", argv[i] + 9);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            connections = strtoul(argv[++i], NULL, 10);
+        } else if (!client.socket_path) {
+            client.socket_path = argv[i];
+        } else {
+            client.files = argv + i;
+            client.count = argc - i;
+            break;
+        }
+    }
+
+    if (!client.socket_path || !client.count)
+    {
+        fprintf(stderr, "usage: asmclient SOCKET [--inline] [--format=hack|bin|ihex|c] [-j N] files...\n");
+        return 1;
+    }
+
+    if (connections < 1) connections = 1;
+    if (connections > client.count) connections = client.count;
+
+    pthread_t *threads = malloc(connections * sizeof(pthread_t));
+    if (!threads) return 1;
+
+    // every thread keeps one connection and takes the next file when its
+    // reply is in.
+    size_t started = 0;
+    for (; started < connections; started++) {
+        if (pthread_create(&threads[started], NULL, run_client, &client)) break;
+    }
+
+    if (!started) {
+        run_client(&client);
+    }
+
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    if (client.failed) {
+        fprintf(stderr, "%zu of %zu files failed\n", client.failed, client.count);
+    }
+
+    return client.failed ? 1 : 0;
+}
+
+static void* run_client(void *arg)
+{
+    Client *client = arg;
+    int fd = connect_socket(client->socket_path);
+    FILE *in = fd >= 0 ? fdopen(fd, "r") : NULL;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&client->lock);
+        size_t i = client->next < client->count ? client->next++ : client->count;
+        pthread_mutex_unlock(&client->lock);
+
+        if (i == client->count) break;
+
+        // without a connection every file left fails.
+        if (!in || send_file(client, fd, in, client->files[i]))
+        {
+            pthread_mutex_lock(&client->lock);
+            client->failed++;
+            pthread_mutex_unlock(&client->lock);
+        }
+    }
+
+    if (in) {
+        fclose(in);
+    } else if (fd >= 0) {
+        close(fd);
+    }
+
+    return NULL;
+}
+
+static int connect_socket(const char *socket_path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        fprintf(stderr, "Err connecting to %s: %s\n", socket_path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// send_file runs one job and waits for its reply.
+static int send_file(Client *client, int fd, FILE *in, const char *path)
+{
+    char header[PATH_MAX + 64];
+    size_t len = 0;
+
+    if (client->inline_source)
+    {
+        char *src = read_file(path, &len);
+        if (!src) return 1;
+
+        int n = snprintf(header, sizeof(header), "asm %s %zu\n", client->format->name, len);
+        int errnum = write_all(fd, header, n) || write_all(fd, src, len);
+        free(src);
+
+        if (errnum || read_reply(in, path, &len)) return 1;
+
+        return write_output(path, client->format->ext, in, len);
+    }
+
+    // the server has its own working directory.
+    char input[PATH_MAX];
+    if (!realpath(path, input))
+    {
+        fprintf(stderr, "can not open file:%s\n", path);
+        return 1;
+    }
+
+    int n = snprintf(header, sizeof(header), "file %s %zu 0\n", client->format->name, strlen(input));
+    if (write_all(fd, header, n) || write_all(fd, input, strlen(input))) return 1;
+
+    return read_reply(in, path, &len);
+}
+
+// read_reply reads the reply header, printing the errors of a failed job.
+static int read_reply(FILE *in, const char *path, size_t *len)
+{
+    char line[256];
+    size_t count = 0;
+
+    if (!fgets(line, sizeof(line), in))
+    {
+        fprintf(stderr, "%s: the server hung up\n", path);
+        return 1;
+    }
+
+    if (sscanf(line, "ok %zu", len) == 1) return 0;
+
+    if (sscanf(line, "error %zu", &count) != 1)
+    {
+        fprintf(stderr, "%s: bad reply: %s", path, line);
+        return 1;
+    }
+
+    for (size_t i = 0; i < count && fgets(line, sizeof(line), in); i++) {
+        fprintf(stderr, "%s:%s", path, line);
+    }
+
+    return 1;
+}
+
+static char* read_file(const char *path, size_t *len)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", path);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char *src = size >= 0 ? malloc(size + 1) : NULL;
+    if (src && fread(src, 1, size, file) != (size_t)size)
+    {
+        free(src);
+        src = NULL;
+    }
+    fclose(file);
+
+    *len = src ? size : 0;
+
+    return src;
+}
+
+// write_output copies len bytes of the reply next to path, with its
+// extension replaced by ext.
+static int write_output(const char *path, const char *ext, FILE *in, size_t len)
+{
+    char name[PATH_MAX];
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    int base = dot && (!slash || dot > slash) ? (int)(dot - path) : (int)strlen(path);
+    snprintf(name, sizeof(name), "%.*s%s", base, path, ext);
+
+    FILE *out = fopen(name, "wb");
+    char buffer[64 * 1024];
+    int errnum = !out;
+
+    while (len)
+    {
+        size_t chunk = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (fread(buffer, 1, chunk, in) != chunk)
+        {
+            // the server went away mid reply, leave no truncated output.
+            if (out)
+            {
+                fclose(out);
+                remove(name);
+            }
+            return 1;
+        }
+        if (out && fwrite(buffer, 1, chunk, out) != chunk) errnum = 1;
+        len -= chunk;
+    }
+
+    if (out && fclose(out)) errnum = 1;
+    if (errnum) {
+        fprintf(stderr, "can not write file:%s\n", name);
+    }
+
+    return errnum;
+}
+
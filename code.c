@@ -1,10 +1,29 @@
+#define _GNU_SOURCE
 #include<stdio.h>
+#include<stdint.h>
 #include<stdlib.h>
 #include <ctype.h>
+#include<string.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
 #include "./parser.h"
 #include"./table.h"
-#include <errno.h>
-#include<string.h>
+#include "./ir.h"
+#include "./opt.h"
+#include "./pool.h"
+#include "./arena.h"
+#include "./stats.h"
+#include "./code.h"
+#include "./hack.h"
+#include "./aot.h"
+#include "./diag.h"
+#include "./obj.h"
+#include "./io.h"
+#include "encode_tables.h"
 
 #define Uint16_MAX  (1 << 15)
 
@@ -29,111 +48,569 @@
 #define R14 14
 #define R15 15
 
-#define SCREEN 16384
-#define KBD 24576 
 #define SP 0
 #define LCL 1
 #define ARG 2
 #define THIS 3
 #define THAT 4
 
-typedef struct
+// defined value of a symbol code_emit_label_ref() used before its label.
+#define LABEL_PENDING 2
+// defined value of a symbol an object linked by assemble_objects() made a
+// label, so a second one is caught.
+#define LINK_LABEL 3
+
+// programs smaller than this are encoded by a single thread.
+#define ENCODE_CHUNK_MIN 65536
+// inputs are scanned in chunks of at least this many bytes.
+#define SCAN_CHUNK_MIN (1 << 20)
+// scan_parallel() returns SCAN_SERIAL when the input has to be scanned by
+// scan() after all.
+#define SCAN_SERIAL -2
+// how a chunk saw one of its symbols, kept in the defined array of its IR.
+#define SCAN_REFERENCED 1
+#define SCAN_LABEL_FIRST 2
+#define SCAN_LABEL_DEFINED 4
+#define HACK_LINE_SIZE 17
+
+struct Code
 {
     Parser *parser;
     SymbolTable *table;
+    IR *ir;
     uint16_t next_ram_free_slot;
+    char *input_name;
+    // output_name overrides the file next to the input, "-" is stdout as
+    // is an input named "-".
+    const char *output_name;
     FILE *output;
-}Code;
-
-struct TableEntity{
-    char* mnemonic;
-    char* bits; 
+    CodeOptions options;
+    // everything of the run but the IR comes from arena when there is one,
+    // the IR's arrays are charged to it.
+    Arena *arena;
+    Stats *stats;
+    Diagnostics *diag;
+    // set by code_set_output_buffer(), the output goes there instead of a
+    // file. out_size counts on past out_capacity when it does not fit.
+    int to_buffer;
+    char *out_data;
+    size_t out_capacity;
+    size_t out_size;
+    // what the peephole pass did, see code_optimized().
+    int opt_status;
+    size_t opt_removed;
+    // lines read by scan_parallel(), which leaves the parser at its start.
+    size_t scanned_lines;
 };
 
-static const struct TableEntity destEntityTable[] = {
-    {"",    "000"}, {"M",   "001"}, {"D",   "010"},
-    {"MD",  "011"}, {"A",   "100"}, {"AM",  "101"},
-    {"AD",  "110"}, {"AMD", "111"}, {NULL, NULL}
-};
-
-static const struct TableEntity computeEntityTable[] = {
-    {"0", "101010"}, {"1", "111111"}, {"-1", "111010"},
-    {"D", "001100"}, {"A", "110000"}, {"M", "110000"},
-    {"!D", "001101"}, {"!A", "110001"}, {"!M", "110001"},
-    {"-D", "001111"}, {"-A", "110011"}, {"-M", "110011"},
-    {"D+1", "011111"}, {"A+1", "110111"}, {"M+1", "110111"},
-    {"D-1", "001110"}, {"A-1", "110010"}, {"M-1", "110010"},
-    {"D+A", "000010"}, {"D+M", "000010"}, {"D-A", "010011"},
-    {"D-M", "010011"}, {"A-D", "000111"}, {"M-D", "000111"},
-    {"D&A", "000000"}, {"D&M", "000000"}, {"D|A", "010101"},
-    {"D|M", "010101"}, {NULL, NULL}
-};
+// EncodeChunk is a contiguous range of IR entries encoded by one thread
+// straight into the mapped output, rom_start is where its first word goes.
+typedef struct
+{
+    IR *ir;
+    char *output;
+    size_t start;
+    size_t end;
+    size_t rom_start;
+    size_t rom_count;
+}EncodeChunk;
+
+// ScanChunk is a run of whole lines scanned by one thread into an IR of
+// its own, whose symbol ids are local to the chunk until map turns them
+// into the ids of the program's IR.
+typedef struct
+{
+    const char *data;
+    size_t len;
+    IR *ir;
+    size_t lines;
+    int status;
+    uint32_t *map;
+    IR *program;
+    size_t start;
+    size_t line_start;
+}ScanChunk;
+
+// Fixup is a ROM word of the single pass that loads a symbol, by its IR
+// id, patched once the whole input has been read.
+typedef struct
+{
+    size_t index;
+    uint32_t symbol;
+}Fixup;
 
-static const struct TableEntity jumpEntityTable[] = {
-    {"",    "000"}, {"JGT", "001"}, {"JEQ", "010"},
-    {"JGE", "011"}, {"JLT", "100"}, {"JNE", "101"},
-    {"JLE", "110"}, {"JMP", "111"}, {NULL, NULL}
-};
+// LinkLabel is a label of the object being linked, by ROM offset.
+typedef struct
+{
+    uint32_t offset;
+    uint32_t id;
+}LinkLabel;
 
-static SymbolTable* init_symbol_table_with_values(void);
+static SymbolTable* init_symbol_table_with_values(Arena *arena);
 static int scan(Code *code);
+static int scan_parallel(Code *code, const char *data, size_t len);
+static void scan_chunk(void *arg);
+static void copy_chunk(void *arg);
+static void free_scan_chunks(ScanChunk *work, size_t chunks);
+static int finish(Code *c, int errnum);
+static int link_object(Code *code, const char *path);
+static int compare_labels(const void *a, const void *b);
 static int generate(Code *code);
+static int generate_mapped(Code *code);
+static void count_chunk(void *arg);
+static void encode_chunk(void *arg);
+static void free_pool(Code *code, Pool *pool);
 void free_code(Code *c);
-static int generate_A_instruction(SymbolTable *table, const char* symbol, char bitsBuffer[17]);
-static void generate_C_instruction(const char* dest, const char* comp, const char* jump, char bitsBuffer[17]);
-static int to_uint16(const char* s, uint16_t *target);
-static void to_binary(uint16_t number, char *output);
-static const char* lookup(const struct TableEntity table[], const char* key);
-static char* change_file_extention(const char* filename);
-
-Code* init_code(Parser *parser, const char* filename)
+static uint32_t intern_symbol(Code *code, Slice sym);
+static int encode_C_instruction(Slice dest, Slice comp, Slice jump, uint16_t *target, Diagnostics *diag, size_t line);
+static void* code_alloc(Code *code, size_t size);
+static void code_release(Code *code, void *ptr);
+static void collect_stats(Code *code);
+static int open_output(Code *code);
+static int write_words(Code *code, const uint16_t *words, size_t count);
+static int write_object(Code *code);
+static int write_buffer(Code *code, const char *buffer, size_t size);
+static size_t format_hack(const uint16_t *words, size_t count, char *out);
+static size_t format_bin(const uint16_t *words, size_t count, int little_endian, char *out);
+static size_t format_ihex(const uint16_t *words, size_t count, int little_endian, char *out);
+static size_t ihex_record(char *out, uint8_t type, uint16_t address, const uint8_t *data, size_t len);
+static ssize_t buffer_write(void *cookie, const char *data, size_t size);
+static int output_fits(Code *code);
+static int output_mappable(Code *code);
+static int to_uint16(Slice s, uint16_t *target);
+static inline void to_binary(uint16_t number, char *output);
+static char* change_file_extention(const char* filename, const char* ext);
+
+// init_code prepares assembling parser's input, the output file is opened
+// once the program is known to assemble since its extension depends on the
+// output format. With an arena the run allocates from it and free_code()
+// leaves releasing it to the caller. parser is NULL for a front end that
+// builds the program with the code_emit_ functions.
+Code* init_code(Parser *parser, const char* filename, Arena *arena)
 {   
-    char* fname = change_file_extention(filename);
-    if (!fname) {
-        fprintf(stderr, "cant rename file");
-        return NULL; 
+    Code* c = arena ? arena_alloc(arena, sizeof(Code)) : malloc(sizeof(Code));
+    if (!c){
+       return NULL;
     }
 
-    FILE *outfile = fopen(fname, "w");
-    if (!outfile) {
-        fprintf(stderr, "can not open file:%s", fname);
-        free(fname);
+    c->arena = arena;
+    c->input_name = arena ? arena_strndup(arena, filename, strlen(filename)) : strdup(filename);
+    c->table = init_symbol_table_with_values(arena);
+    c->ir = ir_init();
+    if (!c->ir || !c->input_name || !c->table) {
+        symbol_table_free(c->table, 1);
+        ir_free(c->ir);
+        code_release(c, c->input_name);
+        code_release(c, c);
         return NULL;
     }
 
-    free(fname);
-
-    Code* c = malloc(sizeof(Code));
-    if (!c){
-       return NULL;
-    }
-
-    c->table = init_symbol_table_with_values();
     c->parser = parser;
+    c->ir->budget = arena;
     c->next_ram_free_slot = R15 + 1;
-    c->output = outfile;
+    c->output_name = NULL;
+    c->output = NULL;
+    c->stats = NULL;
+    c->diag = NULL;
+    c->to_buffer = 0;
+    c->out_data = NULL;
+    c->out_capacity = 0;
+    c->out_size = 0;
+    c->opt_status = OPT_OK;
+    c->opt_removed = 0;
+    c->scanned_lines = 0;
+    memset(&c->options, 0, sizeof(CodeOptions));
 
     return c;
 }
 
+void code_set_options(Code *c, const CodeOptions *options)
+{
+    c->options = *options;
+}
+
+// code_set_stats makes the run record its figures in stats, NULL turns
+// it off again.
+void code_set_stats(Code *c, Stats *stats)
+{
+    c->stats = stats;
+}
+
+// code_set_diagnostics sends the errors of the run, the parser's too, to
+// diag instead of stderr.
+void code_set_diagnostics(Code *c, Diagnostics *diag)
+{
+    c->diag = diag;
+    if (c->parser) {
+        parser_set_diagnostics(c->parser, diag);
+    }
+}
+
+// code_set_output_name writes the output to name instead of the file next
+// to the input, "-" writes it to stdout.
+void code_set_output_name(Code *c, const char *name)
+{
+    c->output_name = name;
+}
+
+// code_set_output_buffer makes the run write its output to the capacity
+// bytes at buffer instead of a file next to the input.
+void code_set_output_buffer(Code *c, char *buffer, size_t capacity)
+{
+    c->to_buffer = 1;
+    c->out_data = buffer;
+    c->out_capacity = capacity;
+    c->out_size = 0;
+}
+
+// code_output_size is the size of the output written to the buffer, or
+// the size it needs after a CODE_NO_SPACE.
+size_t code_output_size(Code *c)
+{
+    return c->out_size;
+}
+
+// code_optimized returns the OPT_ status of the peephole pass, with the
+// instructions it removed and the ROM size left.
+int code_optimized(Code *c, size_t *removed, size_t *rom_size)
+{
+    *removed = c->opt_removed;
+    *rom_size = c->ir->rom_size;
+
+    return c->opt_status;
+}
+
 int assemble(Code *c) {
-    int errnum;
-    
-    errnum = scan(c);
-    if (errnum && errnum != PARSE_EOF) {
-        free_code(c);
-        // delete file;
-        return errnum;
+    stats_phase_begin(c->stats, PHASE_SCAN);
+
+    return finish(c, scan(c));
+}
+
+// assemble_emitted generates the program a front end built with the
+// code_emit_ functions instead of the parser's input.
+int assemble_emitted(Code *c) {
+    return finish(c, 0);
+}
+
+// assemble_objects links the objects -c wrote for files into one program
+// and generates it like an assembled one, so -O and every output format
+// apply. The objects are laid out in order, which gives the ROM and the
+// RAM slots of assembling their sources as one file; a label defined by
+// two of them is an error instead of the later one winning.
+int assemble_objects(Code *c, const char *const *files, size_t count)
+{
+    int errnum = 0;
+
+    stats_phase_begin(c->stats, PHASE_SCAN);
+    for (size_t i = 0; i < count && !errnum; i++) {
+        errnum = link_object(c, files[i]);
+    }
+
+    return finish(c, errnum);
+}
+
+// link_object appends the object at path to the IR. Its symbols are
+// interned in the IR's hash index once each, the way scan_parallel()
+// merges a chunk, and its words go in with the relocated ones turned back
+// into symbol references.
+static int link_object(Code *code, const char *path)
+{
+    IR *ir = code->ir;
+    Object obj;
+    int errnum = UNEXPECTED;
+
+    int status = obj_read(path, &obj);
+    if (status)
+    {
+        if (status == OBJ_IO) {
+            diag_report(code->diag, 0, "can not open file:%s", path);
+        } else if (status == OBJ_BAD) {
+            diag_report(code->diag, 0, "Err %s: not a Hack object", path);
+        } else {
+            diag_report(code->diag, 0, "Err out of memory");
+        }
+        return UNEXPECTED;
+    }
+
+    uint32_t *map = malloc((obj.symbol_count + 1) * sizeof(uint32_t));
+    LinkLabel *labels = malloc((obj.symbol_count + 1) * sizeof(LinkLabel));
+    size_t label_count = 0;
+    if (!map || !labels || ir_reserve(ir, (size_t)obj.word_count + obj.symbol_count))
+    {
+        diag_report(code->diag, 0, "Err out of memory");
+        goto done;
+    }
+
+    for (uint32_t i = 0; i < obj.symbol_count; i++)
+    {
+        ObjSymbol *s = &obj.symbols[i];
+        Slice sym = { obj.names + s->name, s->len };
+
+        uint32_t id = intern_symbol(code, sym);
+        if (id == IR_NO_SYMBOL)
+        {
+            diag_report(code->diag, 0, "Err out of memory");
+            goto done;
+        }
+        map[i] = id;
+
+        // the first object to see a symbol decides whether it takes a RAM
+        // slot, as its first use would in scan().
+        if (!ir->defined[id])
+        {
+            if (s->flags & OBJ_VARIABLE) {
+                ir->values[id] = code->next_ram_free_slot++;
+            }
+            ir->defined[id] = 1;
+        }
+
+        if (s->flags & OBJ_LABEL)
+        {
+            if (ir->defined[id] == LINK_LABEL)
+            {
+                diag_report(code->diag, 0, "Err %s: label %.*s is defined by an earlier object", path, (int)sym.len, sym.ptr);
+                goto done;
+            }
+
+            ir->values[id] = ir->rom_size + s->value;
+            ir->defined[id] = LINK_LABEL;
+            labels[label_count].offset = s->value;
+            labels[label_count++].id = id;
+        }
+    }
+
+    qsort(labels, label_count, sizeof(LinkLabel), compare_labels);
+
+    // ir_push() can not fail, the room was reserved above.
+    size_t l = 0, r = 0, w = 0;
+    for (uint32_t i = 0; i < obj.word_count; i++)
+    {
+        for (; l < label_count && labels[l].offset == i; l++) {
+            ir_push(ir, IR_LABEL, labels[l].id, 0);
+        }
+
+        uint16_t word = obj.words[i];
+        if (r < obj.reloc_count && obj.relocs[r].word == i) {
+            ir_push(ir, IR_A_SYMBOL, map[obj.relocs[r++].symbol], 0);
+        } else if (w < obj.wide_count && obj.wide[w] == i) {
+            ir_push(ir, IR_A_CONST, word, 0);
+            w++;
+        } else {
+            ir_push(ir, word & 0x8000 ? IR_C : IR_A_CONST, word, 0);
+        }
+    }
+
+    for (; l < label_count; l++) {
+        ir_push(ir, IR_LABEL, labels[l].id, 0);
+    }
+
+    errnum = 0;
+
+done:
+    free(map);
+    free(labels);
+    obj_free(&obj);
+
+    return errnum;
+}
+
+static int compare_labels(const void *a, const void *b)
+{
+    uint32_t x = ((const LinkLabel*)a)->offset;
+    uint32_t y = ((const LinkLabel*)b)->offset;
+
+    return (x > y) - (x < y);
+}
+
+// finish runs the optional peephole pass and generates the IR once the
+// front end ended with errnum.
+static int finish(Code *c, int errnum)
+{
+    IR *ir = c->ir;
+    for (uint32_t id = 0; id < ir->symbol_count && (!errnum || errnum == PARSE_EOF); id++)
+    {
+        if (ir->defined[id] == LABEL_PENDING)
+        {
+            size_t len;
+            const char *name = ir_symbol_name(ir, id, &len);
+            diag_report(c->diag, 0, "undefined label: %.*s", (int)len, name);
+            errnum = UNEXPECTED;
+        }
+    }
+
+    if ((!errnum || errnum == PARSE_EOF) && c->options.optimize)
+    {
+        c->opt_status = opt_peephole(c->ir, &c->opt_removed);
+        if (c->opt_status == OPT_NO_MEMORY)
+        {
+            diag_report(c->diag, 0, "Err out of memory");
+            errnum = UNEXPECTED;
+        }
     }
+    if (!errnum || errnum == PARSE_EOF) {
+        stats_phase_begin(c->stats, PHASE_GENERATE);
+        errnum = generate(c);
+    }
+
+    collect_stats(c);
 
-    errnum = generate(c);
     if (errnum && errnum != PARSE_EOF) {
-        free_code(c);
         // delete file;
         return errnum;
     }
 
-    return 0;
+    return output_fits(c);
+}
+
+// assemble_single_pass reads the input once, encoding every instruction as
+// it is parsed. Symbols are interned into the IR, which keeps the RAM slot
+// of those first used before any definition, and every reference is
+// recorded as a fixup patched with the symbol's final value when the input
+// is exhausted: a label defined again, or over a predefined symbol like R0,
+// takes its last definition everywhere, so the output is the same as the
+// scan/generate path.
+int assemble_single_pass(Code *c) {
+    IR *ir = c->ir;
+    uint16_t *words = NULL;
+    size_t words_count = 0, words_cap = 0;
+    Fixup *fixups = NULL;
+    size_t fixups_count = 0, fixups_cap = 0;
+    int errnum = 0;
+
+    stats_phase_begin(c->stats, PHASE_SCAN);
+    reset(c->parser);
+
+    while(hasMoreLines(c->parser))
+    {
+        int result = advance(c->parser);
+        if (result == PARSE_EOF) break;
+        if (result != PARSE_OK) {
+            errnum = result;
+            goto done;
+        }
+
+        instruction_type instyp = instructionType(c->parser);
+        if (c->stats) {
+            c->stats->types[instyp]++;
+        }
+
+        if (instyp == L_INSTRUCTION)
+        {
+            Slice sym = symbol_slice(c->parser);
+
+            if (symbol_table_setn(c->table, sym.ptr, sym.len, current_line_number(c->parser))) {
+                diag_report(c->diag, 0, "Err out of memory growing the symbol table");
+                errnum = UNEXPECTED;
+                goto done;
+            }
+            continue;
+        }
+
+        if (words_count == words_cap)
+        {
+            words_cap = words_cap ? words_cap * 2 : 1024;
+            uint16_t *grown = realloc(words, words_cap * sizeof(uint16_t));
+            if (!grown) {
+                errnum = UNEXPECTED;
+                goto done;
+            }
+            words = grown;
+        }
+
+        if (instyp == C_INSTRUCTION)
+        {
+            if (encode_C_instruction(dest_slice(c->parser), comp_slice(c->parser), jump_slice(c->parser), &words[words_count],
+                    c->diag, current_source_line(c->parser))) {
+                errnum = UNEXPECTED;
+                goto done;
+            }
+            words_count++;
+            continue;
+        }
+
+        Slice sym = symbol_slice(c->parser);
+        uint16_t val;
+        int perr = to_uint16(sym, &val);
+        if (perr == OVERFLOW_ERR)
+        {
+            size_t line = current_source_line(c->parser);
+            diag_report(c->diag, line, "Err overflow on line: %zu", line);
+            errnum = OVERFLOW_ERR;
+            goto done;
+        }
+
+        // a symbol takes a RAM slot when its first use comes before any
+        // definition, which a label defined later still overrides.
+        if (perr == NOT_NUMBER)
+        {
+            int created;
+            uint32_t id = ir_intern(ir, sym.ptr, sym.len, &created);
+            if (id == IR_NO_SYMBOL)
+            {
+                diag_report(c->diag, 0, "Err out of memory growing the symbol table");
+                errnum = UNEXPECTED;
+                goto done;
+            }
+
+            if (created && !symbol_table_getn(c->table, sym.ptr, sym.len, &val)) {
+                ir->values[id] = c->next_ram_free_slot++;
+            }
+
+            if (fixups_count == fixups_cap)
+            {
+                fixups_cap = fixups_cap ? fixups_cap * 2 : 256;
+                Fixup *grown = realloc(fixups, fixups_cap * sizeof(Fixup));
+                if (!grown) {
+                    errnum = UNEXPECTED;
+                    goto done;
+                }
+                fixups = grown;
+            }
+
+            fixups[fixups_count].index = words_count;
+            fixups[fixups_count].symbol = id;
+            fixups_count++;
+        }
+
+        words[words_count++] = val;
+    }
+
+    stats_phase_begin(c->stats, PHASE_GENERATE);
+
+    // the last label or the predefined value wins over a RAM slot.
+    for (uint32_t id = 0; id < ir->symbol_count; id++)
+    {
+        size_t len;
+        const char *name = ir_symbol_name(ir, id, &len);
+        symbol_table_getn(c->table, name, len, &ir->values[id]);
+    }
+
+    for (size_t i = 0; i < fixups_count; i++) {
+        words[fixups[i].index] = ir->values[fixups[i].symbol];
+    }
+
+    stats_phase_begin(c->stats, PHASE_OUTPUT);
+    if (open_output(c)) {
+        errnum = UNEXPECTED;
+        goto done;
+    }
+
+    stats_phase_begin(c->stats, PHASE_GENERATE);
+    errnum = write_words(c, words, words_count);
+    if (!errnum) {
+        errnum = output_fits(c);
+    }
+
+done:
+    if (c->stats) {
+        c->stats->instructions = words_count;
+    }
+    collect_stats(c);
+
+    free(fixups);
+    free(words);
+
+    return errnum;
 }
 
 void free_code(Code *c) {
@@ -143,52 +620,77 @@ void free_code(Code *c) {
 
     free_parser(c->parser);
 
-    symbol_table_free(c->table, 0);
+    symbol_table_free(c->table, 1);
+    ir_free(c->ir);
 
-    if (c->output) {
+    if (c->output == stdout) {
+        fflush(stdout);
+    } else if (c->output) {
         fclose(c->output);
     }
+
+    code_release(c, c->input_name);
+    code_release(c, c);
 }
 
-static SymbolTable* init_symbol_table_with_values(void)
-{
-    SymbolTable* st = symbol_table_init();
-
-    symbol_table_set(st, "R0", R0);
-    symbol_table_set(st, "R1", R1);
-    symbol_table_set(st, "R2", R2);
-    symbol_table_set(st, "R3", R3);
-    symbol_table_set(st, "R4", R4);
-    symbol_table_set(st, "R5", R5);
-    symbol_table_set(st, "R6", R6);
-    symbol_table_set(st, "R7", R7);
-    symbol_table_set(st, "R8", R8);
-    symbol_table_set(st, "R9", R9);
-    symbol_table_set(st, "R10", R10);
-    symbol_table_set(st, "R11", R11);
-    symbol_table_set(st, "R12", R12);
-    symbol_table_set(st, "R13", R13);
-    symbol_table_set(st, "R14", R14);
-    symbol_table_set(st, "R15", R15);
-    symbol_table_set(st, "SCREEN", SCREEN);
-    symbol_table_set(st, "KBD", KBD);
-    symbol_table_set(st, "SP", SP);
-    symbol_table_set(st, "LCL", LCL);
-    symbol_table_set(st, "ARG", ARG);
-    symbol_table_set(st, "THIS", THIS);
-    symbol_table_set(st, "THAT", THAT);
+static SymbolTable* init_symbol_table_with_values(Arena *arena)
+{
+    SymbolTable* st = symbol_table_init(arena);
+    if (!st) return NULL;
+
+    int failed = 0;
+    failed |= symbol_table_set(st, "R0", R0);
+    failed |= symbol_table_set(st, "R1", R1);
+    failed |= symbol_table_set(st, "R2", R2);
+    failed |= symbol_table_set(st, "R3", R3);
+    failed |= symbol_table_set(st, "R4", R4);
+    failed |= symbol_table_set(st, "R5", R5);
+    failed |= symbol_table_set(st, "R6", R6);
+    failed |= symbol_table_set(st, "R7", R7);
+    failed |= symbol_table_set(st, "R8", R8);
+    failed |= symbol_table_set(st, "R9", R9);
+    failed |= symbol_table_set(st, "R10", R10);
+    failed |= symbol_table_set(st, "R11", R11);
+    failed |= symbol_table_set(st, "R12", R12);
+    failed |= symbol_table_set(st, "R13", R13);
+    failed |= symbol_table_set(st, "R14", R14);
+    failed |= symbol_table_set(st, "R15", R15);
+    failed |= symbol_table_set(st, "SCREEN", SCREEN);
+    failed |= symbol_table_set(st, "KBD", KBD);
+    failed |= symbol_table_set(st, "SP", SP);
+    failed |= symbol_table_set(st, "LCL", LCL);
+    failed |= symbol_table_set(st, "ARG", ARG);
+    failed |= symbol_table_set(st, "THIS", THIS);
+    failed |= symbol_table_set(st, "THAT", THAT);
+
+    if (failed)
+    {
+        symbol_table_free(st, 1);
+        return NULL;
+    }
 
     return st;
 }
 
+// scan reads the source once and builds the IR: A-instructions with a
+// number and C-instructions are encoded right away, symbols are interned
+// and get their RAM slot on first use the way the symbol table used to.
 static int scan(Code *code)
 {   
+    const char *data;
+    size_t len;
+
+    if (code->options.scan_threads > 1 && parser_input(code->parser, &data, &len))
+    {
+        int errnum = scan_parallel(code, data, len);
+        if (errnum != SCAN_SERIAL) return errnum;
+    }
+
     reset(code->parser);
 
     int result;
     instruction_type instyp;
-    const char* symbol_ptr;
-    uint16_t val;
+    uint32_t line;
     int errnum;
 
     while(hasMoreLines(code->parser))
@@ -202,210 +704,1052 @@ static int scan(Code *code)
         if (instyp == INVALID) { 
             return -1;
         }
+
+        line = current_source_line(code->parser);
         
-        if (instyp == A_INSTRUCTION)
-        {
-            symbol_ptr = symbol(code->parser);
-            errnum = to_uint16(symbol_ptr, &val);
-            if (errnum == OVERFLOW_ERR)
-            {
-                fprintf(stderr, "Err overflow on line: %zu\n", current_line_number(code->parser));
-                return OVERFLOW_ERR;
-            }
+        if (instyp == A_INSTRUCTION) {
+            errnum = code_emit_a(code, symbol_slice(code->parser), line);
+        } else if (instyp == L_INSTRUCTION) {
+            errnum = code_emit_label(code, symbol_slice(code->parser), line);
+        } else {
+            errnum = code_emit_c(code, dest_slice(code->parser), comp_slice(code->parser), jump_slice(code->parser), line);
+        }
 
-            // if already doesnt exist to handle reserve keyboards and L_instructions.
-            if (errnum == NOT_NUMBER && !symbol_table_get(code->table, symbol_ptr, &val))
-            { 
-                symbol_table_set(code->table, symbol_ptr, code->next_ram_free_slot);
-                code->next_ram_free_slot++;
-            }
-        }else if (instyp == L_INSTRUCTION)
-        {   
-            symbol_ptr = symbol(code->parser);
-            size_t cln = current_line_number(code->parser);
-            symbol_table_set(code->table, symbol_ptr, cln);
+        if (errnum) {
+            return errnum;
         }
     }
 
     return 0;
 }
 
-static int generate(Code *code)
+// scan_parallel builds the same IR as scan() from an input held in memory:
+// the chunks are scanned on their own threads, then merged in order so
+// symbols are interned and given RAM slots in the order scan() would give
+// them, and labels get the ROM words of the chunks before them added.
+// Inputs that are too small, or where a chunk hit an error, are left to
+// scan() so the errors are reported the way they always are.
+static int scan_parallel(Code *code, const char *data, size_t len)
 {
-    reset(code->parser);
+    size_t threads = code->options.scan_threads;
+    size_t chunks = len / SCAN_CHUNK_MIN;
+    if (chunks > threads * 4) chunks = threads * 4;
+    if (chunks < 2) return SCAN_SERIAL;
 
-    int result;
-    instruction_type instyp;
-    const char* symbol_ptr;
-    const char* dest_ptr;
-    const char* comp_prt;
-    const char* jum_prt;
-    int errnum;
-    char bitsBufer[17];
+    ScanChunk *work = calloc(chunks, sizeof(ScanChunk));
+    if (!work) return SCAN_SERIAL;
 
-    while(hasMoreLines(code->parser))
+    // every chunk but the last ends with a newline.
+    size_t start = 0;
+    for (size_t i = 0; i < chunks; i++)
     {
-        result = advance(code->parser);
-        if (result != PARSE_OK)
-        {
-            return result;
-        }
-
-        instyp = instructionType(code->parser);
-        if (instyp == A_INSTRUCTION) {
-            symbol_ptr = symbol(code->parser); 
-            errnum = generate_A_instruction(code->table, symbol_ptr, bitsBufer);
-            if (errnum == UNEXPECTED) {
-                return UNEXPECTED;
-            }
-            fprintf(code->output,"%s\n", bitsBufer);
-        }
-        else if (instyp == C_INSTRUCTION) {
-            dest_ptr = dest(code->parser);
-            comp_prt = comp(code->parser);
-            jum_prt = jump(code->parser);
-
-            generate_C_instruction(dest_ptr, comp_prt, jum_prt, bitsBufer);
-            fprintf(code->output,"%s\n", bitsBufer);
-        }
-    }
+        size_t end = len;
+        size_t split = len * (i + 1) / chunks;
+        if (split < start) split = start;
 
-    return 0;
-}
+        const char *nl = i + 1 < chunks ? memchr(data + split, '\n', len - split) : NULL;
+        if (nl) end = nl - data + 1;
 
-static int generate_A_instruction(SymbolTable *table,const char* symbol, char bitsBuffer[17])
-{   
-    for (int i = 0; i < 17; i++) {
-        bitsBuffer[i] = '0';
+        work[i].data = data + start;
+        work[i].len = end - start;
+        work[i].program = code->ir;
+        start = end;
     }
 
-    uint16_t val;
-    int perr = to_uint16(symbol, &val);
-    if (perr == OVERFLOW_ERR)
+    Pool *pool = pool_init(threads < chunks ? threads : chunks);
+    for (size_t i = 0; i < chunks; i++)
     {
-        return UNEXPECTED;
+        if (!pool || pool_submit(pool, scan_chunk, &work[i])) scan_chunk(&work[i]);
     }
+    if (pool) pool_wait(pool);
 
-    if (perr == NOT_NUMBER)
+    IR *ir = code->ir;
+    size_t count = 0, rom = 0, lines = 0;
+    for (size_t i = 0; i < chunks; i++)
     {
-        if (!symbol_table_get(table, symbol, &val)){
-            return UNEXPECTED;
+        if (work[i].status)
+        {
+            free_pool(code, pool);
+            free_scan_chunks(work, chunks);
+            return SCAN_SERIAL;
         }
-    }
-
-    to_binary(val, bitsBuffer);
-    
-    return 0;
-}
 
-static void generate_C_instruction(const char* dest, const char* comp, const char* jump, char bitsBuffer[17])
-{   
-    for (int i = 0; i < 17; i++) {
-        bitsBuffer[i] = '0';
+        count += work[i].ir->count;
     }
 
-
-    bitsBuffer[16] = 0;
-    bitsBuffer[0] = bitsBuffer[1] = bitsBuffer[2] = '1';
-
-    if (strstr(comp, "M")) {
-        bitsBuffer[3] = '1';
+    if (ir_reserve(ir, count))
+    {
+        free_pool(code, pool);
+        free_scan_chunks(work, chunks);
+        return UNEXPECTED;
     }
 
-    if (dest) {
-        const char* destBits  = lookup(destEntityTable, dest);
-        if (!destBits) {
-            fprintf(stderr, "invalid expression: %s\n", dest);
-            exit(1);
+    count = 0;
+    for (size_t i = 0; i < chunks; i++)
+    {
+        IR *local = work[i].ir;
+        work[i].start = count;
+        work[i].line_start = lines;
+        work[i].map = malloc((local->symbol_count + 1) * sizeof(uint32_t));
+        if (!work[i].map)
+        {
+            free_pool(code, pool);
+            free_scan_chunks(work, chunks);
+            return UNEXPECTED;
         }
 
-        for (int i = 0, j = 10; j < 13; i++, j++) {
-            bitsBuffer[j] = destBits[i];
-        }
-    }
+        for (uint32_t id = 0; id < local->symbol_count; id++)
+        {
+            Slice sym;
+            sym.ptr = ir_symbol_name(local, id, &sym.len);
 
-    if (comp) {
-        const char* compBits  = lookup(computeEntityTable, comp);
-        if (!compBits) {
-            fprintf(stderr, "invalid expression: %s\n", comp);
-            exit(1);
-        }
+            uint32_t global = intern_symbol(code, sym);
+            if (global == IR_NO_SYMBOL)
+            {
+                free_pool(code, pool);
+                free_scan_chunks(work, chunks);
+                return UNEXPECTED;
+            }
+            work[i].map[id] = global;
 
-        for (int i = 0, j = 4; j < 10; i++, j++) {
-            bitsBuffer[j] = compBits[i];
-        }
-    }
+            // the first chunk to see a symbol decides whether it takes a
+            // RAM slot, as its first use would in scan().
+            if (!ir->defined[global])
+            {
+                if (local->defined[id] & SCAN_REFERENCED) {
+                    ir->values[global] = code->next_ram_free_slot++;
+                }
+                ir->defined[global] = 1;
+            }
 
-    if (jump) {
-        const char* jumpBits  = lookup(jumpEntityTable, jump);
-        if (!jumpBits) {
-            fprintf(stderr, "invalid expression: %s\n", jump);
-            exit(1);
+            // a later definition overrides an earlier one, as in scan().
+            if (local->defined[id] & SCAN_LABEL_DEFINED) {
+                ir->values[global] = rom + local->values[id];
+            }
         }
 
-        for (int i = 0, j = 13; j < 16; i++, j++) {
-            bitsBuffer[j] = jumpBits[i];
-        }
+        count += local->count;
+        rom += local->rom_size;
+        lines += work[i].lines;
     }
-}
-
-static int to_uint16(const char* s, uint16_t *target) {
-    if (!s || *s == '\0') return 0;
 
-    errno = 0;
-    char* endptr;
-
-    long val = strtol(s, &endptr, 10);
-
-    if (errno == ERANGE) return OVERFLOW_ERR; 
-    if (endptr == s) return NOT_NUMBER; 
-    if (*endptr != '\0') return NOT_NUMBER;
-    if (val > Uint16_MAX)
+    for (size_t i = 0; i < chunks; i++)
     {
-        return OVERFLOW_ERR;
+        if (!pool || pool_submit(pool, copy_chunk, &work[i])) copy_chunk(&work[i]);
     }
+    if (pool) pool_wait(pool);
+
+    ir->count += count;
+    ir->rom_size += rom;
+    code->scanned_lines = lines;
 
-    *target = (uint16_t)val;
+    free_pool(code, pool);
+    free_scan_chunks(work, chunks);
 
     return 0;
 }
 
-static void to_binary(uint16_t number, char *output)
+// scan_chunk scans one chunk into its own IR, an error only sets the
+// chunk's status since scan() reports it again.
+static void scan_chunk(void *arg)
 {
-    for (int i = 15; i >= 0; i--)
+    ScanChunk *chunk = arg;
+    Diagnostics quiet = { NULL, 0, 0, 0 };
+    Parser *p = init_parser_buffer(chunk->data, chunk->len, NULL);
+    IR *ir = ir_init();
+    uint16_t val;
+    uint32_t id;
+    int created;
+
+    chunk->ir = ir;
+    if (!p || !ir)
     {
-        output[15 - i] = (number & (1 << i)) ? '1' : '0';
+        free_parser(p);
+        chunk->status = UNEXPECTED;
+        return;
     }
+    parser_set_diagnostics(p, &quiet);
 
-    output[16] = 0;
-}
-
-static const char* lookup(const struct TableEntity table[], const char* key) {
-    for (int i = 0; table[i].mnemonic != NULL; i++) {
-        if (strcmp(table[i].mnemonic, key) == 0 ) {
-            return table[i].bits;
+    while (hasMoreLines(p) && !chunk->status)
+    {
+        int result = advance(p);
+        if (result == PARSE_EOF) break;
+        if (result != PARSE_OK)
+        {
+            chunk->status = result;
+            break;
         }
-    }
-    
-    return NULL;
-}
-
-static char* change_file_extention(const char* filename) {
-    const char *asm_ext = ".asm";
-    size_t asm_ext_size = strlen(asm_ext);
-    const char *ext = ".hack";
-    size_t ext_size = strlen(ext);
-    size_t file_size = strlen(filename);
 
-    char* fname = (char*) malloc(file_size - asm_ext_size + ext_size + 1);
-    strlcpy(fname, filename, file_size - asm_ext_size + 1);
+        uint32_t line = current_source_line(p);
+        Slice sym = symbol_slice(p);
 
-    for (size_t i = file_size - asm_ext_size, j = 0; i <  file_size + ext_size; i++, j++) {
-        fname[i] = ext[j];
+        switch (instructionType(p))
+        {
+        case A_INSTRUCTION:
+            result = to_uint16(sym, &val);
+            if (result == OVERFLOW_ERR) {
+                chunk->status = OVERFLOW_ERR;
+            } else if (result != NOT_NUMBER) {
+                chunk->status = ir_push(ir, IR_A_CONST, val, line);
+            } else if ((id = ir_intern(ir, sym.ptr, sym.len, &created)) == IR_NO_SYMBOL) {
+                chunk->status = UNEXPECTED;
+            } else {
+                if (created) ir->defined[id] = SCAN_REFERENCED;
+                chunk->status = ir_push(ir, IR_A_SYMBOL, id, line);
+            }
+            break;
+        case L_INSTRUCTION:
+            id = ir_intern(ir, sym.ptr, sym.len, &created);
+            if (id == IR_NO_SYMBOL)
+            {
+                chunk->status = UNEXPECTED;
+                break;
+            }
+            if (created) ir->defined[id] = SCAN_LABEL_FIRST;
+            ir->defined[id] |= SCAN_LABEL_DEFINED;
+            ir->values[id] = ir->rom_size;
+            chunk->status = ir_push(ir, IR_LABEL, id, line);
+            break;
+        case C_INSTRUCTION:
+            if (encode_C_instruction(dest_slice(p), comp_slice(p), jump_slice(p), &val, &quiet, line)) {
+                chunk->status = UNEXPECTED;
+            } else {
+                chunk->status = ir_push(ir, IR_C, val, line);
+            }
+            break;
+        default:
+            chunk->status = UNEXPECTED;
+        }
     }
 
-    fname[file_size - asm_ext_size + ext_size] = 0;
+    chunk->lines = current_source_line(p);
+    free_parser(p);
+}
 
-    return fname;
+// copy_chunk moves a chunk's instructions to their place in the program's
+// IR, with global symbol ids and line numbers.
+static void copy_chunk(void *arg)
+{
+    ScanChunk *chunk = arg;
+    IR *from = chunk->ir;
+    IR *to = chunk->program;
+    size_t at = to->count + chunk->start;
+
+    memcpy(to->kinds + at, from->kinds, from->count);
+
+    for (size_t i = 0; i < from->count; i++)
+    {
+        uint32_t operand = from->operands[i];
+        if (from->kinds[i] == IR_A_SYMBOL || from->kinds[i] == IR_LABEL) {
+            operand = chunk->map[operand];
+        }
+
+        to->operands[at + i] = operand;
+        to->lines[at + i] = from->lines[i] + chunk->line_start;
+    }
+}
+
+static void free_scan_chunks(ScanChunk *work, size_t chunks)
+{
+    for (size_t i = 0; i < chunks; i++)
+    {
+        ir_free(work[i].ir);
+        free(work[i].map);
+    }
+
+    free(work);
+}
+
+// code_emit_a appends @sym to the IR, sym being a number or a symbol.
+int code_emit_a(Code *code, Slice sym, uint32_t line)
+{
+    IR *ir = code->ir;
+    uint16_t val;
+    uint32_t id;
+
+    int errnum = to_uint16(sym, &val);
+    if (errnum == OVERFLOW_ERR)
+    {
+        diag_report(code->diag, line, "Err overflow on line: %zu", (size_t)line);
+        return OVERFLOW_ERR;
+    }
+
+    if (errnum != NOT_NUMBER) {
+        return ir_push(ir, IR_A_CONST, val, line) ? UNEXPECTED : 0;
+    }
+
+    id = intern_symbol(code, sym);
+    if (id == IR_NO_SYMBOL) {
+        return UNEXPECTED;
+    }
+
+    // if already doesnt exist to handle reserve keyboards and L_instructions.
+    if (!ir->defined[id])
+    {
+        ir->values[id] = code->next_ram_free_slot;
+        ir->defined[id] = 1;
+        code->next_ram_free_slot++;
+    }
+
+    return ir_push(ir, IR_A_SYMBOL, id, line) ? UNEXPECTED : 0;
+}
+
+// code_emit_label_ref appends @sym for a front end that knows sym is a
+// label, so it takes no RAM slot while it is not defined yet. finish()
+// fails when it never is.
+int code_emit_label_ref(Code *code, Slice sym, uint32_t line)
+{
+    IR *ir = code->ir;
+
+    uint32_t id = intern_symbol(code, sym);
+    if (id == IR_NO_SYMBOL) {
+        return UNEXPECTED;
+    }
+
+    if (!ir->defined[id]) {
+        ir->defined[id] = LABEL_PENDING;
+    }
+
+    return ir_push(ir, IR_A_SYMBOL, id, line) ? UNEXPECTED : 0;
+}
+
+// code_emit_label appends (sym) to the IR, sym gets the next ROM address.
+int code_emit_label(Code *code, Slice sym, uint32_t line)
+{
+    IR *ir = code->ir;
+
+    uint32_t id = intern_symbol(code, sym);
+    if (id == IR_NO_SYMBOL) {
+        return UNEXPECTED;
+    }
+
+    ir->values[id] = ir->rom_size;
+    ir->defined[id] = 1;
+
+    return ir_push(ir, IR_LABEL, id, line) ? UNEXPECTED : 0;
+}
+
+// code_emit_c appends dest=comp;jump to the IR, dest and jump may be empty.
+int code_emit_c(Code *code, Slice dest, Slice comp, Slice jump, uint32_t line)
+{
+    uint16_t val;
+
+    if (encode_C_instruction(dest, comp, jump, &val, code->diag, line)) {
+        return UNEXPECTED;
+    }
+
+    return ir_push(code->ir, IR_C, val, line) ? UNEXPECTED : 0;
+}
+
+// generate emits the IR built by scan(), symbol ids are resolved through
+// the value array so no text or hashing is involved.
+static int generate(Code *code)
+{
+    stats_phase_begin(code->stats, PHASE_OUTPUT);
+    if (open_output(code)) {
+        return UNEXPECTED;
+    }
+    stats_phase_begin(code->stats, PHASE_GENERATE);
+
+    if (code->options.format == FORMAT_OBJECT) {
+        return write_object(code);
+    }
+
+    if (code->options.encode_threads > 0 && code->options.format == FORMAT_HACK && output_mappable(code)) {
+        return generate_mapped(code);
+    }
+
+    IR *ir = code->ir;
+    uint16_t *words = code_alloc(code, (ir->rom_size ? ir->rom_size : 1) * sizeof(uint16_t));
+    if (!words) {
+        return UNEXPECTED;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        switch (ir->kinds[i])
+        {
+        case IR_LABEL:
+            continue;
+        case IR_A_SYMBOL:
+            words[count++] = ir->values[ir->operands[i]];
+            break;
+        default:
+            words[count++] = ir->operands[i];
+        }
+    }
+
+    int errnum = write_words(code, words, count);
+    code_release(code, words);
+
+    return errnum;
+}
+
+// generate_mapped sizes the output for rom_size fixed width lines, maps it
+// and lets encode_threads threads write contiguous ranges of it in place.
+static int generate_mapped(Code *code)
+{
+    IR *ir = code->ir;
+    size_t size = ir->rom_size * HACK_LINE_SIZE;
+    char *output;
+
+    if (code->to_buffer)
+    {
+        // the threads write the caller's buffer in place, when it is big
+        // enough.
+        code->out_size = size;
+        if (size > code->out_capacity || size == 0) return 0;
+        output = code->out_data;
+    }
+    else
+    {
+        int fd = fileno(code->output);
+
+        fflush(code->output);
+        if (ftruncate(fd, size))
+        {
+            perror("Err sizing output");
+            return UNEXPECTED;
+        }
+
+        if (size == 0) return 0;
+
+        output = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (output == MAP_FAILED)
+        {
+            perror("Err mapping output");
+            return UNEXPECTED;
+        }
+    }
+
+    size_t threads = code->options.encode_threads;
+    size_t chunks = ir->count / ENCODE_CHUNK_MIN + 1;
+    if (chunks > threads * 4) chunks = threads * 4;
+
+    EncodeChunk *work = malloc(chunks * sizeof(EncodeChunk));
+    if (!work)
+    {
+        if (!code->to_buffer) munmap(output, size);
+        return UNEXPECTED;
+    }
+
+    for (size_t i = 0; i < chunks; i++)
+    {
+        work[i].ir = ir;
+        work[i].output = output;
+        work[i].start = ir->count * i / chunks;
+        work[i].end = ir->count * (i + 1) / chunks;
+    }
+
+    Pool *pool = chunks > 1 ? pool_init(threads < chunks ? threads : chunks) : NULL;
+
+    // labels take no ROM word, so each chunk counts its words before the
+    // offsets are known.
+    for (size_t i = 0; i < chunks; i++)
+    {
+        if (!pool || pool_submit(pool, count_chunk, &work[i])) count_chunk(&work[i]);
+    }
+    if (pool) pool_wait(pool);
+
+    size_t rom = 0;
+    for (size_t i = 0; i < chunks; i++)
+    {
+        work[i].rom_start = rom;
+        rom += work[i].rom_count;
+    }
+
+    for (size_t i = 0; i < chunks; i++)
+    {
+        if (!pool || pool_submit(pool, encode_chunk, &work[i])) encode_chunk(&work[i]);
+    }
+    if (pool) pool_wait(pool);
+
+    free_pool(code, pool);
+    free(work);
+
+    if (!code->to_buffer && munmap(output, size))
+    {
+        perror("Err writing output");
+        return UNEXPECTED;
+    }
+
+    return 0;
+}
+
+static void count_chunk(void *arg)
+{
+    EncodeChunk *chunk = arg;
+    size_t count = 0;
+
+    for (size_t i = chunk->start; i < chunk->end; i++) {
+        count += chunk->ir->kinds[i] != IR_LABEL;
+    }
+
+    chunk->rom_count = count;
+}
+
+static void encode_chunk(void *arg)
+{
+    EncodeChunk *chunk = arg;
+    IR *ir = chunk->ir;
+    char *line = chunk->output + chunk->rom_start * HACK_LINE_SIZE;
+    uint16_t word;
+
+    for (size_t i = chunk->start; i < chunk->end; i++)
+    {
+        switch (ir->kinds[i])
+        {
+        case IR_LABEL:
+            continue;
+        case IR_A_SYMBOL:
+            word = ir->values[ir->operands[i]];
+            break;
+        default:
+            word = ir->operands[i];
+        }
+
+        to_binary(word, line);
+        line[16] = '\n';
+        line += HACK_LINE_SIZE;
+    }
+}
+
+// free_pool counts the CPU time of the pool's threads in the running
+// phase and frees it.
+static void free_pool(Code *code, Pool *pool)
+{
+    stats_add_cpu(code->stats, pool_cpu_ms(pool));
+    pool_free(pool);
+}
+
+// intern_symbol returns the IR id of sym, predefined symbols come with
+// their value the first time they are seen.
+static uint32_t intern_symbol(Code *code, Slice sym)
+{
+    int created;
+    uint16_t val;
+
+    uint32_t id = ir_intern(code->ir, sym.ptr, sym.len, &created);
+    if (created && symbol_table_getn(code->table, sym.ptr, sym.len, &val))
+    {
+        code->ir->values[id] = val;
+        code->ir->defined[id] = 1;
+    }
+
+    return id;
+}
+
+// pack_mnemonic packs a dest, comp or jump mnemonic the way gen_tables
+// does, 0 means it is too long to be one.
+static inline uint32_t pack_mnemonic(Slice s)
+{
+    const unsigned char *c = (const unsigned char*)s.ptr;
+
+    switch (s.len)
+    {
+    case 1:
+        return 1u << 24 | c[0];
+    case 2:
+        return 2u << 24 | c[1] << 8 | c[0];
+    case 3:
+        return 3u << 24 | c[2] << 16 | c[1] << 8 | c[0];
+    default:
+        return 0;
+    }
+}
+
+// encode_C_instruction looks every field up in the perfect hash tables
+// generated from mnemonics.h, the entries are already shifted into place.
+static int encode_C_instruction(Slice dest, Slice comp, Slice jump, uint16_t *target, Diagnostics *diag, size_t line)
+{
+    uint16_t word = 0xE000;
+    uint32_t key;
+    const EncodeEntry *entry;
+
+    key = pack_mnemonic(comp);
+    entry = &compHashTable[ENCODE_HASH(key, COMP_HASH_MULT, COMP_HASH_SHIFT)];
+    if (!key || entry->key != key) {
+        diag_report(diag, line, "invalid expression: %.*s", (int)comp.len, comp.ptr);
+        return UNEXPECTED;
+    }
+    word |= entry->bits;
+
+    if (dest.len) {
+        key = pack_mnemonic(dest);
+        entry = &destHashTable[ENCODE_HASH(key, DEST_HASH_MULT, DEST_HASH_SHIFT)];
+        if (!key || entry->key != key) {
+            diag_report(diag, line, "invalid expression: %.*s", (int)dest.len, dest.ptr);
+            return UNEXPECTED;
+        }
+        word |= entry->bits;
+    }
+
+    if (jump.len) {
+        key = pack_mnemonic(jump);
+        entry = &jumpHashTable[ENCODE_HASH(key, JUMP_HASH_MULT, JUMP_HASH_SHIFT)];
+        if (!key || entry->key != key) {
+            diag_report(diag, line, "invalid expression: %.*s", (int)jump.len, jump.ptr);
+            return UNEXPECTED;
+        }
+        word |= entry->bits;
+    }
+
+    *target = word;
+
+    return 0;
+}
+
+// code_alloc takes memory from the run's arena, or the heap without one;
+// code_release only gives heap memory back.
+static void* code_alloc(Code *code, size_t size)
+{
+    return code->arena ? arena_alloc(code->arena, size) : malloc(size);
+}
+
+static void code_release(Code *code, void *ptr)
+{
+    if (!code->arena) free(ptr);
+}
+
+// collect_stats ends the timing of the run and fills in the counters that
+// are cheaper to derive once at the end than to keep up while assembling.
+static void collect_stats(Code *code)
+{
+    Stats *s = code->stats;
+    if (!s) return;
+
+    stats_phase_begin(s, PHASE_NONE);
+
+    IR *ir = code->ir;
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        switch (ir->kinds[i])
+        {
+        case IR_LABEL:
+            s->types[L_INSTRUCTION]++;
+            break;
+        case IR_C:
+            s->types[C_INSTRUCTION]++;
+            break;
+        default:
+            s->types[A_INSTRUCTION]++;
+        }
+    }
+
+    s->lines_read = code->parser ? current_source_line(code->parser) : 0;
+    if (code->scanned_lines) s->lines_read = code->scanned_lines;
+    s->instructions += ir->rom_size;
+    s->instructions_removed += code->opt_removed;
+    symbol_table_stats(code->table, &s->symbol_table);
+    ir_table_stats(ir, &s->ir_symbols);
+    s->bytes_allocated += ir_allocated_bytes(ir);
+}
+
+static int open_output(Code *code)
+{
+    static const char *extensions[] = { ".hack", ".bin", ".hex", ".c", ".hobj" };
+
+    // the C translation is written through stdio, a stream over the buffer
+    // takes it there. The other formats are copied by write_words().
+    if (code->to_buffer)
+    {
+        if (code->options.format != FORMAT_C) return 0;
+
+        cookie_io_functions_t io = { NULL, buffer_write, NULL, NULL };
+        code->output = fopencookie(code, "w", io);
+        if (!code->output) {
+            diag_report(code->diag, 0, "Err out of memory");
+            return UNEXPECTED;
+        }
+
+        return 0;
+    }
+
+    const char *name = code->output_name ? code->output_name : code->input_name;
+    if (!strcmp(name, "-"))
+    {
+        code->output = stdout;
+        return 0;
+    }
+
+    if (code->output_name)
+    {
+        code->output = fopen(code->output_name, "w+");
+        if (!code->output) {
+            diag_report(code->diag, 0, "can not open file:%s", code->output_name);
+            return UNEXPECTED;
+        }
+        return 0;
+    }
+
+    char* fname = change_file_extention(code->input_name, extensions[code->options.format]);
+    if (!fname) {
+        diag_report(code->diag, 0, "cant rename file");
+        return UNEXPECTED;
+    }
+
+    code->output = fopen(fname, "w+");
+    if (!code->output) {
+        diag_report(code->diag, 0, "can not open file:%s", fname);
+        free(fname);
+        return UNEXPECTED;
+    }
+
+    free(fname);
+
+    return 0;
+}
+
+// write_words renders the ROM in the selected format into one buffer and
+// hands it to the kernel with a single write.
+static int write_words(Code *code, const uint16_t *words, size_t count)
+{
+    if (code->options.format == FORMAT_C)
+    {
+        stats_phase_begin(code->stats, PHASE_OUTPUT);
+        if (aot_write(code->output, words, count, code->input_name)) return UNEXPECTED;
+
+        return fflush(code->output) ? UNEXPECTED : 0;
+    }
+
+    // an Intel HEX data record is at most 44 characters for 8 words.
+    size_t capacity = count * HACK_LINE_SIZE + (count / 8 + 2) * 44 + 64;
+    char *buffer = code_alloc(code, capacity);
+    if (!buffer) {
+        return UNEXPECTED;
+    }
+
+    size_t size;
+    switch (code->options.format)
+    {
+    case FORMAT_BIN:
+        size = format_bin(words, count, code->options.little_endian, buffer);
+        break;
+    case FORMAT_IHEX:
+        size = format_ihex(words, count, code->options.little_endian, buffer);
+        break;
+    default:
+        size = format_hack(words, count, buffer);
+    }
+
+    stats_phase_begin(code->stats, PHASE_OUTPUT);
+    int errnum = write_buffer(code, buffer, size);
+    code_release(code, buffer);
+
+    return errnum;
+}
+
+// write_object writes the IR as an object for the linker instead of a ROM.
+// Symbols keep their first seen order and a symbol that was first used,
+// not defined, asks for a RAM slot, so linking objects in the order of
+// their sources gives the slots assembling the sources as one file would.
+// Predefined symbols are resolved here unless the module makes them a
+// label.
+static int write_object(Code *code)
+{
+    IR *ir = code->ir;
+    Object obj;
+    int errnum = UNEXPECTED;
+
+    memset(&obj, 0, sizeof(Object));
+    uint8_t *seen = code_alloc(code, ir->symbol_count + 1);
+    uint32_t *index = code_alloc(code, (ir->symbol_count + 1) * sizeof(uint32_t));
+    obj.words = code_alloc(code, (ir->rom_size + 1) * sizeof(uint16_t));
+    obj.symbols = code_alloc(code, (ir->symbol_count + 1) * sizeof(ObjSymbol));
+    if (!seen || !index || !obj.words || !obj.symbols) goto done;
+
+    memset(seen, 0, ir->symbol_count);
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        uint32_t id = ir->operands[i];
+        if (ir->kinds[i] == IR_LABEL) {
+            seen[id] |= OBJ_LABEL;
+        } else if (ir->kinds[i] == IR_A_SYMBOL && !seen[id]) {
+            seen[id] = OBJ_VARIABLE;
+            obj.reloc_count++;
+        } else if (ir->kinds[i] == IR_A_SYMBOL) {
+            obj.reloc_count++;
+        } else if (ir->kinds[i] == IR_A_CONST && (ir->operands[i] & 0x8000)) {
+            obj.wide_count++;
+        }
+    }
+
+    for (uint32_t id = 0; id < ir->symbol_count; id++)
+    {
+        size_t len;
+        uint16_t val;
+        const char *name = ir_symbol_name(ir, id, &len);
+
+        index[id] = IR_NO_SYMBOL;
+        if (!(seen[id] & OBJ_LABEL) && symbol_table_getn(code->table, name, len, &val)) continue;
+
+        ObjSymbol *s = &obj.symbols[obj.symbol_count];
+        s->name = name - ir->names;
+        s->len = len;
+        s->value = seen[id] & OBJ_LABEL ? ir->values[id] : 0;
+        s->flags = seen[id];
+        index[id] = obj.symbol_count++;
+    }
+
+    obj.relocs = code_alloc(code, (obj.reloc_count + 1) * sizeof(ObjReloc));
+    obj.wide = code_alloc(code, (obj.wide_count + 1) * sizeof(uint32_t));
+    if (!obj.relocs || !obj.wide) goto done;
+
+    obj.reloc_count = 0;
+    obj.wide_count = 0;
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        uint32_t operand = ir->operands[i];
+
+        switch (ir->kinds[i])
+        {
+        case IR_LABEL:
+            continue;
+        case IR_A_SYMBOL:
+            if (index[operand] == IR_NO_SYMBOL)
+            {
+                obj.words[obj.word_count++] = ir->values[operand];
+                continue;
+            }
+            obj.relocs[obj.reloc_count].word = obj.word_count;
+            obj.relocs[obj.reloc_count++].symbol = index[operand];
+            obj.words[obj.word_count++] = 0;
+            break;
+        case IR_A_CONST:
+            if (operand & 0x8000) obj.wide[obj.wide_count++] = obj.word_count;
+            obj.words[obj.word_count++] = operand;
+            break;
+        default:
+            obj.words[obj.word_count++] = operand;
+        }
+    }
+
+    // the names are copied whole, symbols point into them where the IR did.
+    obj.names = ir->names;
+    obj.names_size = ir->names_size;
+
+    char *buffer = code_alloc(code, obj_size(&obj));
+    if (buffer)
+    {
+        size_t size = obj_encode(&obj, buffer);
+        stats_phase_begin(code->stats, PHASE_OUTPUT);
+        errnum = write_buffer(code, buffer, size);
+        code_release(code, buffer);
+    }
+
+done:
+    code_release(code, seen);
+    code_release(code, index);
+    code_release(code, obj.words);
+    code_release(code, obj.symbols);
+    code_release(code, obj.relocs);
+    code_release(code, obj.wide);
+
+    return errnum;
+}
+
+// write_buffer hands the size bytes at buffer to the output with a single
+// write.
+static int write_buffer(Code *code, const char *buffer, size_t size)
+{
+    if (code->to_buffer) {
+        return buffer_write(code, buffer, size) < 0 ? UNEXPECTED : 0;
+    }
+
+    fflush(code->output);
+
+    if (write_all(fileno(code->output), buffer, size))
+    {
+        perror("Err writing output");
+        return UNEXPECTED;
+    }
+
+    return 0;
 }
 
+static size_t format_hack(const uint16_t *words, size_t count, char *out)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        to_binary(words[i], out);
+        out[16] = '\n';
+        out += HACK_LINE_SIZE;
+    }
+
+    return count * HACK_LINE_SIZE;
+}
+
+static size_t format_bin(const uint16_t *words, size_t count, int little_endian, char *out)
+{
+    uint8_t *bytes = (uint8_t*)out;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint8_t hi = words[i] >> 8;
+        uint8_t lo = words[i] & 0xFF;
+        bytes[2 * i] = little_endian ? lo : hi;
+        bytes[2 * i + 1] = little_endian ? hi : lo;
+    }
+
+    return count * 2;
+}
+
+// format_ihex writes the words as 16 byte data records, with an extended
+// linear address record whenever the byte address passes a 64K boundary.
+static size_t format_ihex(const uint16_t *words, size_t count, int little_endian, char *out)
+{
+    uint8_t data[16];
+    size_t size = 0;
+    size_t total = count * 2;
+
+    for (size_t offset = 0; offset < total; offset += sizeof(data))
+    {
+        if (offset && (offset & 0xFFFF) == 0)
+        {
+            uint8_t upper[2] = { (offset >> 24) & 0xFF, (offset >> 16) & 0xFF };
+            size += ihex_record(out + size, 0x04, 0, upper, 2);
+        }
+
+        size_t len = total - offset < sizeof(data) ? total - offset : sizeof(data);
+        format_bin(words + offset / 2, len / 2, little_endian, (char*)data);
+        size += ihex_record(out + size, 0x00, offset & 0xFFFF, data, len);
+    }
+
+    size += ihex_record(out + size, 0x01, 0, NULL, 0);
+
+    return size;
+}
+
+static size_t ihex_record(char *out, uint8_t type, uint16_t address, const uint8_t *data, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    uint8_t header[4] = { len, address >> 8, address & 0xFF, type };
+    uint8_t sum = 0;
+    size_t size = 0;
+
+    out[size++] = ':';
+    for (size_t i = 0; i < 4 + len; i++)
+    {
+        uint8_t byte = i < 4 ? header[i] : data[i - 4];
+        sum += byte;
+        out[size++] = hex[byte >> 4];
+        out[size++] = hex[byte & 0xF];
+    }
+
+    sum = -sum;
+    out[size++] = hex[sum >> 4];
+    out[size++] = hex[sum & 0xF];
+    out[size++] = '\n';
+
+    return size;
+}
+
+// buffer_write appends to the output buffer. What does not fit is only
+// counted, so the caller learns the size it takes.
+static ssize_t buffer_write(void *cookie, const char *data, size_t size)
+{
+    Code *code = cookie;
+
+    if (code->out_size <= code->out_capacity && size <= code->out_capacity - code->out_size) {
+        memcpy(code->out_data + code->out_size, data, size);
+    }
+    code->out_size += size;
+
+    return size;
+}
+
+static int output_fits(Code *code)
+{
+    return code->to_buffer && code->out_size > code->out_capacity ? CODE_NO_SPACE : 0;
+}
+
+// output_mappable tells whether the output can be sized and mapped, which
+// a pipe or a terminal can not. stdout is left alone even when it is a
+// file, it may be appended to.
+static int output_mappable(Code *code)
+{
+    struct stat st;
+
+    if (code->to_buffer) return 1;
+
+    return code->output != stdout && fstat(fileno(code->output), &st) == 0 && S_ISREG(st.st_mode);
+}
+
+// to_uint16 parses a base 10 number the way strtol does, the whole slice
+// has to be consumed for it to be a number.
+static int to_uint16(Slice s, uint16_t *target) {
+    if (!s.ptr || s.len == 0) return 0;
+
+    const char *c = s.ptr;
+    const char *end = s.ptr + s.len;
+    while (c < end && isspace((unsigned char)*c)) c++;
+
+    int negative = 0;
+    if (c < end && (*c == '+' || *c == '-')) {
+        negative = *c == '-';
+        c++;
+    }
+
+    if (c == end || !isdigit((unsigned char)*c)) return NOT_NUMBER;
+
+    // only the low 16 bits matter once the value is known to be too big.
+    unsigned long val = 0;
+    int overflow = 0;
+    for (; c < end && isdigit((unsigned char)*c); c++)
+    {
+        val = val * 10 + (*c - '0');
+        if (val > Uint16_MAX) {
+            overflow = 1;
+            val &= 0xFFFF;
+        }
+    }
+
+    if (c != end) return NOT_NUMBER;
+    if (overflow && !negative)
+    {
+        return OVERFLOW_ERR;
+    }
+
+    *target = (uint16_t)(negative ? -val : val);
+
+    return 0;
+}
+
+// to_binary writes the 16 ASCII bits of number, most significant first. It
+// does not terminate the line, callers put the '\n' after it.
+static inline void to_binary(uint16_t number, char *output)
+{
+#ifdef __SSE2__
+    // spread the high byte over lanes 0-7 and the low byte over lanes 8-15,
+    // keep one bit per lane and turn it into '0' or '1'.
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i v = _mm_cvtsi32_si128((number >> 8) | (number << 8));
+    v = _mm_unpacklo_epi8(v, v);
+    v = _mm_unpacklo_epi16(v, v);
+    v = _mm_unpacklo_epi32(v, v);
+    v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+    v = _mm_sub_epi8(_mm_set1_epi8('0'), v);
+    _mm_storeu_si128((__m128i*)output, v);
+#else
+    memcpy(output, hackByteTable[number >> 8], 8);
+    memcpy(output + 8, hackByteTable[number & 0xFF], 8);
+#endif
+}
+
+static char* change_file_extention(const char* filename, const char* ext) {
+    // the extension is whatever follows the last dot of the file name,
+    // .asm or .vm.
+    const char *dot = strrchr(filename, '.');
+    const char *slash = strrchr(filename, '/');
+    size_t ext_size = strlen(ext);
+    size_t base_size = dot && (!slash || dot > slash) ? (size_t)(dot - filename) : strlen(filename);
+
+    char* fname = (char*) malloc(base_size + ext_size + 1);
+    if (!fname) return NULL;
+
+    memcpy(fname, filename, base_size);
+    memcpy(fname + base_size, ext, ext_size + 1);
+
+    return fname;
+}
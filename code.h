@@ -1,10 +1,57 @@
 #ifndef CODE_H
 #define CODE_H
 #include "./parser.h"
+#include "./arena.h"
+#include "./stats.h"
+#include "./diag.h"
+
+#include<stddef.h>
+#include<stdint.h>
 
 typedef struct Code Code;
-Code* init_code(Parser *parser, const char* filename);
+
+typedef enum{
+    FORMAT_HACK,    // ASCII .hack, one 16 character line per word
+    FORMAT_BIN,     // raw 16-bit words, .bin
+    FORMAT_IHEX,    // Intel HEX, .hex
+    FORMAT_C,       // C source that runs the program, .c
+    FORMAT_OBJECT   // relocatable object for the linker, .hobj, see obj.h
+}output_format;
+
+typedef struct {
+    // encode_threads > 0 sizes the output up front, maps it and encodes
+    // contiguous instruction ranges on that many threads.
+    size_t encode_threads;
+    output_format format;
+    // byte order of the words in the bin and ihex formats, big endian by default.
+    int little_endian;
+    // optimize runs the peephole pass of opt.c on the IR before generating.
+    int optimize;
+    // scan_threads > 1 scans an input held in memory in chunks on that
+    // many threads.
+    size_t scan_threads;
+}CodeOptions;
+
+// assemble() and assemble_single_pass() return CODE_NO_SPACE when the
+// output did not fit the buffer given to code_set_output_buffer().
+#define CODE_NO_SPACE 5
+
+Code* init_code(Parser *parser, const char* filename, Arena *arena);
 int assemble(Code *c);
+int assemble_single_pass(Code *c);
+int assemble_emitted(Code *c);
+int assemble_objects(Code *c, const char *const *files, size_t count);
+int code_emit_a(Code *c, Slice sym, uint32_t line);
+int code_emit_label_ref(Code *c, Slice sym, uint32_t line);
+int code_emit_label(Code *c, Slice sym, uint32_t line);
+int code_emit_c(Code *c, Slice dest, Slice comp, Slice jump, uint32_t line);
+void code_set_options(Code *c, const CodeOptions *options);
+void code_set_stats(Code *c, Stats *stats);
+void code_set_diagnostics(Code *c, Diagnostics *diag);
+void code_set_output_name(Code *c, const char *name);
+void code_set_output_buffer(Code *c, char *buffer, size_t capacity);
+size_t code_output_size(Code *c);
+int code_optimized(Code *c, size_t *removed, size_t *rom_size);
 void free_code(Code *c);
 
 #endif
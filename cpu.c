@@ -0,0 +1,314 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./cpu.h"
+
+// The emulator decodes every ROM word once when it is loaded and then runs
+// with threaded dispatch: each handler ends by jumping straight to the
+// handler of the next instruction through a table of label addresses, so
+// there is no central switch to mispredict. The 28 computations of the
+// book have a handler each, any other comp bits go through hack_alu().
+
+enum{
+    OP_A,           // @value
+    OP_HALT,        // @value where the next word jumps back here
+    OP_END,         // past the program, runs as @0
+    OP_ZERO, OP_ONE, OP_MINUS_ONE,
+    OP_D, OP_A_REG, OP_M,
+    OP_NOT_D, OP_NOT_A, OP_NOT_M,
+    OP_NEG_D, OP_NEG_A, OP_NEG_M,
+    OP_D_PLUS_ONE, OP_A_PLUS_ONE, OP_M_PLUS_ONE,
+    OP_D_MINUS_ONE, OP_A_MINUS_ONE, OP_M_MINUS_ONE,
+    OP_D_PLUS_A, OP_D_PLUS_M,
+    OP_D_MINUS_A, OP_D_MINUS_M,
+    OP_A_MINUS_D, OP_M_MINUS_D,
+    OP_D_AND_A, OP_D_AND_M,
+    OP_D_OR_A, OP_D_OR_M,
+    OP_ALU_A,       // other comp bits with a=0
+    OP_ALU_M,       // other comp bits with a=1
+    OP_COUNT
+};
+
+// comp bits (a c1..c6) of the computations with a handler of their own.
+static const struct { uint8_t comp; uint8_t op; } compOps[] = {
+    { 0x2A, OP_ZERO }, { 0x3F, OP_ONE }, { 0x3A, OP_MINUS_ONE },
+    { 0x0C, OP_D }, { 0x30, OP_A_REG }, { 0x70, OP_M },
+    { 0x0D, OP_NOT_D }, { 0x31, OP_NOT_A }, { 0x71, OP_NOT_M },
+    { 0x0F, OP_NEG_D }, { 0x33, OP_NEG_A }, { 0x73, OP_NEG_M },
+    { 0x1F, OP_D_PLUS_ONE }, { 0x37, OP_A_PLUS_ONE }, { 0x77, OP_M_PLUS_ONE },
+    { 0x0E, OP_D_MINUS_ONE }, { 0x32, OP_A_MINUS_ONE }, { 0x72, OP_M_MINUS_ONE },
+    { 0x02, OP_D_PLUS_A }, { 0x42, OP_D_PLUS_M },
+    { 0x13, OP_D_MINUS_A }, { 0x53, OP_D_MINUS_M },
+    { 0x07, OP_A_MINUS_D }, { 0x47, OP_M_MINUS_D },
+    { 0x00, OP_D_AND_A }, { 0x40, OP_D_AND_M },
+    { 0x15, OP_D_OR_A }, { 0x55, OP_D_OR_M },
+};
+
+static Decoded decode(uint16_t word);
+static void mark_halts(Cpu *cpu);
+
+Cpu* cpu_init(void)
+{
+    Cpu *cpu = malloc(sizeof(Cpu));
+    if (!cpu) return NULL;
+
+    memset(cpu, 0, sizeof(Cpu));
+    cpu_load(cpu, NULL, 0);
+
+    return cpu;
+}
+
+// cpu_load replaces the ROM with words and decodes it, the RAM is kept.
+void cpu_load(Cpu *cpu, const uint16_t *words, size_t count)
+{
+    if (count > ROM_SIZE) count = ROM_SIZE;
+
+    memset(cpu->rom, 0, sizeof(cpu->rom));
+    if (count) memcpy(cpu->rom, words, count * sizeof(uint16_t));
+    cpu->rom_size = count;
+
+    for (size_t i = 0; i < ROM_SIZE; i++) {
+        cpu->decoded[i] = decode(cpu->rom[i]);
+    }
+    for (size_t i = count; i < ROM_SIZE; i++) {
+        cpu->decoded[i].op = OP_END;
+    }
+    mark_halts(cpu);
+
+    cpu_reset(cpu);
+}
+
+// cpu_load_file loads a .hack file, one 16 digit binary word per line.
+int cpu_load_file(Cpu *cpu, const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", filename);
+        return 1;
+    }
+
+    static uint16_t words[ROM_SIZE];
+    size_t count = 0, line_number = 0;
+    char line[256];
+    int errnum = 0;
+
+    while (fgets(line, sizeof(line), file))
+    {
+        line_number++;
+
+        uint16_t word = 0;
+        int digits = 0;
+        for (char *c = line; *c && *c != '\n' && *c != '\r'; c++)
+        {
+            if (*c != '0' && *c != '1') {
+                digits = -1;
+                break;
+            }
+            word = (word << 1) | (*c - '0');
+            digits++;
+        }
+
+        if (digits == 0) continue;
+        if (digits != 16)
+        {
+            fprintf(stderr, "Err %s: bad word on line: %zu\n", filename, line_number);
+            errnum = 1;
+            break;
+        }
+
+        if (count == ROM_SIZE)
+        {
+            fprintf(stderr, "Err %s: program does not fit the ROM\n", filename);
+            errnum = 1;
+            break;
+        }
+
+        words[count++] = word;
+    }
+
+    fclose(file);
+
+    if (!errnum) cpu_load(cpu, words, count);
+
+    return errnum;
+}
+
+// cpu_reset restarts the program, like the reset pin it leaves the RAM alone.
+void cpu_reset(Cpu *cpu)
+{
+    cpu->a = 0;
+    cpu->d = 0;
+    cpu->pc = 0;
+    cpu->cycles = 0;
+}
+
+int cpu_halted(Cpu *cpu)
+{
+    return cpu_halts_at(cpu, cpu->pc);
+}
+
+// cpu_halts_at tells if pc is past the program or on an @k, 0;JMP loop.
+int cpu_halts_at(const Cpu *cpu, uint16_t pc)
+{
+    uint8_t op = cpu->decoded[pc & (ROM_SIZE - 1)].op;
+
+    return op == OP_HALT || op == OP_END;
+}
+
+// cpu_run executes at most max_cycles instructions and returns how many
+// it did. Like the CPU chip of the book, M and a jump both use A as it was
+// before the instruction, so AM=M-1 writes the old address and A=M;JMP
+// jumps to the old A.
+uint64_t cpu_run(Cpu *cpu, uint64_t max_cycles)
+{
+    static const void *handlers[OP_COUNT] = {
+        [OP_A] = &&op_a, [OP_HALT] = &&op_halt, [OP_END] = &&op_end,
+        [OP_ZERO] = &&op_zero, [OP_ONE] = &&op_one, [OP_MINUS_ONE] = &&op_minus_one,
+        [OP_D] = &&op_d, [OP_A_REG] = &&op_a_reg, [OP_M] = &&op_m,
+        [OP_NOT_D] = &&op_not_d, [OP_NOT_A] = &&op_not_a, [OP_NOT_M] = &&op_not_m,
+        [OP_NEG_D] = &&op_neg_d, [OP_NEG_A] = &&op_neg_a, [OP_NEG_M] = &&op_neg_m,
+        [OP_D_PLUS_ONE] = &&op_d_plus_one, [OP_A_PLUS_ONE] = &&op_a_plus_one, [OP_M_PLUS_ONE] = &&op_m_plus_one,
+        [OP_D_MINUS_ONE] = &&op_d_minus_one, [OP_A_MINUS_ONE] = &&op_a_minus_one, [OP_M_MINUS_ONE] = &&op_m_minus_one,
+        [OP_D_PLUS_A] = &&op_d_plus_a, [OP_D_PLUS_M] = &&op_d_plus_m,
+        [OP_D_MINUS_A] = &&op_d_minus_a, [OP_D_MINUS_M] = &&op_d_minus_m,
+        [OP_A_MINUS_D] = &&op_a_minus_d, [OP_M_MINUS_D] = &&op_m_minus_d,
+        [OP_D_AND_A] = &&op_d_and_a, [OP_D_AND_M] = &&op_d_and_m,
+        [OP_D_OR_A] = &&op_d_or_a, [OP_D_OR_M] = &&op_d_or_m,
+        [OP_ALU_A] = &&op_alu_a, [OP_ALU_M] = &&op_alu_m,
+    };
+
+    uint16_t *ram = cpu->ram;
+    const Decoded *rom = cpu->decoded;
+    const Decoded *in;
+    uint16_t a = cpu->a, d = cpu->d, pc = cpu->pc, out;
+    uint64_t remaining = max_cycles;
+    int stop_at_halt = cpu->stop_at_halt;
+
+#define M ram[a & (RAM_SIZE - 1)]
+#define DISPATCH() do { \
+        if (!remaining) goto done; \
+        remaining--; \
+        in = &rom[pc]; \
+        goto *handlers[in->op]; \
+    } while (0)
+#define COMPUTE(expr) out = (uint16_t)(expr); goto store
+
+    DISPATCH();
+
+op_halt:
+op_end:
+    if (stop_at_halt)
+    {
+        remaining++;
+        goto done;
+    }
+op_a:
+    a = in->value;
+    pc = (pc + 1) & (ROM_SIZE - 1);
+    DISPATCH();
+
+op_zero:        COMPUTE(0);
+op_one:         COMPUTE(1);
+op_minus_one:   COMPUTE(-1);
+op_d:           COMPUTE(d);
+op_a_reg:       COMPUTE(a);
+op_m:           COMPUTE(M);
+op_not_d:       COMPUTE(~d);
+op_not_a:       COMPUTE(~a);
+op_not_m:       COMPUTE(~M);
+op_neg_d:       COMPUTE(-d);
+op_neg_a:       COMPUTE(-a);
+op_neg_m:       COMPUTE(-M);
+op_d_plus_one:  COMPUTE(d + 1);
+op_a_plus_one:  COMPUTE(a + 1);
+op_m_plus_one:  COMPUTE(M + 1);
+op_d_minus_one: COMPUTE(d - 1);
+op_a_minus_one: COMPUTE(a - 1);
+op_m_minus_one: COMPUTE(M - 1);
+op_d_plus_a:    COMPUTE(d + a);
+op_d_plus_m:    COMPUTE(d + M);
+op_d_minus_a:   COMPUTE(d - a);
+op_d_minus_m:   COMPUTE(d - M);
+op_a_minus_d:   COMPUTE(a - d);
+op_m_minus_d:   COMPUTE(M - d);
+op_d_and_a:     COMPUTE(d & a);
+op_d_and_m:     COMPUTE(d & M);
+op_d_or_a:      COMPUTE(d | a);
+op_d_or_m:      COMPUTE(d | M);
+op_alu_a:       COMPUTE(hack_alu(d, a, in->alu));
+op_alu_m:       COMPUTE(hack_alu(d, M, in->alu));
+
+store:
+    {
+        uint8_t flags = (int16_t)out < 0 ? JUMP_LT : out == 0 ? JUMP_EQ : JUMP_GT;
+        pc = (in->jump & flags) ? (a & (ROM_SIZE - 1)) : ((pc + 1) & (ROM_SIZE - 1));
+    }
+
+    if (in->dest & DEST_M) M = out;
+    if (in->dest & DEST_A) a = out;
+    if (in->dest & DEST_D) d = out;
+    DISPATCH();
+
+#undef COMPUTE
+#undef DISPATCH
+#undef M
+
+done:
+    cpu->a = a;
+    cpu->d = d;
+    cpu->pc = pc;
+    cpu->cycles += max_cycles - remaining;
+
+    return max_cycles - remaining;
+}
+
+void cpu_free(Cpu *cpu)
+{
+    free(cpu);
+}
+
+static Decoded decode(uint16_t word)
+{
+    Decoded in = { 0, 0, 0, 0, 0 };
+
+    if (!IS_C(word))
+    {
+        in.op = OP_A;
+        in.value = word;
+        return in;
+    }
+
+    uint8_t comp = COMP(word);
+    in.op = (comp & 0x40) ? OP_ALU_M : OP_ALU_A;
+    for (size_t i = 0; i < sizeof(compOps) / sizeof(compOps[0]); i++)
+    {
+        if (compOps[i].comp == comp) {
+            in.op = compOps[i].op;
+            break;
+        }
+    }
+
+    in.alu = comp & 0x3F;
+    in.dest = DEST(word);
+    in.jump = JUMP(word);
+
+    return in;
+}
+
+// mark_halts finds the @k, 0;JMP loops programs end with: an A-instruction
+// at address k loading k, followed by an unconditional jump that writes
+// nothing.
+static void mark_halts(Cpu *cpu)
+{
+    for (size_t k = 0; k + 1 < cpu->rom_size; k++)
+    {
+        Decoded *at = &cpu->decoded[k];
+        Decoded *next = &cpu->decoded[k + 1];
+
+        if (at->op == OP_A && at->value == k && next->op > OP_END && next->jump == 0x7 && next->dest == 0) {
+            at->op = OP_HALT;
+        }
+    }
+}
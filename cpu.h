@@ -0,0 +1,43 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include<stddef.h>
+#include<stdint.h>
+#include "./hack.h"
+
+// Decoded is a ROM word taken apart once when the program is loaded: op
+// picks the handler, the other fields are what the handler needs.
+typedef struct {
+    uint8_t op;
+    uint8_t dest;
+    uint8_t jump;
+    uint8_t alu;        // the zx nx zy ny f no bits, for the generic ALU
+    uint16_t value;     // the constant of an A-instruction
+}Decoded;
+
+// Cpu is a Hack computer: a flat 32K RAM, which includes the SCREEN and
+// KBD maps, and the ROM both as words and decoded.
+typedef struct {
+    uint16_t ram[RAM_SIZE];
+    uint16_t rom[ROM_SIZE];
+    Decoded decoded[ROM_SIZE];
+    size_t rom_size;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t cycles;
+    // stop at the end of the program or at an @k, 0;JMP loop on address k
+    // instead of spinning there.
+    int stop_at_halt;
+}Cpu;
+
+Cpu* cpu_init(void);
+void cpu_load(Cpu *cpu, const uint16_t *words, size_t count);
+int cpu_load_file(Cpu *cpu, const char *filename);
+void cpu_reset(Cpu *cpu);
+uint64_t cpu_run(Cpu *cpu, uint64_t max_cycles);
+int cpu_halted(Cpu *cpu);
+int cpu_halts_at(const Cpu *cpu, uint16_t pc);
+void cpu_free(Cpu *cpu);
+
+#endif
@@ -0,0 +1,30 @@
+#include<stdio.h>
+#include<stdarg.h>
+#include "./diag.h"
+
+// diag_report formats one error into d, or prints it as a line of its
+// own to stderr when d is NULL. Messages longer than DIAG_MESSAGE_SIZE
+// are cut short.
+void diag_report(Diagnostics *d, size_t line, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+
+    if (!d)
+    {
+        vfprintf(stderr, format, args);
+        fputc('\n', stderr);
+    }
+    else if (d->count < d->capacity)
+    {
+        Diagnostic *item = &d->items[d->count++];
+        item->line = line;
+        vsnprintf(item->message, sizeof(item->message), format, args);
+    }
+    else
+    {
+        d->dropped++;
+    }
+
+    va_end(args);
+}
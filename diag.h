@@ -0,0 +1,27 @@
+#ifndef DIAG_H
+#define DIAG_H
+
+#include<stddef.h>
+
+#define DIAG_MESSAGE_SIZE 128
+
+// Diagnostic is one error found while assembling, line is the source line
+// it is about or 0 when it is not about a line.
+typedef struct {
+    size_t line;
+    char message[DIAG_MESSAGE_SIZE];
+}Diagnostic;
+
+// Diagnostics collects errors into storage the caller owns: the first
+// capacity of them are kept in items, the rest are only counted in
+// dropped. Where a NULL Diagnostics is passed errors go to stderr.
+typedef struct {
+    Diagnostic *items;
+    size_t capacity;
+    size_t count;
+    size_t dropped;
+}Diagnostics;
+
+void diag_report(Diagnostics *d, size_t line, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#endif
@@ -0,0 +1,414 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include "./mnemonics.h"
+
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+
+// disassembler turns a .hack or .bin ROM back into assembly that assembles
+// to the same words. Every one of the 65536 words is rendered once into a
+// decode table built from the mnemonics of mnemonics.h, so the ROM is
+// turned into text with one table lookup and copy per word. An @n right
+// before a jump is taken for a jump target: n gets a synthetic label L<n>
+// and the @n is written as @L<n>, which assembles back to n.
+
+// DecodeEntry is the text of one word with its newline. text is copied
+// whole, so it has room to spare.
+typedef struct {
+    uint8_t len;
+    char text[15];
+}DecodeEntry;
+
+typedef enum{
+    INPUT_HACK,
+    INPUT_BIN
+}input_format;
+
+static DecodeEntry decode[1 << 16];
+
+static void build_decode_table(void);
+static const char* find_mnemonic(const struct TableEntity *table, uint16_t bits, int comp);
+static uint16_t parse_bits(const char *bits);
+static char* read_input(const char *path, size_t *size);
+static uint16_t* parse_hack(const char *path, const char *data, size_t size, size_t *count);
+static uint16_t* parse_bin(const char *path, const char *data, size_t size, int little_endian, size_t *count);
+static char* disassemble(const char *path, const uint16_t *words, size_t count, size_t *size);
+static int is_jump(uint16_t word);
+static int write_output(const char *path, const char *data, size_t size);
+static int has_extension(const char *filename, const char *ext);
+static double now_ms(void);
+
+int main(int argc, char *argv[])
+{
+    const char *input = NULL;
+    const char *output = "-";
+    int format = -1;
+    int little_endian = 0;
+    int print_time = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output = argv[++i];
+        } else if (!strcmp(argv[i], "--format=hack")) {
+            format = INPUT_HACK;
+        } else if (!strcmp(argv[i], "--format=bin")) {
+            format = INPUT_BIN;
+        } else if (!strcmp(argv[i], "--endian=little")) {
+            little_endian = 1;
+        } else if (!strcmp(argv[i], "--endian=big")) {
+            little_endian = 0;
+        } else if (!strcmp(argv[i], "--time")) {
+            print_time = 1;
+        } else {
+            input = argv[i];
+        }
+    }
+
+    if (!input)
+    {
+        fprintf(stderr, "usage: disassembler [--format=hack|bin] [--endian=big|little] [--time] [-o out.asm] program.hack|program.bin|-\n");
+        return 1;
+    }
+
+    if (format < 0) {
+        format = has_extension(input, ".bin") ? INPUT_BIN : INPUT_HACK;
+    }
+
+    double start = now_ms();
+    build_decode_table();
+
+    size_t size, count, text_size;
+    char *data = read_input(input, &size);
+    if (!data) return 1;
+
+    uint16_t *words = format == INPUT_BIN ? parse_bin(input, data, size, little_endian, &count)
+        : parse_hack(input, data, size, &count);
+    free(data);
+    if (!words) return 1;
+
+    char *text = disassemble(input, words, count, &text_size);
+    free(words);
+    if (!text) return 1;
+
+    int errnum = write_output(output, text, text_size);
+    free(text);
+
+    if (print_time) {
+        fprintf(stderr, "%s: %.3f ms, %zu words\n", input, now_ms() - start, count);
+    }
+
+    return errnum;
+}
+
+// build_decode_table renders every word: dest=comp;jump for the
+// C-instructions whose comp is in the table, @n for the rest. A word with
+// the top bit set that is no C-instruction is written @-n, the assembler
+// keeps the low 16 bits of a negative number. A C-instruction with neither
+// dest nor jump is written comp; since the assembler needs a '=' or ';' to
+// tell it from a label.
+static void build_decode_table(void)
+{
+    for (uint32_t word = 0; word < 1 << 16; word++)
+    {
+        char digits[8];
+        int n = 0;
+        uint32_t v = word < 0x8000 ? word : 0x10000 - word;
+        do {
+            digits[n++] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+
+        DecodeEntry *e = &decode[word];
+        e->len = 0;
+        e->text[e->len++] = '@';
+        if (word >= 0x8000) e->text[e->len++] = '-';
+        while (n) e->text[e->len++] = digits[--n];
+        e->text[e->len++] = '\n';
+    }
+
+    for (uint32_t comp = 0; comp < 128; comp++)
+    {
+        const char *c = find_mnemonic(computeEntityTable, comp, 1);
+        if (!c) continue;
+
+        for (uint32_t dest = 0; dest < 8; dest++)
+        {
+            const char *d = find_mnemonic(destEntityTable, dest, 0);
+
+            for (uint32_t jump = 0; jump < 8; jump++)
+            {
+                const char *j = find_mnemonic(jumpEntityTable, jump, 0);
+                DecodeEntry *e = &decode[0xE000 | comp << 6 | dest << 3 | jump];
+                int n = snprintf(e->text, sizeof(e->text), "%s%s%s%s%s\n", d, *d ? "=" : "", c,
+                    *j || !*d ? ";" : "", j);
+                e->len = n;
+            }
+        }
+    }
+}
+
+// find_mnemonic returns the first mnemonic of table with bits, for comp the
+// a-bit is bit 6 and set by the mnemonics that read M.
+static const char* find_mnemonic(const struct TableEntity *table, uint16_t bits, int comp)
+{
+    for (int i = 0; table[i].mnemonic; i++)
+    {
+        uint16_t entry = parse_bits(table[i].bits);
+        if (comp && strchr(table[i].mnemonic, 'M')) entry |= 1 << 6;
+        if (entry == bits) return table[i].mnemonic;
+    }
+
+    return NULL;
+}
+
+static uint16_t parse_bits(const char *bits)
+{
+    uint16_t val = 0;
+    while (*bits) {
+        val = (val << 1) | (*bits++ == '1');
+    }
+
+    return val;
+}
+
+// read_input reads the whole input, "-" is stdin.
+static char* read_input(const char *path, size_t *size)
+{
+    FILE *file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", path);
+        return NULL;
+    }
+
+    // a file is read in one go, a pipe into a buffer that doubles.
+    size_t cap = 1 << 16, len = 0;
+    if (file != stdin && !fseek(file, 0, SEEK_END))
+    {
+        long end = ftell(file);
+        if (end >= 0) cap = end + 1;
+        rewind(file);
+    }
+    char *data = malloc(cap);
+
+    while (data)
+    {
+        len += fread(data + len, 1, cap - len, file);
+        if (len < cap) break;
+
+        char *grown = realloc(data, cap * 2);
+        if (!grown) {
+            free(data);
+        }
+        data = grown;
+        cap *= 2;
+    }
+
+    int failed = !data || ferror(file);
+    if (file != stdin) fclose(file);
+
+    if (failed)
+    {
+        fprintf(stderr, "Err reading %s\n", path);
+        free(data);
+        return NULL;
+    }
+
+    *size = len;
+
+    return data;
+}
+
+// parse_hack reads one 16 digit binary word per line, blank lines are
+// skipped like the emulator does.
+static uint16_t* parse_hack(const char *path, const char *data, size_t size, size_t *count)
+{
+    uint16_t *words = malloc((size / 17 + 1) * sizeof(uint16_t));
+    if (!words)
+    {
+        fprintf(stderr, "Err %s: out of memory\n", path);
+        return NULL;
+    }
+
+    const char *c = data, *end = data + size;
+    size_t n = 0, line = 0;
+
+    while (c < end)
+    {
+        line++;
+
+        // nearly every line is 16 digits and a newline.
+        const char *nl = end - c > 16 && c[16] == '\n' ? c + 16 : memchr(c, '\n', end - c);
+        const char *stop = nl ? nl : end;
+        size_t len = stop - c;
+        if (len && c[len - 1] == '\r') len--;
+
+        if (len == 0)
+        {
+            c = stop + 1;
+            continue;
+        }
+
+        uint16_t word = 0;
+        int ok = len == 16;
+#ifdef __SSE2__
+        if (ok)
+        {
+            // '0' and '1' differ in the low bit only. The digits are put
+            // in reverse order, the most significant one in lane 15, and
+            // movemask collects the low bits shifted to the top of each lane.
+            __m128i v = _mm_loadu_si128((const __m128i*)c);
+            ok = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(~1)), _mm_set1_epi8('0'))) == 0xFFFF;
+
+            v = _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3));
+            v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+            v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+            word = _mm_movemask_epi8(_mm_slli_epi16(v, 7));
+        }
+#else
+        for (size_t i = 0; ok && i < 16; i++)
+        {
+            ok = c[i] == '0' || c[i] == '1';
+            word = (word << 1) | (c[i] & 1);
+        }
+#endif
+
+        if (!ok)
+        {
+            fprintf(stderr, "Err %s: bad word on line: %zu\n", path, line);
+            free(words);
+            return NULL;
+        }
+
+        words[n++] = word;
+        c = stop + 1;
+    }
+
+    *count = n;
+
+    return words;
+}
+
+// parse_bin reads raw 16-bit words, big endian unless little_endian.
+static uint16_t* parse_bin(const char *path, const char *data, size_t size, int little_endian, size_t *count)
+{
+    if (size % 2)
+    {
+        fprintf(stderr, "Err %s: odd number of bytes\n", path);
+        return NULL;
+    }
+
+    uint16_t *words = malloc((size / 2 + 1) * sizeof(uint16_t));
+    if (!words)
+    {
+        fprintf(stderr, "Err %s: out of memory\n", path);
+        return NULL;
+    }
+
+    const uint8_t *b = (const uint8_t*)data;
+    for (size_t i = 0; i < size / 2; i++) {
+        words[i] = little_endian ? b[2 * i] | b[2 * i + 1] << 8 : b[2 * i] << 8 | b[2 * i + 1];
+    }
+
+    *count = size / 2;
+
+    return words;
+}
+
+// disassemble writes the program with labels on the jump targets.
+static char* disassemble(const char *path, const uint16_t *words, size_t count, size_t *size)
+{
+    // a label can sit after the last instruction.
+    uint8_t *labels = calloc(count + 1, 1);
+    if (!labels)
+    {
+        fprintf(stderr, "Err %s: out of memory\n", path);
+        return NULL;
+    }
+
+    for (size_t i = 0; i + 1 < count; i++)
+    {
+        if (words[i] < 0x8000 && words[i] <= count && is_jump(words[i + 1])) {
+            labels[words[i]] = 1;
+        }
+    }
+
+    // the entry copy writes 15 bytes whatever the length of the line, a
+    // label line takes less than 32.
+    char *text = malloc(count * (sizeof(decode[0].text) + 32) + 32);
+    if (!text)
+    {
+        fprintf(stderr, "Err %s: out of memory\n", path);
+        free(labels);
+        return NULL;
+    }
+
+    char *out = text;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t word = words[i];
+
+        if (labels[i]) out += sprintf(out, "(L%zu)\n", i);
+
+        if (word < 0x8000 && word <= count && labels[word] && i + 1 < count && is_jump(words[i + 1]))
+        {
+            out += sprintf(out, "@L%u\n", word);
+            continue;
+        }
+
+        memcpy(out, decode[word].text, sizeof(decode[word].text));
+        out += decode[word].len;
+    }
+
+    if (labels[count]) out += sprintf(out, "(L%zu)\n", count);
+
+    free(labels);
+    *size = out - text;
+
+    return text;
+}
+
+// is_jump tells whether word is a C-instruction with jump bits.
+static int is_jump(uint16_t word)
+{
+    return (word & 0x7) && decode[word].text[0] != '@';
+}
+
+static int write_output(const char *path, const char *data, size_t size)
+{
+    FILE *file = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    if (!file)
+    {
+        fprintf(stderr, "can not write file:%s\n", path);
+        return 1;
+    }
+
+    int errnum = fwrite(data, 1, size, file) != size;
+    errnum |= file == stdout ? fflush(stdout) != 0 : fclose(file) != 0;
+    if (errnum) {
+        fprintf(stderr, "can not write file:%s\n", path);
+    }
+
+    return errnum;
+}
+
+static int has_extension(const char *filename, const char *ext)
+{
+    size_t len = strlen(filename), ext_len = strlen(ext);
+
+    return len >= ext_len && !strcmp(filename + len - ext_len, ext);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,222 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include "./cpu.h"
+#include "./jit.h"
+#include "./batch.h"
+#include "./tst.h"
+
+// emulator runs a .hack (or .asm) program until it halts, or a .tst test
+// script against its .cmp file.
+
+static double now_ms(void);
+static int dump_ram(Cpu *cpu, const char *range);
+static int parse_range(const char *range, long *from, long *to);
+static int run_lanes(Cpu *cpu, const char *filename, BatchOptions *options, const char *dump, int print_time);
+static int write_screen(Cpu *cpu, const char *filename);
+static int has_extension(const char *filename, const char *ext);
+
+int main(int argc, char *argv[])
+{
+    const char *input = NULL;
+    const char *dump = NULL;
+    const char *screen = NULL;
+    uint64_t max_cycles = UINT64_MAX;
+    int print_time = 0;
+    int use_jit = 0;
+    const char *lanes = NULL;
+    BatchOptions batch = { 0, UINT64_MAX, 0, 0, 0 };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            max_cycles = strtoull(argv[++i], NULL, 10);
+        } else if (!strncmp(argv[i], "--cycles=", 9)) {
+            max_cycles = strtoull(argv[i] + 9, NULL, 10);
+        } else if (!strncmp(argv[i], "--dump=", 7)) {
+            dump = argv[i] + 7;
+        } else if (!strncmp(argv[i], "--screen=", 9)) {
+            screen = argv[i] + 9;
+        } else if (!strcmp(argv[i], "--time")) {
+            print_time = 1;
+        } else if (!strcmp(argv[i], "--jit")) {
+            use_jit = 1;
+        } else if (!strncmp(argv[i], "--lanes=", 8)) {
+            lanes = argv[i] + 8;
+        } else if (!strcmp(argv[i], "--serial")) {
+            batch.serial = 1;
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            batch.workers = strtoul(argv[++i], NULL, 10);
+        } else {
+            input = argv[i];
+        }
+    }
+
+    if (!input)
+    {
+        fprintf(stderr, "usage: emulator [-n cycles] [--dump=from-to] [--screen=file.pbm] [--time] [--jit] [--lanes=file [--serial] [-j N]] program.hack|program.asm|script.tst\n");
+        return 1;
+    }
+
+    if (has_extension(input, ".tst")) {
+        return tst_run(input) ? 1 : 0;
+    }
+
+    Cpu *cpu = cpu_init();
+    if (!cpu)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    if (load_program(cpu, input))
+    {
+        cpu_free(cpu);
+        return 1;
+    }
+
+    cpu->stop_at_halt = 1;
+
+    if (lanes)
+    {
+        batch.max_cycles = max_cycles;
+        int errnum = run_lanes(cpu, lanes, &batch, dump, print_time);
+        cpu_free(cpu);
+        return errnum;
+    }
+
+    Jit *jit = NULL;
+    if (use_jit && !(jit = jit_init(cpu))) {
+        fprintf(stderr, "no JIT on this host, interpreting\n");
+    }
+
+    double start = now_ms();
+    uint64_t cycles = jit ? jit_run(jit, max_cycles) : cpu_run(cpu, max_cycles);
+    double elapsed = now_ms() - start;
+
+    fprintf(stderr, "%s after %llu instructions at PC %u\n", cpu_halted(cpu) ? "halted" : "stopped",
+        (unsigned long long)cycles, cpu->pc);
+    if (print_time) {
+        fprintf(stderr, "%.3f ms, %.1f M instructions/s\n", elapsed, elapsed > 0 ? cycles / elapsed / 1000 : 0.0);
+    }
+
+    int ext_code = 0;
+    if (dump && dump_ram(cpu, dump)) ext_code = 1;
+    if (screen && write_screen(cpu, screen)) ext_code = 1;
+
+    jit_free(jit);
+    cpu_free(cpu);
+
+    return ext_code;
+}
+
+// run_lanes runs the program once per line of filename, see batch.h, and
+// prints how each lane ended and its part of the RAM in the dump range.
+static int run_lanes(Cpu *cpu, const char *filename, BatchOptions *options, const char *dump, int print_time)
+{
+    Lane *lanes;
+    size_t count;
+    long from = 0, to = -1;
+
+    if (dump && parse_range(dump, &from, &to)) return 1;
+    if (batch_read_lanes(filename, &lanes, &count)) return 1;
+
+    options->dump_from = from;
+    options->dump_count = to - from + 1;
+
+    double start = now_ms();
+    int errnum = batch_run(cpu, lanes, count, options);
+    double elapsed = now_ms() - start;
+
+    uint64_t cycles = 0;
+    for (size_t i = 0; i < count && !errnum; i++)
+    {
+        Lane *lane = &lanes[i];
+        cycles += lane->cycles;
+
+        printf("lane %zu: %s after %llu instructions at PC %u\n", i, lane->halted ? "halted" : "stopped",
+            (unsigned long long)lane->cycles, lane->pc);
+        for (long k = from; k <= to; k++) {
+            printf("lane %zu: RAM[%ld] = %d\n", i, k, (int16_t)lane->dump[k - from]);
+        }
+    }
+
+    if (print_time && !errnum) {
+        fprintf(stderr, "%zu lanes, %llu instructions, %.3f ms, %.1f M instructions/s\n", count,
+            (unsigned long long)cycles, elapsed, elapsed > 0 ? cycles / elapsed / 1000 : 0.0);
+    }
+
+    batch_free_lanes(lanes, count);
+
+    return errnum;
+}
+
+// dump_ram prints RAM[from] to RAM[to] as signed decimals, one per line.
+static int dump_ram(Cpu *cpu, const char *range)
+{
+    long from, to;
+    if (parse_range(range, &from, &to)) return 1;
+
+    for (long i = from; i <= to; i++) {
+        printf("RAM[%ld] = %d\n", i, (int16_t)cpu->ram[i]);
+    }
+
+    return 0;
+}
+
+static int parse_range(const char *range, long *from, long *to)
+{
+    char *end;
+    *from = strtol(range, &end, 10);
+    *to = *end == '-' ? strtol(end + 1, &end, 10) : *from;
+
+    if (*end || *from < 0 || *to < *from || *to >= RAM_SIZE)
+    {
+        fprintf(stderr, "bad RAM range: %s\n", range);
+        return 1;
+    }
+
+    return 0;
+}
+
+// write_screen saves the screen map as a plain black and white PBM, bit 0
+// of a word being its leftmost pixel.
+static int write_screen(Cpu *cpu, const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", filename);
+        return 1;
+    }
+
+    fprintf(file, "P1\n%d %d\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+    for (int y = 0; y < SCREEN_HEIGHT; y++)
+    {
+        for (int x = 0; x < SCREEN_WIDTH; x++)
+        {
+            uint16_t word = cpu->ram[SCREEN + y * (SCREEN_WIDTH / 16) + x / 16];
+            fputc((word >> (x % 16)) & 1 ? '1' : '0', file);
+        }
+        fputc('\n', file);
+    }
+
+    return fclose(file) ? 1 : 0;
+}
+
+static int has_extension(const char *filename, const char *ext)
+{
+    size_t len = strlen(filename), ext_len = strlen(ext);
+
+    return len >= ext_len && !strcmp(filename + len - ext_len, ext);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
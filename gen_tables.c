@@ -0,0 +1,232 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./mnemonics.h"
+
+// gen_tables writes encode_tables.h: one perfect hash table per C-instruction
+// field, mapping a mnemonic packed into a 32-bit key straight to its bits
+// already shifted into place (the comp entries carry the a-bit as well),
+// and the byte to ASCII bits table used to print .hack lines without SSE2.
+// Besides the book spellings the tables accept commuted operands (A+D, M|D,
+// 1+D) and any order of the dest registers (DM, MA, DAM, ...).
+
+#define MAX_KEYS 128
+#define MAX_HASH_BITS 10
+
+typedef struct {
+    uint32_t key;
+    uint16_t bits;
+}Entry;
+
+typedef struct {
+    Entry entries[MAX_KEYS];
+    size_t count;
+}KeySet;
+
+static uint32_t pack(const char *mnemonic);
+static uint16_t parse_bits(const char *bits);
+static void add(KeySet *set, const char *mnemonic, uint16_t bits);
+static void add_permutations(KeySet *set, char *m, size_t k, size_t len, uint16_t bits);
+static void add_dest(KeySet *set);
+static void add_comp(KeySet *set);
+static void add_jump(KeySet *set);
+static void emit(const char *name, const char *prefix, KeySet *set);
+static void emit_byte_table(void);
+
+int main(void)
+{
+    KeySet dest = { .count = 0 }, comp = { .count = 0 }, jump = { .count = 0 };
+
+    add_dest(&dest);
+    add_comp(&comp);
+    add_jump(&jump);
+
+    printf("// generated by gen_tables, do not edit.\n");
+    printf("#ifndef ENCODE_TABLES_H\n#define ENCODE_TABLES_H\n\n");
+    printf("#include<stdint.h>\n\n");
+    printf("typedef struct {\n    uint32_t key;\n    uint16_t bits;\n}EncodeEntry;\n\n");
+    printf("#define ENCODE_HASH(key, mult, shift) ((uint32_t)((key) * (mult)) >> (shift))\n\n");
+
+    emit("destHashTable", "DEST", &dest);
+    emit("compHashTable", "COMP", &comp);
+    emit("jumpHashTable", "JUMP", &jump);
+    emit_byte_table();
+
+    printf("#endif\n");
+
+    return 0;
+}
+
+// pack puts up to three mnemonic bytes and the length into a key, longer
+// mnemonics can not be valid so they never reach the tables. It has to
+// match pack_mnemonic() in code.c.
+static uint32_t pack(const char *mnemonic)
+{
+    uint32_t key = 0;
+    size_t i;
+    for (i = 0; mnemonic[i]; i++) {
+        key |= (uint32_t)(unsigned char)mnemonic[i] << (8 * i);
+    }
+
+    return key | (uint32_t)i << 24;
+}
+
+static uint16_t parse_bits(const char *bits)
+{
+    uint16_t val = 0;
+    while (*bits) {
+        val = (val << 1) | (*bits++ == '1');
+    }
+
+    return val;
+}
+
+static void add(KeySet *set, const char *mnemonic, uint16_t bits)
+{
+    uint32_t key = pack(mnemonic);
+
+    for (size_t i = 0; i < set->count; i++)
+    {
+        if (set->entries[i].key == key) return;
+    }
+
+    if (set->count == MAX_KEYS)
+    {
+        fprintf(stderr, "gen_tables: too many mnemonics\n");
+        exit(1);
+    }
+
+    set->entries[set->count].key = key;
+    set->entries[set->count].bits = bits;
+    set->count++;
+}
+
+static void add_permutations(KeySet *set, char *m, size_t k, size_t len, uint16_t bits)
+{
+    if (k == len)
+    {
+        add(set, m, bits);
+        return;
+    }
+
+    for (size_t i = k; i < len; i++)
+    {
+        char t = m[k]; m[k] = m[i]; m[i] = t;
+        add_permutations(set, m, k + 1, len, bits);
+        t = m[k]; m[k] = m[i]; m[i] = t;
+    }
+}
+
+static void add_dest(KeySet *set)
+{
+    for (int i = 0; destEntityTable[i].mnemonic; i++)
+    {
+        char m[4] = { 0 };
+        strncpy(m, destEntityTable[i].mnemonic, 3);
+        if (!*m) continue;
+
+        // every ordering of the registers.
+        add_permutations(set, m, 0, strlen(m), parse_bits(destEntityTable[i].bits) << 3);
+    }
+}
+
+static void add_comp(KeySet *set)
+{
+    for (int i = 0; computeEntityTable[i].mnemonic; i++)
+    {
+        const char *m = computeEntityTable[i].mnemonic;
+        uint16_t bits = parse_bits(computeEntityTable[i].bits) << 6;
+        if (strchr(m, 'M')) bits |= 1 << 12;
+
+        add(set, m, bits);
+
+        // x+y, x&y and x|y commute.
+        if (strlen(m) == 3 && (m[1] == '+' || m[1] == '&' || m[1] == '|'))
+        {
+            char swapped[4] = { m[2], m[1], m[0], 0 };
+            add(set, swapped, bits);
+        }
+    }
+}
+
+static void add_jump(KeySet *set)
+{
+    for (int i = 0; jumpEntityTable[i].mnemonic; i++)
+    {
+        const char *m = jumpEntityTable[i].mnemonic;
+        if (!*m) continue;
+
+        add(set, m, parse_bits(jumpEntityTable[i].bits));
+    }
+}
+
+// emit searches the smallest table and a multiplier for which every key
+// lands in its own slot, then prints it.
+static void emit(const char *name, const char *prefix, KeySet *set)
+{
+    static uint8_t used[1 << MAX_HASH_BITS];
+    uint32_t seed = 2654435769u;
+
+    for (int bits = 1; bits <= MAX_HASH_BITS; bits++)
+    {
+        size_t size = (size_t)1 << bits;
+        if (size < set->count) continue;
+
+        for (int attempt = 0; attempt < 200000; attempt++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            uint32_t mult = seed | 1;
+            int shift = 32 - bits;
+            int ok = 1;
+
+            memset(used, 0, size);
+            for (size_t i = 0; i < set->count && ok; i++)
+            {
+                uint32_t h = (uint32_t)(set->entries[i].key * mult) >> shift;
+                if (used[h]) ok = 0;
+                used[h] = 1;
+            }
+
+            if (!ok) continue;
+
+            printf("#define %s_HASH_MULT %uu\n", prefix, mult);
+            printf("#define %s_HASH_SHIFT %d\n\n", prefix, shift);
+            printf("static const EncodeEntry %s[%zu] = {\n", name, size);
+            for (size_t slot = 0; slot < size; slot++)
+            {
+                uint32_t key = 0;
+                uint16_t val = 0;
+                for (size_t i = 0; i < set->count; i++)
+                {
+                    if (((uint32_t)(set->entries[i].key * mult) >> shift) == slot)
+                    {
+                        key = set->entries[i].key;
+                        val = set->entries[i].bits;
+                    }
+                }
+                printf("    {0x%08x, 0x%04x},\n", key, val);
+            }
+            printf("};\n\n");
+            return;
+        }
+    }
+
+    fprintf(stderr, "gen_tables: no perfect hash found for %s\n", name);
+    exit(1);
+}
+
+static void emit_byte_table(void)
+{
+    printf("#ifndef __SSE2__\n");
+    printf("static const char hackByteTable[256][8] = {\n");
+    for (int byte = 0; byte < 256; byte++)
+    {
+        printf("    {");
+        for (int bit = 7; bit >= 0; bit--) {
+            printf("'%c'%s", (byte >> bit) & 1 ? '1' : '0', bit ? ", " : "");
+        }
+        printf("},\n");
+    }
+    printf("};\n#endif\n\n");
+}
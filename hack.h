@@ -0,0 +1,48 @@
+#ifndef HACK_H
+#define HACK_H
+
+#include<stdint.h>
+
+// the Hack memory map and instruction words, shared by the assembler and
+// the emulator.
+
+#define SCREEN 16384
+#define KBD 24576
+
+#define SCREEN_WIDTH 512
+#define SCREEN_HEIGHT 256
+
+#define ROM_SIZE 32768
+#define RAM_SIZE 32768
+
+// fields of an instruction word, a C-instruction has bit 15 set.
+#define IS_C(word) ((word) & 0x8000)
+#define COMP(word) (((word) >> 6) & 0x7F)
+#define DEST(word) (((word) >> 3) & 0x7)
+#define JUMP(word) ((word) & 0x7)
+
+// destination and jump bits of a C-instruction.
+#define DEST_A 0x4
+#define DEST_D 0x2
+#define DEST_M 0x1
+
+#define JUMP_LT 0x4
+#define JUMP_EQ 0x2
+#define JUMP_GT 0x1
+#define JUMP_ALWAYS 0x7
+
+// hack_alu is the Hack ALU for any comp bits: zero and/or negate x and y,
+// add or and them, negate the result. x is D, y is A or M.
+static inline uint16_t hack_alu(uint16_t x, uint16_t y, uint8_t bits)
+{
+    if (bits & 0x20) x = 0;
+    if (bits & 0x10) x = ~x;
+    if (bits & 0x08) y = 0;
+    if (bits & 0x04) y = ~y;
+
+    uint16_t out = (bits & 0x02) ? (uint16_t)(x + y) : (x & y);
+
+    return (bits & 0x01) ? (uint16_t)~out : out;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#include<stdio.h>
+#include<stddef.h>
+#include "./hackasm.h"
+#include "./parser.h"
+#include "./code.h"
+#include "./arena.h"
+#include "./diag.h"
+
+// the arena of a call grows in blocks of this size, or a quarter of
+// max_memory when that is smaller.
+#define HACKASM_ARENA_BLOCK (64 * 1024)
+#define HACKASM_ARENA_MIN_BLOCK 1024
+
+static const output_format formats[] = { FORMAT_HACK, FORMAT_BIN, FORMAT_IHEX, FORMAT_C };
+
+// hack_assemble assembles the len bytes at src with the two pass
+// assembler into out. Errors are added to diagnostics, which may be NULL
+// when only the result matters; nothing is printed. Every allocation of
+// the call comes from an arena of its own that is freed before it
+// returns.
+int hack_assemble(const char *src, size_t len, const HackOptions *options, HackBuffer *out, Diagnostics *diagnostics)
+{
+    static const HackOptions defaults = { HACKASM_HACK, 0, 0, 0, NULL, 0 };
+    Diagnostics ignored = { NULL, 0, 0, 0 };
+    Diagnostics *diag = diagnostics ? diagnostics : &ignored;
+
+    if (!options) options = &defaults;
+    out->size = 0;
+
+    if ((unsigned)options->format >= sizeof(formats) / sizeof(formats[0]))
+    {
+        diag_report(diag, 0, "unknown output format: %d", (int)options->format);
+        return HACKASM_ERROR;
+    }
+
+    size_t block = HACKASM_ARENA_BLOCK;
+    if (options->max_memory && options->max_memory / 4 < block) block = options->max_memory / 4;
+    if (block < HACKASM_ARENA_MIN_BLOCK) block = HACKASM_ARENA_MIN_BLOCK;
+
+    Arena *arena = arena_init(block);
+    if (!arena)
+    {
+        diag_report(diag, 0, "Err out of memory");
+        return HACKASM_NO_MEMORY;
+    }
+    arena_set_limit(arena, options->max_memory);
+
+    int result = HACKASM_NO_MEMORY;
+    Parser *parser = init_parser_buffer(src, len, arena);
+    Code *c = parser ? init_code(parser, options->name ? options->name : "input", arena) : NULL;
+
+    if (c)
+    {
+        CodeOptions code_options = { options->encode_threads, formats[options->format], options->little_endian, options->optimize };
+        code_set_options(c, &code_options);
+        code_set_diagnostics(c, diag);
+        code_set_output_buffer(c, out->data, out->capacity);
+
+        int errnum = assemble(c);
+        out->size = code_output_size(c);
+
+        if (!errnum) {
+            result = HACKASM_OK;
+        } else if (errnum == CODE_NO_SPACE) {
+            result = HACKASM_NO_SPACE;
+        } else if (!arena_refused(arena)) {
+            result = HACKASM_ERROR;
+        }
+
+        free_code(c);
+    }
+    else
+    {
+        free_parser(parser);
+    }
+
+    if (result == HACKASM_NO_MEMORY) {
+        diag_report(diag, 0, "Err out of memory, the limit is %zu bytes", options->max_memory);
+    }
+
+    arena_free(arena);
+
+    return result;
+}
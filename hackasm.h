@@ -0,0 +1,49 @@
+#ifndef HACKASM_H
+#define HACKASM_H
+
+#include<stddef.h>
+#include "./diag.h"
+
+// libhackasm assembles a program held in memory into a buffer the caller
+// owns. A call keeps all of its state to itself and touches no file, so
+// any number of threads can assemble at once.
+
+#define HACKASM_OK 0
+#define HACKASM_ERROR 1         // the source does not assemble, see the diagnostics
+#define HACKASM_NO_SPACE 2      // the output does not fit, out->size is what it takes
+#define HACKASM_NO_MEMORY 3     // the run needed more than max_memory bytes
+
+// hackasm_format picks the output, the same choices as --format.
+typedef enum{
+    HACKASM_HACK,
+    HACKASM_BIN,
+    HACKASM_IHEX,
+    HACKASM_C
+}hackasm_format;
+
+typedef struct {
+    hackasm_format format;
+    // byte order of the words in the bin and ihex formats, big endian by default.
+    int little_endian;
+    // encode_threads > 0 encodes the hack format on that many threads.
+    size_t encode_threads;
+    // max_memory > 0 caps the bytes one call allocates for its parser,
+    // symbols, IR and output staging.
+    size_t max_memory;
+    // name is only used in the header of the C output, "input" by default.
+    const char *name;
+    // optimize runs the peephole pass of -O.
+    int optimize;
+}HackOptions;
+
+// HackBuffer is where the output goes: capacity bytes at data. size is
+// set to the bytes written, or the bytes needed with HACKASM_NO_SPACE.
+typedef struct {
+    char *data;
+    size_t capacity;
+    size_t size;
+}HackBuffer;
+
+int hack_assemble(const char *src, size_t len, const HackOptions *options, HackBuffer *out, Diagnostics *diagnostics);
+
+#endif
@@ -0,0 +1,23 @@
+#include<errno.h>
+#include<unistd.h>
+#include "./io.h"
+
+// write_all writes size bytes to fd however many write() calls it takes,
+// and returns nonzero with errno set when one fails.
+int write_all(int fd, const char *buffer, size_t size)
+{
+    while (size)
+    {
+        ssize_t written = write(fd, buffer, size);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+
+        buffer += written;
+        size -= written;
+    }
+
+    return 0;
+}
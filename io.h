@@ -0,0 +1,8 @@
+#ifndef IO_H
+#define IO_H
+
+#include<stddef.h>
+
+int write_all(int fd, const char *buffer, size_t size);
+
+#endif
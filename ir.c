@@ -0,0 +1,274 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./ir.h"
+#include "./table.h"
+
+#define IR_INITIAL_CAPACITY 1024
+#define IR_INITIAL_SYMBOLS 64
+
+static int grow_instructions(IR *ir);
+static int grow_symbols(IR *ir);
+static int grow_slots(IR *ir);
+static uint32_t* find_slot(IR *ir, const char *name, size_t len, uint32_t hash);
+static int charge(IR *ir, size_t size);
+
+IR* ir_init(void)
+{
+    IR *ir = malloc(sizeof(IR));
+    if (!ir) return NULL;
+
+    memset(ir, 0, sizeof(IR));
+
+    return ir;
+}
+
+int ir_push(IR *ir, ir_kind kind, uint32_t operand, uint32_t line)
+{
+    if (ir->count == ir->capacity && grow_instructions(ir)) {
+        return 1;
+    }
+
+    ir->kinds[ir->count] = kind;
+    ir->operands[ir->count] = operand;
+    ir->lines[ir->count] = line;
+    ir->count++;
+
+    if (kind != IR_LABEL) {
+        ir->rom_size++;
+    }
+
+    return 0;
+}
+
+// ir_reserve makes room for count more instructions, for a caller that
+// fills the arrays itself.
+int ir_reserve(IR *ir, size_t count)
+{
+    while (ir->count + count > ir->capacity) {
+        if (grow_instructions(ir)) return 1;
+    }
+
+    return 0;
+}
+
+// ir_intern returns the id of name, adding it when it is not known yet.
+// created is set when a new id was handed out. IR_NO_SYMBOL is returned
+// when out of memory.
+uint32_t ir_intern(IR *ir, const char *name, size_t len, int *created)
+{
+    if (created) *created = 0;
+
+    if ((ir->symbol_count + 1) * 2 > ir->slot_count && grow_slots(ir)) {
+        return IR_NO_SYMBOL;
+    }
+
+    uint32_t hash = table_hash(name, len);
+    uint32_t *slot = find_slot(ir, name, len, hash);
+    if (*slot) {
+        return *slot - 1;
+    }
+
+    if (ir->symbol_count == ir->symbol_capacity && grow_symbols(ir)) {
+        return IR_NO_SYMBOL;
+    }
+
+    if (ir->names_size + len > ir->names_capacity)
+    {
+        size_t capacity = ir->names_capacity ? ir->names_capacity * 2 : 4096;
+        while (capacity < ir->names_size + len) capacity *= 2;
+        if (charge(ir, capacity - ir->names_capacity)) return IR_NO_SYMBOL;
+
+        char *names = realloc(ir->names, capacity);
+        if (!names) return IR_NO_SYMBOL;
+
+        ir->names = names;
+        ir->names_capacity = capacity;
+    }
+
+    uint32_t id = ir->symbol_count++;
+    memcpy(ir->names + ir->names_size, name, len);
+    ir->name_offsets[id] = ir->names_size;
+    ir->name_lengths[id] = len;
+    ir->names_size += len;
+    ir->hashes[id] = hash;
+    ir->values[id] = 0;
+    ir->defined[id] = 0;
+    *slot = id + 1;
+
+    if (created) *created = 1;
+
+    return id;
+}
+
+uint32_t ir_find(IR *ir, const char *name, size_t len)
+{
+    if (!ir->slot_count) return IR_NO_SYMBOL;
+
+    uint32_t *slot = find_slot(ir, name, len, table_hash(name, len));
+
+    return *slot ? *slot - 1 : IR_NO_SYMBOL;
+}
+
+const char* ir_symbol_name(IR *ir, uint32_t id, size_t *len)
+{
+    if (id >= ir->symbol_count) return NULL;
+
+    if (len) *len = ir->name_lengths[id];
+
+    return ir->names + ir->name_offsets[id];
+}
+
+void ir_free(IR *ir)
+{
+    if (!ir) return;
+
+    free(ir->kinds);
+    free(ir->operands);
+    free(ir->lines);
+    free(ir->names);
+    free(ir->name_offsets);
+    free(ir->name_lengths);
+    free(ir->hashes);
+    free(ir->values);
+    free(ir->defined);
+    free(ir->slots);
+    free(ir);
+}
+
+// ir_table_stats reports the interned symbols hash, a probe being a slot.
+void ir_table_stats(IR *ir, TableStats *stats)
+{
+    uint32_t mask = ir->slot_count - 1;
+    size_t total_probes = 0;
+
+    memset(stats, 0, sizeof(TableStats));
+    stats->capacity = ir->slot_count;
+    stats->used = ir->symbol_count;
+
+    for (uint32_t i = 0; i < ir->slot_count; i++)
+    {
+        if (!ir->slots[i]) continue;
+
+        size_t probes = ((i - ir->hashes[ir->slots[i] - 1]) & mask) + 1;
+        total_probes += probes;
+        if (probes > stats->longest_probe) stats->longest_probe = probes;
+    }
+
+    stats->average_probe = stats->used ? (double)total_probes / stats->used : 0;
+}
+
+// ir_allocated_bytes is the heap the IR holds, spare capacity included.
+size_t ir_allocated_bytes(IR *ir)
+{
+    return ir->capacity * (sizeof(uint8_t) + 2 * sizeof(uint32_t))
+        + ir->names_capacity
+        + ir->symbol_capacity * (3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t))
+        + ir->slot_count * sizeof(uint32_t);
+}
+
+// find_slot is the hot lookup of scan(), once per symbol reference; the
+// SymbolTable only sees each distinct name once, for its predefined value.
+// The index hashes like the table but probes single slots of ids at half
+// load: the table's control bytes would add a cache miss per lookup here,
+// and its 16-bit values can not hold an id.
+static uint32_t* find_slot(IR *ir, const char *name, size_t len, uint32_t hash)
+{
+    uint32_t mask = ir->slot_count - 1;
+    uint32_t i = hash & mask;
+
+    for (;;)
+    {
+        uint32_t *slot = &ir->slots[i];
+        if (!*slot) return slot;
+
+        uint32_t id = *slot - 1;
+        if (ir->hashes[id] == hash && ir->name_lengths[id] == len
+            && memcmp(ir->names + ir->name_offsets[id], name, len) == 0) {
+            return slot;
+        }
+
+        i = (i + 1) & mask;
+    }
+}
+
+static int grow_instructions(IR *ir)
+{
+    size_t capacity = ir->capacity ? ir->capacity * 2 : IR_INITIAL_CAPACITY;
+    if (charge(ir, (capacity - ir->capacity) * (sizeof(uint8_t) + 2 * sizeof(uint32_t)))) return 1;
+
+    uint8_t *kinds = realloc(ir->kinds, capacity * sizeof(uint8_t));
+    if (!kinds) return 1;
+    ir->kinds = kinds;
+
+    uint32_t *operands = realloc(ir->operands, capacity * sizeof(uint32_t));
+    if (!operands) return 1;
+    ir->operands = operands;
+
+    uint32_t *lines = realloc(ir->lines, capacity * sizeof(uint32_t));
+    if (!lines) return 1;
+    ir->lines = lines;
+
+    ir->capacity = capacity;
+
+    return 0;
+}
+
+static int grow_symbols(IR *ir)
+{
+    uint32_t capacity = ir->symbol_capacity ? ir->symbol_capacity * 2 : IR_INITIAL_SYMBOLS;
+    if (charge(ir, (capacity - ir->symbol_capacity) * (3 * sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t)))) return 1;
+
+    uint32_t *offsets = realloc(ir->name_offsets, capacity * sizeof(uint32_t));
+    if (!offsets) return 1;
+    ir->name_offsets = offsets;
+
+    uint32_t *lengths = realloc(ir->name_lengths, capacity * sizeof(uint32_t));
+    if (!lengths) return 1;
+    ir->name_lengths = lengths;
+
+    uint32_t *hashes = realloc(ir->hashes, capacity * sizeof(uint32_t));
+    if (!hashes) return 1;
+    ir->hashes = hashes;
+
+    uint16_t *values = realloc(ir->values, capacity * sizeof(uint16_t));
+    if (!values) return 1;
+    ir->values = values;
+
+    uint8_t *defined = realloc(ir->defined, capacity * sizeof(uint8_t));
+    if (!defined) return 1;
+    ir->defined = defined;
+
+    ir->symbol_capacity = capacity;
+
+    return 0;
+}
+
+static int grow_slots(IR *ir)
+{
+    uint32_t count = ir->slot_count ? ir->slot_count * 2 : IR_INITIAL_SYMBOLS * 2;
+    if (charge(ir, (count - ir->slot_count) * sizeof(uint32_t))) return 1;
+
+    uint32_t *slots = calloc(count, sizeof(uint32_t));
+    if (!slots) return 1;
+
+    uint32_t mask = count - 1;
+    for (uint32_t id = 0; id < ir->symbol_count; id++)
+    {
+        uint32_t i = ir->hashes[id] & mask;
+        while (slots[i]) i = (i + 1) & mask;
+        slots[i] = id + 1;
+    }
+
+    free(ir->slots);
+    ir->slots = slots;
+    ir->slot_count = count;
+
+    return 0;
+}
+
+static int charge(IR *ir, size_t size)
+{
+    return ir->budget ? arena_charge(ir->budget, size) : 0;
+}
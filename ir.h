@@ -0,0 +1,58 @@
+#ifndef IR_H
+#define IR_H
+
+#include<stddef.h>
+#include<stdint.h>
+#include "./stats.h"
+#include "./arena.h"
+
+#define IR_NO_SYMBOL UINT32_MAX
+
+// ir_kind says how the operand of an instruction is to be read.
+typedef enum{
+    IR_A_CONST,     // operand is the final A-instruction word
+    IR_A_SYMBOL,    // operand is a symbol id, resolved when the word is emitted
+    IR_C,           // operand is the final C-instruction word
+    IR_LABEL        // operand is a symbol id, takes no ROM word
+}ir_kind;
+
+// IR is a program as a struct of arrays, built once by scan() so later
+// passes never go back to the source text. Symbol names are interned to
+// dense 32-bit ids which index the symbol arrays.
+typedef struct {
+    uint8_t *kinds;
+    uint32_t *operands;
+    uint32_t *lines;
+    size_t count;
+    size_t capacity;
+    size_t rom_size;
+
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+    uint32_t *name_offsets;
+    uint32_t *name_lengths;
+    uint32_t *hashes;
+    uint16_t *values;
+    uint8_t *defined;
+    uint32_t symbol_count;
+    uint32_t symbol_capacity;
+
+    uint32_t *slots;
+    uint32_t slot_count;
+
+    // budget, when set, is charged for every byte the arrays grow by.
+    Arena *budget;
+}IR;
+
+IR* ir_init(void);
+int ir_push(IR *ir, ir_kind kind, uint32_t operand, uint32_t line);
+int ir_reserve(IR *ir, size_t count);
+uint32_t ir_intern(IR *ir, const char *name, size_t len, int *created);
+uint32_t ir_find(IR *ir, const char *name, size_t len);
+const char* ir_symbol_name(IR *ir, uint32_t id, size_t *len);
+void ir_table_stats(IR *ir, TableStats *stats);
+size_t ir_allocated_bytes(IR *ir);
+void ir_free(IR *ir);
+
+#endif
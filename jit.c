@@ -0,0 +1,491 @@
+#include<stdio.h>
+#include<stddef.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./jit.h"
+
+// The JIT translates a basic block into x86-64 code the first time the
+// program reaches it. Inside the generated code A lives in r12d, D in r13d,
+// the instruction budget in r14, the RAM base in rbx and the table of
+// translated blocks in r15; the PC is implied by the position in the code
+// and only put in esi when leaving it. A block ends at a jump, before a
+// halt loop or after JIT_MAX_BLOCK instructions. Its exits to blocks known
+// at translation time start out as stubs back to jit_run() and are patched
+// into direct jumps once the target is translated, so hot loops never leave
+// the generated code. A jump to A looks the target up in the block table.
+// Each block charges its length to the budget on entry; when the budget is
+// shorter it leaves and cpu_run() executes the rest, so a limit stops at
+// exactly the same instruction as the interpreter. The ROM can not be
+// written by a program, so the only thing that invalidates translated code
+// is loading another ROM, after which jit_flush() has to be called.
+
+#if defined(__x86_64__)
+
+#include<sys/mman.h>
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_MAX_BLOCK 256
+// upper bound of the bytes one instruction translates to, stubs included.
+#define JIT_MAX_INSTRUCTION 96
+
+// JitState is what the generated code loads on entry and stores on exit,
+// its offsets are baked into the prologue and the exit.
+typedef struct {
+    uint16_t *ram;
+    void **blocks;
+    uint64_t remaining;
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+}JitState;
+
+// Patch is a rel32 in the code still jumping to a stub, to be pointed at
+// the block of target once it is translated.
+typedef struct {
+    uint32_t site;
+    uint16_t target;
+    int32_t next;
+}Patch;
+
+typedef void (*jit_entry_fn)(JitState *state, void *block);
+
+struct Jit {
+    Cpu *cpu;
+    uint8_t *code;
+    size_t used;
+    size_t start;           // end of the prologue and exit, where blocks go
+    size_t exit;
+    void *blocks[ROM_SIZE];
+    uint16_t lengths[ROM_SIZE];
+    int32_t patch_heads[ROM_SIZE];
+    Patch *patches;
+    size_t patch_count;
+    size_t patch_capacity;
+};
+
+// jump bits to the x86 condition code (the low nibble of jcc) taken on
+// the result of test ax, ax.
+static const uint8_t jumpConditions[8] = {
+    0, 0xF /* g */, 0x4 /* e */, 0xD /* ge */, 0xC /* l */, 0x5 /* ne */, 0xE /* le */, 0,
+};
+
+static void emit(Jit *jit, const uint8_t *bytes, size_t count);
+static void emit_u32(Jit *jit, uint32_t value);
+static void emit_prologue(Jit *jit);
+static int compile(Jit *jit, uint16_t pc);
+static void emit_load_y(Jit *jit, int memory, int to_edx);
+static void emit_comp(Jit *jit, uint8_t comp);
+static void emit_indirect(Jit *jit);
+static int emit_chain(Jit *jit, uint8_t condition, uint16_t target, uint32_t *sites, uint16_t *targets, int pending);
+static int add_patch(Jit *jit, uint32_t site, uint16_t target);
+static void link_to(Jit *jit, uint32_t site, const void *target);
+
+#define EMIT(...) do { \
+        static const uint8_t bytes_[] = { __VA_ARGS__ }; \
+        emit(jit, bytes_, sizeof(bytes_)); \
+    } while (0)
+
+Jit* jit_init(Cpu *cpu)
+{
+    Jit *jit = malloc(sizeof(Jit));
+    if (!jit) return NULL;
+
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED)
+    {
+        free(jit);
+        return NULL;
+    }
+
+    jit->cpu = cpu;
+    jit->patches = NULL;
+    jit->patch_capacity = 0;
+    jit->used = 0;
+    emit_prologue(jit);
+    jit->start = jit->used;
+    jit_flush(jit);
+
+    return jit;
+}
+
+// jit_flush drops every translated block.
+void jit_flush(Jit *jit)
+{
+    jit->used = jit->start;
+    jit->patch_count = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->lengths, 0, sizeof(jit->lengths));
+    for (size_t i = 0; i < ROM_SIZE; i++) {
+        jit->patch_heads[i] = -1;
+    }
+}
+
+// jit_run executes at most max_cycles instructions and returns how many
+// it did, like cpu_run() which it hands the tail of the budget to.
+uint64_t jit_run(Jit *jit, uint64_t max_cycles)
+{
+    Cpu *cpu = jit->cpu;
+    uint64_t remaining = max_cycles, interpreted = 0;
+    JitState state = { cpu->ram, jit->blocks, 0, 0, 0, 0 };
+
+    while (remaining)
+    {
+        uint16_t pc = cpu->pc;
+        if (cpu->stop_at_halt && cpu_halts_at(cpu, pc)) break;
+
+        if (!jit->blocks[pc] && compile(jit, pc))
+        {
+            // no room even after a flush, interpret instead.
+            interpreted += cpu_run(cpu, remaining);
+            remaining = 0;
+            break;
+        }
+
+        if (remaining < jit->lengths[pc])
+        {
+            uint64_t done = cpu_run(cpu, remaining);
+            interpreted += done;
+            remaining -= done;
+            break;
+        }
+
+        state.remaining = remaining;
+        state.a = cpu->a;
+        state.d = cpu->d;
+        ((jit_entry_fn)(void*)jit->code)(&state, jit->blocks[pc]);
+
+        remaining = state.remaining;
+        cpu->a = state.a;
+        cpu->d = state.d;
+        cpu->pc = state.pc;
+    }
+
+    // cpu_run() counted its own part.
+    cpu->cycles += max_cycles - remaining - interpreted;
+
+    return max_cycles - remaining;
+}
+
+void jit_free(Jit *jit)
+{
+    if (!jit) return;
+
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit->patches);
+    free(jit);
+}
+
+static void emit(Jit *jit, const uint8_t *bytes, size_t count)
+{
+    memcpy(jit->code + jit->used, bytes, count);
+    jit->used += count;
+}
+
+static void emit_u32(Jit *jit, uint32_t value)
+{
+    memcpy(jit->code + jit->used, &value, 4);
+    jit->used += 4;
+}
+
+// emit_prologue writes the entry, called as fn(state, block), and the exit
+// every stub jumps to with the PC in esi.
+static void emit_prologue(Jit *jit)
+{
+    EMIT(0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57); // push rbx, rbp, r12-r15
+    EMIT(0x48, 0x83, 0xEC, 0x08);                                     // sub rsp, 8
+    EMIT(0x48, 0x89, 0xFD);                                           // mov rbp, rdi
+
+    uint8_t load[] = {
+        0x48, 0x8B, 0x5D, offsetof(JitState, ram),                    // mov rbx, [rbp+ram]
+        0x4C, 0x8B, 0x7D, offsetof(JitState, blocks),                 // mov r15, [rbp+blocks]
+        0x4C, 0x8B, 0x75, offsetof(JitState, remaining),              // mov r14, [rbp+remaining]
+        0x44, 0x0F, 0xB7, 0x65, offsetof(JitState, a),                // movzx r12d, word [rbp+a]
+        0x44, 0x0F, 0xB7, 0x6D, offsetof(JitState, d),                // movzx r13d, word [rbp+d]
+        0xFF, 0xE6,                                                   // jmp rsi
+    };
+    emit(jit, load, sizeof(load));
+
+    jit->exit = jit->used;
+    uint8_t store[] = {
+        0x66, 0x44, 0x89, 0x65, offsetof(JitState, a),                // mov [rbp+a], r12w
+        0x66, 0x44, 0x89, 0x6D, offsetof(JitState, d),                // mov [rbp+d], r13w
+        0x4C, 0x89, 0x75, offsetof(JitState, remaining),              // mov [rbp+remaining], r14
+        0x66, 0x89, 0x75, offsetof(JitState, pc),                     // mov [rbp+pc], si
+        0x48, 0x83, 0xC4, 0x08,                                       // add rsp, 8
+        0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B,   // pop r15-r12, rbp, rbx
+        0xC3,                                                         // ret
+    };
+    emit(jit, store, sizeof(store));
+}
+
+// compile translates the block at pc, flushing everything first when the
+// code buffer is full. It returns nonzero if even that does not help.
+static int compile(Jit *jit, uint16_t pc)
+{
+    Cpu *cpu = jit->cpu;
+    size_t count = 0;
+    uint16_t at = pc;
+
+    // the block: up to and including a jump, stopping short of a halt loop.
+    for (;;)
+    {
+        if (count && cpu->stop_at_halt && cpu_halts_at(cpu, at)) break;
+
+        uint16_t word = cpu->rom[at];
+        count++;
+        at = (at + 1) & (ROM_SIZE - 1);
+        if ((IS_C(word) && JUMP(word)) || count == JIT_MAX_BLOCK) break;
+    }
+
+    if (JIT_CODE_SIZE - jit->used < count * JIT_MAX_INSTRUCTION + 64)
+    {
+        jit_flush(jit);
+        if (JIT_CODE_SIZE - jit->used < count * JIT_MAX_INSTRUCTION + 64) return 1;
+    }
+
+    // the jumps to stubs, emitted after the block body, at most two.
+    uint32_t sites[2];
+    uint16_t targets[2];
+    int pending = 0;
+
+    jit->blocks[pc] = jit->code + jit->used;
+    jit->lengths[pc] = count;
+
+    EMIT(0x49, 0x81, 0xFE); emit_u32(jit, count);                        // cmp r14, count
+    EMIT(0x0F, 0x82);                                                     // jb budget stub
+    uint32_t budget_site = jit->used;
+    emit_u32(jit, 0);
+    EMIT(0x49, 0x81, 0xEE); emit_u32(jit, count);                        // sub r14, count
+
+    at = pc;
+    int ends_in_jump = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t word = cpu->rom[at];
+        uint16_t previous = cpu->rom[(at - 1) & (ROM_SIZE - 1)];
+        at = (at + 1) & (ROM_SIZE - 1);
+
+        if (!IS_C(word))
+        {
+            EMIT(0x41, 0xBC); emit_u32(jit, word);                         // mov r12d, word
+            continue;
+        }
+
+        uint8_t comp = COMP(word), dest = DEST(word), jump = JUMP(word);
+        if (!dest && !jump) continue;
+
+        // the target is known when the @k before the jump is in the block.
+        int known = jump && i > 0 && !IS_C(previous);
+
+        if ((comp & 0x40) || (dest & DEST_M)) {
+            EMIT(0x44, 0x89, 0xE1, 0x81, 0xE1, 0xFF, 0x7F, 0x00, 0x00);  // mov ecx, r12d; and ecx, 0x7FFF
+        }
+        if (dest || jump != 0x7) emit_comp(jit, comp);
+        if (jump && !known) {
+            EMIT(0x44, 0x89, 0xE6, 0x81, 0xE6, 0xFF, 0x7F, 0x00, 0x00);  // mov esi, r12d; and esi, 0x7FFF
+        }
+
+        if (dest & DEST_M) EMIT(0x66, 0x89, 0x04, 0x4B);                  // mov [rbx+rcx*2], ax
+        if (dest & DEST_A) EMIT(0x41, 0x89, 0xC4);                        // mov r12d, eax
+        if (dest & DEST_D) EMIT(0x41, 0x89, 0xC5);                        // mov r13d, eax
+
+        if (!jump) continue;
+
+        if (jump == 0x7)
+        {
+            ends_in_jump = 1;
+            if (known) {
+                pending = emit_chain(jit, 0, previous, sites, targets, pending);
+            } else {
+                emit_indirect(jit);
+            }
+            continue;
+        }
+
+        EMIT(0x66, 0x85, 0xC0);                                           // test ax, ax
+        if (known) {
+            pending = emit_chain(jit, jumpConditions[jump], previous, sites, targets, pending);
+        } else {
+            // jump over the lookup when the condition does not hold.
+            uint8_t skip[] = { 0x70 | (jumpConditions[jump] ^ 1), 15 };
+            emit(jit, skip, sizeof(skip));
+            emit_indirect(jit);
+        }
+    }
+
+    if (!ends_in_jump) pending = emit_chain(jit, 0, at, sites, targets, pending);
+
+    // the budget stub leaves with the PC of the block itself.
+    link_to(jit, budget_site, jit->code + jit->used);
+    EMIT(0xBE); emit_u32(jit, pc);                                        // mov esi, pc
+    EMIT(0xE9); emit_u32(jit, jit->exit - (jit->used + 4));               // jmp exit
+
+    for (int i = 0; i < pending; i++)
+    {
+        link_to(jit, sites[i], jit->code + jit->used);
+        if (add_patch(jit, sites[i], targets[i])) return 1;
+
+        EMIT(0xBE); emit_u32(jit, targets[i]);                            // mov esi, target
+        EMIT(0xE9); emit_u32(jit, jit->exit - (jit->used + 4));           // jmp exit
+    }
+
+    // the jumps waiting for this block go straight to it from now on.
+    for (int32_t i = jit->patch_heads[pc]; i >= 0; i = jit->patches[i].next) {
+        link_to(jit, jit->patches[i].site, jit->blocks[pc]);
+    }
+    jit->patch_heads[pc] = -1;
+
+    return 0;
+}
+
+// emit_load_y loads A, or M through the address in ecx, into eax or edx.
+static void emit_load_y(Jit *jit, int memory, int to_edx)
+{
+    if (memory) {
+        uint8_t bytes[] = { 0x0F, 0xB7, to_edx ? 0x14 : 0x04, 0x4B };     // movzx r32, word [rbx+rcx*2]
+        emit(jit, bytes, sizeof(bytes));
+    } else {
+        uint8_t bytes[] = { 0x44, 0x89, to_edx ? 0xE2 : 0xE0 };           // mov r32, r12d
+        emit(jit, bytes, sizeof(bytes));
+    }
+}
+
+// emit_comp computes the ALU output into eax, zero extended from 16 bits.
+// The computations of the book get short sequences, the rest follows the
+// zx nx zy ny f no bits one by one.
+static void emit_comp(Jit *jit, uint8_t comp)
+{
+    int memory = comp & 0x40;
+    uint8_t bits = comp & 0x3F;
+
+    switch (bits)
+    {
+    case 0x2A: EMIT(0x31, 0xC0); return;                                  // xor eax, eax
+    case 0x3F: EMIT(0xB8, 0x01, 0x00, 0x00, 0x00); return;                // mov eax, 1
+    case 0x3A: EMIT(0xB8, 0xFF, 0xFF, 0x00, 0x00); return;                // mov eax, 0xFFFF
+    case 0x0C: EMIT(0x44, 0x89, 0xE8); return;                            // mov eax, r13d
+    case 0x30: emit_load_y(jit, memory, 0); return;
+    case 0x0D: EMIT(0x44, 0x89, 0xE8, 0xF7, 0xD0); break;                 // not D
+    case 0x31: emit_load_y(jit, memory, 0); EMIT(0xF7, 0xD0); break;      // not y
+    case 0x0F: EMIT(0x44, 0x89, 0xE8, 0xF7, 0xD8); break;                 // neg D
+    case 0x33: emit_load_y(jit, memory, 0); EMIT(0xF7, 0xD8); break;      // neg y
+    case 0x1F: EMIT(0x44, 0x89, 0xE8, 0x83, 0xC0, 0x01); break;           // D + 1
+    case 0x37: emit_load_y(jit, memory, 0); EMIT(0x83, 0xC0, 0x01); break;
+    case 0x0E: EMIT(0x44, 0x89, 0xE8, 0x83, 0xE8, 0x01); break;           // D - 1
+    case 0x32: emit_load_y(jit, memory, 0); EMIT(0x83, 0xE8, 0x01); break;
+    case 0x07: emit_load_y(jit, memory, 0); EMIT(0x44, 0x29, 0xE8); break; // y - D
+    case 0x02:
+    case 0x13:
+    case 0x00:
+    case 0x15:
+        EMIT(0x44, 0x89, 0xE8);                                           // mov eax, r13d
+        emit_load_y(jit, memory, 1);
+        if (bits == 0x02) EMIT(0x01, 0xD0);                               // add eax, edx
+        if (bits == 0x13) EMIT(0x29, 0xD0);                               // sub eax, edx
+        if (bits == 0x00) EMIT(0x21, 0xD0);                               // and eax, edx
+        if (bits == 0x15) EMIT(0x09, 0xD0);                               // or eax, edx
+        break;
+    default:
+        if (bits & 0x20) EMIT(0x31, 0xC0); else EMIT(0x44, 0x89, 0xE8);   // x = 0 or D
+        if (bits & 0x10) EMIT(0xF7, 0xD0);
+        if (bits & 0x08) EMIT(0x31, 0xD2); else emit_load_y(jit, memory, 1);
+        if (bits & 0x04) EMIT(0xF7, 0xD2);
+        if (bits & 0x02) EMIT(0x01, 0xD0); else EMIT(0x21, 0xD0);
+        if (bits & 0x01) EMIT(0xF7, 0xD0);
+    }
+
+    EMIT(0x0F, 0xB7, 0xC0);                                               // movzx eax, ax
+}
+
+// emit_indirect jumps to the block at esi, or leaves when there is none
+// yet. It is 15 bytes, the conditional jumps skip it with a rel8.
+static void emit_indirect(Jit *jit)
+{
+    EMIT(0x49, 0x8B, 0x0C, 0xF7);                                         // mov rcx, [r15+rsi*8]
+    EMIT(0x48, 0x85, 0xC9);                                               // test rcx, rcx
+    EMIT(0x0F, 0x84); emit_u32(jit, jit->exit - (jit->used + 4));         // jz exit
+    EMIT(0xFF, 0xE1);                                                     // jmp rcx
+}
+
+// emit_chain jumps to the block of target, a jmp when condition is 0 and
+// a jcc otherwise. Until the block exists the jump goes to a stub, which
+// is queued in sites and targets.
+static int emit_chain(Jit *jit, uint8_t condition, uint16_t target, uint32_t *sites, uint16_t *targets, int pending)
+{
+    if (condition) {
+        uint8_t bytes[] = { 0x0F, 0x80 | condition };
+        emit(jit, bytes, sizeof(bytes));
+    } else {
+        EMIT(0xE9);
+    }
+
+    uint32_t site = jit->used;
+    emit_u32(jit, 0);
+
+    if (jit->blocks[target])
+    {
+        link_to(jit, site, jit->blocks[target]);
+        return pending;
+    }
+
+    sites[pending] = site;
+    targets[pending] = target;
+
+    return pending + 1;
+}
+
+static int add_patch(Jit *jit, uint32_t site, uint16_t target)
+{
+    if (jit->patch_count == jit->patch_capacity)
+    {
+        size_t capacity = jit->patch_capacity ? jit->patch_capacity * 2 : 1024;
+        Patch *patches = realloc(jit->patches, capacity * sizeof(Patch));
+        if (!patches) return 1;
+
+        jit->patches = patches;
+        jit->patch_capacity = capacity;
+    }
+
+    Patch *p = &jit->patches[jit->patch_count];
+    p->site = site;
+    p->target = target;
+    p->next = jit->patch_heads[target];
+    jit->patch_heads[target] = jit->patch_count++;
+
+    return 0;
+}
+
+static void link_to(Jit *jit, uint32_t site, const void *target)
+{
+    int32_t rel = (int32_t)((const uint8_t*)target - (jit->code + site + 4));
+    memcpy(jit->code + site, &rel, 4);
+}
+
+#else
+
+// other hosts have no JIT, the emulator interprets.
+Jit* jit_init(Cpu *cpu)
+{
+    (void)cpu;
+    return NULL;
+}
+
+uint64_t jit_run(Jit *jit, uint64_t max_cycles)
+{
+    (void)jit;
+    (void)max_cycles;
+    return 0;
+}
+
+void jit_flush(Jit *jit)
+{
+    (void)jit;
+}
+
+void jit_free(Jit *jit)
+{
+    (void)jit;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include<stdint.h>
+#include "./cpu.h"
+
+typedef struct Jit Jit;
+
+Jit* jit_init(Cpu *cpu);
+uint64_t jit_run(Jit *jit, uint64_t max_cycles);
+void jit_flush(Jit *jit);
+void jit_free(Jit *jit);
+
+#endif
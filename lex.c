@@ -0,0 +1,272 @@
+#include<stdint.h>
+#include "./lex.h"
+
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include<immintrin.h>
+#define LEX_AVX2
+#endif
+
+#define LEX_WINDOW 64
+
+// The lexer turns 64 bytes of input at a time into bit masks of the
+// newlines, slashes, '=', ';' and blanks in them: four SSE2 loads, or two
+// AVX2 ones when the CPU has it. lex_block() works the marks of a line out
+// of the masks, so a line is read once and the short lines of a program
+// share a load. The bytes left at the end of the input go through the same
+// masks built one byte at a time. lex_line_scalar() is the byte by byte
+// reference the vector paths have to agree with.
+
+// LexState carries what lex_block() needs from the window before.
+typedef struct {
+    int slash;      // the last byte of the line so far is a '/'
+    int content;    // a non-blank was seen before the comment
+}LexState;
+
+static inline int lex_block(LineLex *lex, LexState *st, const char *at, unsigned width,
+    uint64_t nl, uint64_t slash, uint64_t eq, uint64_t semi, uint64_t blank);
+static void load_window(LexWindow *w, const char *c, const char *limit);
+static void lex_finish(LineLex *lex, const char *end);
+
+static inline int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// lex_line marks the line at start, which ends at the first newline or at
+// limit, the end of the input. w keeps the masks for the next line.
+void lex_line(LexWindow *w, const char *start, const char *limit, LineLex *lex)
+{
+    LexState st = { 0, 0 };
+    const char *c = start;
+
+    if (!w->base || c < w->base || c >= w->base + w->width) {
+        load_window(w, c, limit);
+    }
+
+    // most lines end in the window they start in, their marks come
+    // straight out of the masks without a branch.
+    unsigned skip = c - w->base;
+    uint64_t nl = w->nl >> skip;
+    if (nl)
+    {
+        uint64_t stop = nl & -nl;
+        uint64_t line = stop - 1;
+        uint64_t slash = w->slash >> skip & line;
+        uint64_t pairs = slash & (slash >> 1);
+        uint64_t live = line & ((pairs & -pairs) - 1);
+        uint64_t content = ~(w->blank >> skip) & live;
+        uint64_t first = content & -content;
+        uint64_t after = live & ~(first | (first - 1));
+
+        lex->end = c + __builtin_ctzll(stop);
+        lex->comment = c + __builtin_ctzll(pairs | stop);
+        lex->eq = c + __builtin_ctzll((w->eq >> skip & live) | stop);
+        lex->semi = c + __builtin_ctzll((w->semi >> skip & live) | stop);
+        lex->blank = c + __builtin_ctzll((w->blank >> skip & after) | stop);
+
+        return;
+    }
+
+    lex->comment = lex->eq = lex->semi = lex->blank = NULL;
+
+    while (c < limit)
+    {
+        if (!w->base || c < w->base || c >= w->base + w->width) {
+            load_window(w, c, limit);
+        }
+
+        unsigned skip = c - w->base;
+        if (lex_block(lex, &st, c, w->width - skip, w->nl >> skip, w->slash >> skip,
+            w->eq >> skip, w->semi >> skip, w->blank >> skip)) return;
+
+        c = w->base + w->width;
+    }
+
+    lex_finish(lex, limit);
+}
+
+// lex_line_scalar marks the line the way lex_line() does, one byte at a
+// time.
+void lex_line_scalar(const char *start, const char *limit, LineLex *lex)
+{
+    const char *c = start;
+    while (c < limit && *c != '\n') c++;
+
+    const char *end = c;
+    int content = 0;
+    lex->end = lex->comment = lex->eq = lex->semi = lex->blank = end;
+
+    for (c = start; c < end; c++)
+    {
+        if (*c == '/' && c + 1 < end && c[1] == '/')
+        {
+            lex->comment = c;
+            break;
+        }
+
+        if (*c == '=' && lex->eq == end) lex->eq = c;
+        if (*c == ';' && lex->semi == end) lex->semi = c;
+
+        if (!is_blank(*c)) {
+            content = 1;
+        } else if (content && lex->blank == end) {
+            lex->blank = c;
+        }
+    }
+}
+
+#ifdef __SSE2__
+// sse2_masks adds the masks of the 16 bytes at c, which start at bit at.
+static inline void sse2_masks(LexWindow *w, const char *c, unsigned at)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)c);
+    // \t \n \v \f \r are 9 to 13, the newline ends the line anyway.
+    __m128i control = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+        _mm_cmpeq_epi8(_mm_min_epu8(control, _mm_set1_epi8(4)), control));
+
+    w->nl |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))) << at;
+    w->slash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('/'))) << at;
+    w->eq |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('='))) << at;
+    w->semi |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(';'))) << at;
+    w->blank |= (uint64_t)(uint16_t)_mm_movemask_epi8(blank) << at;
+}
+#endif
+
+#ifdef LEX_AVX2
+// avx2_window sets the masks of the 64 bytes at c with two loads.
+__attribute__((target("avx2")))
+static void avx2_window(LexWindow *w, const char *c)
+{
+    uint32_t nl[2], slash[2], eq[2], semi[2], blank[2];
+
+    for (int i = 0; i < 2; i++)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(c + 32 * i));
+        __m256i control = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+        __m256i blanks = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(control, _mm256_set1_epi8(4)), control));
+
+        nl[i] = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+        slash[i] = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('/')));
+        eq[i] = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('=')));
+        semi[i] = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+        blank[i] = _mm256_movemask_epi8(blanks);
+    }
+
+    w->nl = (uint64_t)nl[1] << 32 | nl[0];
+    w->slash = (uint64_t)slash[1] << 32 | slash[0];
+    w->eq = (uint64_t)eq[1] << 32 | eq[0];
+    w->semi = (uint64_t)semi[1] << 32 | semi[0];
+    w->blank = (uint64_t)blank[1] << 32 | blank[0];
+}
+#endif
+
+// load_window sets the masks of the 64 bytes at c, or of the bytes left
+// before limit when there are fewer.
+static void load_window(LexWindow *w, const char *c, const char *limit)
+{
+    w->base = c;
+    w->nl = w->slash = w->eq = w->semi = w->blank = 0;
+
+    if (limit - c >= LEX_WINDOW)
+    {
+        w->width = LEX_WINDOW;
+#ifdef LEX_AVX2
+        if (__builtin_cpu_supports("avx2"))
+        {
+            avx2_window(w, c);
+            return;
+        }
+#endif
+#ifdef __SSE2__
+        for (unsigned at = 0; at < LEX_WINDOW; at += 16) {
+            sse2_masks(w, c + at, at);
+        }
+        return;
+#endif
+    }
+
+    w->width = limit - c < LEX_WINDOW ? (unsigned)(limit - c) : LEX_WINDOW;
+    for (unsigned i = 0; i < w->width; i++)
+    {
+        w->nl |= (uint64_t)(c[i] == '\n') << i;
+        w->slash |= (uint64_t)(c[i] == '/') << i;
+        w->eq |= (uint64_t)(c[i] == '=') << i;
+        w->semi |= (uint64_t)(c[i] == ';') << i;
+        w->blank |= (uint64_t)is_blank(c[i]) << i;
+    }
+}
+
+// lex_block takes the masks of the width bytes at at, bit i standing for
+// at[i], and sets the marks found there. It returns 1 once the line ended.
+static inline int lex_block(LineLex *lex, LexState *st, const char *at, unsigned width,
+    uint64_t nl, uint64_t slash, uint64_t eq, uint64_t semi, uint64_t blank)
+{
+    uint64_t live = width == 64 ? UINT64_MAX : ((uint64_t)1 << width) - 1;
+    if (nl) live &= (nl & -nl) - 1;
+
+    if (!lex->comment)
+    {
+        slash &= live;
+        uint64_t pairs = slash & (slash >> 1);
+
+        if (st->slash && (slash & 1))
+        {
+            lex->comment = at - 1;
+            live = 0;
+        }
+        else if (pairs)
+        {
+            lex->comment = at + __builtin_ctzll(pairs);
+            live &= ((uint64_t)1 << __builtin_ctzll(pairs)) - 1;
+        }
+
+        st->slash = (slash >> (width - 1)) & 1;
+    }
+    else
+    {
+        live = 0;
+    }
+
+    eq &= live;
+    semi &= live;
+    if (!lex->eq && eq) lex->eq = at + __builtin_ctzll(eq);
+    if (!lex->semi && semi) lex->semi = at + __builtin_ctzll(semi);
+
+    if (!lex->blank)
+    {
+        uint64_t content = ~blank & live;
+        uint64_t after = live;
+
+        // only blanks past the first non-blank count.
+        if (!st->content)
+        {
+            after = content ? live & ~(content ^ (content - 1)) : 0;
+            st->content = content != 0;
+        }
+
+        blank &= after;
+        if (blank) lex->blank = at + __builtin_ctzll(blank);
+    }
+
+    if (!nl) return 0;
+
+    lex_finish(lex, at + __builtin_ctzll(nl));
+
+    return 1;
+}
+
+// lex_finish points the marks that were not found at end.
+static void lex_finish(LineLex *lex, const char *end)
+{
+    lex->end = end;
+    if (!lex->comment) lex->comment = end;
+    if (!lex->eq) lex->eq = end;
+    if (!lex->semi) lex->semi = end;
+    if (!lex->blank) lex->blank = end;
+}
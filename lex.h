@@ -0,0 +1,34 @@
+#ifndef LEX_H
+#define LEX_H
+
+#include<stddef.h>
+#include<stdint.h>
+
+// LineLex marks what lex_line() found in one line of source, so the parser
+// can trim, classify and split the line without scanning it again. A mark
+// that is not in the line points at end.
+typedef struct {
+    const char *end;        // the newline, or the end of the input
+    const char *comment;    // the first "//"
+    const char *eq;         // the first '=' before the comment
+    const char *semi;       // the first ';' before the comment
+    const char *blank;      // the first blank after the first non-blank, before the comment
+}LineLex;
+
+// LexWindow holds the masks of the last 64 bytes the lexer read, bit i of
+// each standing for base[i], so the short lines of a program are lexed
+// several to a vector load. A zeroed LexWindow is empty.
+typedef struct {
+    const char *base;
+    unsigned width;
+    uint64_t nl;
+    uint64_t slash;
+    uint64_t eq;
+    uint64_t semi;
+    uint64_t blank;
+}LexWindow;
+
+void lex_line(LexWindow *w, const char *start, const char *limit, LineLex *lex);
+void lex_line_scalar(const char *start, const char *limit, LineLex *lex);
+
+#endif
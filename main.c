@@ -1,37 +1,759 @@
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
+#include<time.h>
+#include<dirent.h>
+#include<sys/stat.h>
+#include<pthread.h>
 #include "./parser.h"
 #include "./code.h"
+#include "./pool.h"
+#include "./arena.h"
+#include "./stats.h"
+#include "./serve.h"
+#include "./opt.h"
+#include "./vm.h"
+
+typedef struct {
+    char *path;
+    off_t size;
+    int status;
+    Stats stats;
+}Job;
+
+typedef struct {
+    Job *jobs;
+    size_t count;
+    size_t capacity;
+}JobList;
+
+// runs take an arena from the free list and put it back reset, so a batch
+// ends up with one arena per worker, each reused from file to file.
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+typedef struct {
+    Arena **free;
+    size_t count;
+    size_t capacity;
+    size_t peak;
+    pthread_mutex_t lock;
+}ArenaList;
+
+static ArenaList arenas = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static int single_pass = 0;
+static int print_time = 0;
+// --stats prints to stderr, --stats=file writes JSON to file.
+static int print_stats = 0;
+static const char *stats_file = NULL;
+// -o names the output of a single input, "-" is stdout.
+static const char *output_name = NULL;
+// --serve runs the assembler as a daemon on this socket, see serve.c.
+static const char *socket_path = NULL;
+// --vm translates .vm files and directories of them into one program,
+// --dump-asm also writes it out as .asm text.
+static int vm_mode = 0;
+static const char *dump_asm = NULL;
+// -c writes a .hobj object per input, .hobj inputs are linked into one
+// program.
+static int compile_only = 0;
+static int link_mode = 0;
+static CodeOptions options;
+
+static double now_ms(void);
+static int parse_format(const char *name);
+static int assemble_file(const char *file_name, Stats *stats);
+static int report_stats(JobList *list);
+static Arena* acquire_arena(void);
+static void release_arena(Arena *arena);
+static void free_arenas(void);
+static void run_job(void *arg);
+static int add_input(JobList *list, const char *path);
+static int add_job(JobList *list, const char *path, off_t size);
+static int compare_jobs(const void *a, const void *b);
+static int run_batch(JobList *list, size_t workers);
+static int translate_vm(char **paths, size_t count);
+static int add_vm_files(const char *dir, char ***files, size_t *count);
+static int compare_names(const void *a, const void *b);
+static int link_objects(char **paths, size_t count);
+static void report_optimized(Code *c, const char *file_name);
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) 
+    JobList list = { NULL, 0, 0 };
+    size_t workers = 0;
+    int batch = 0;
+    char **program_paths = malloc(argc * sizeof(char*));
+    size_t program_count = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        size_t len = strlen(argv[i]);
+        if ((!strcmp(argv[i], "-o") || !strcmp(argv[i], "-j") || !strcmp(argv[i], "--serve")) && i + 1 < argc) {
+            i++;
+        } else if (!strcmp(argv[i], "--vm") || (len > 3 && !strcmp(argv[i] + len - 3, ".vm"))) {
+            vm_mode = 1;
+        } else if (len > 5 && !strcmp(argv[i] + len - 5, ".hobj")) {
+            link_mode = 1;
+        }
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--single-pass")) {
+            single_pass = 1;
+        } else if (!strcmp(argv[i], "-O")) {
+            options.optimize = 1;
+        } else if (!strcmp(argv[i], "-c")) {
+            compile_only = 1;
+        } else if (!strcmp(argv[i], "--vm")) {
+            vm_mode = 1;
+        } else if (!strncmp(argv[i], "--dump-asm=", 11)) {
+            dump_asm = argv[i] + 11;
+        } else if (!strcmp(argv[i], "--time")) {
+            print_time = 1;
+        } else if (!strcmp(argv[i], "--stats")) {
+            print_stats = 1;
+        } else if (!strncmp(argv[i], "--stats=", 8)) {
+            print_stats = 1;
+            stats_file = argv[i] + 8;
+        } else if (!strncmp(argv[i], "--encode-threads=", 17)) {
+            options.encode_threads = strtoul(argv[i] + 17, NULL, 10);
+        } else if (!strncmp(argv[i], "--scan-threads=", 15)) {
+            options.scan_threads = strtoul(argv[i] + 15, NULL, 10);
+        } else if (!strncmp(argv[i], "--format=", 9)) {
+            if (parse_format(argv[i] + 9)) {
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--endian=little")) {
+            options.little_endian = 1;
+        } else if (!strcmp(argv[i], "--endian=big")) {
+            options.little_endian = 0;
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            output_name = argv[++i];
+        } else if (!strcmp(argv[i], "--serve") && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            workers = strtoul(argv[++i], NULL, 10);
+            batch = 1;
+        } else if (!strncmp(argv[i], "--jobs=", 7)) {
+            workers = strtoul(argv[i] + 7, NULL, 10);
+            batch = 1;
+        } else if (vm_mode || link_mode) {
+            program_paths[program_count++] = argv[i];
+        } else {
+            struct stat st;
+            if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+                batch = 1;
+            }
+
+            if (add_input(&list, argv[i])) {
+                exit(1);
+            }
+        }
+    }
+
+    if (options.optimize && single_pass)
+    {
+        fprintf(stderr, "-O needs the two-pass mode, it rewrites the IR\n");
+        return 1;
+    }
+
+    if (compile_only)
+    {
+        if (single_pass || vm_mode || link_mode || socket_path || options.optimize)
+        {
+            fprintf(stderr, options.optimize ? "-O works on the whole program, give it when linking the objects\n"
+                : "-c can not be combined with --single-pass, --vm, --serve or .hobj inputs\n");
+            return 1;
+        }
+        options.format = FORMAT_OBJECT;
+    }
+
+    if (link_mode && !vm_mode)
+    {
+        if (single_pass || socket_path)
+        {
+            fprintf(stderr, "linking .hobj files can not be combined with --single-pass or --serve\n");
+            return 1;
+        }
+        int ext_code = link_objects(program_paths, program_count);
+        free(program_paths);
+        free_arenas();
+        exit(ext_code);
+    }
+
+    if (vm_mode)
+    {
+        if (single_pass || socket_path || !program_count)
+        {
+            fprintf(stderr, single_pass || socket_path ? "--vm can not be combined with --single-pass or --serve\n"
+                : "no .vm files given\n");
+            return 1;
+        }
+        int ext_code = translate_vm(program_paths, program_count);
+        free(program_paths);
+        free_arenas();
+        exit(ext_code);
+    }
+    free(program_paths);
+
+    if (socket_path)
+    {
+        if (list.count || output_name)
+        {
+            fprintf(stderr, "--serve takes no input files\n");
+            return 1;
+        }
+        exit(serve(socket_path, workers ? workers : pool_default_workers(), &options));
+    }
+
+    if (list.count == 0 && !batch)
     {
         fprintf(stderr, "path to the .ams file not specifiy");
         return -1;
     }
 
-    const char *file_name = argv[1];
-   
-    Parser *parser = init_parser(file_name);
+    if (output_name && (list.count != 1 || batch))
+    {
+        fprintf(stderr, "-o needs exactly one input file\n");
+        return 1;
+    }
+
+    if (list.count == 1 && !batch)
+    {
+        Job *job = &list.jobs[0];
+        int ext_code = assemble_file(job->path, print_stats ? &job->stats : NULL);
+        if (print_stats && report_stats(&list) && !ext_code) {
+            ext_code = 1;
+        }
+        free(list.jobs[0].path);
+        free(list.jobs);
+        free_arenas();
+        exit(ext_code);
+    }
+
+    int ext_code = run_batch(&list, workers ? workers : pool_default_workers());
+    if (print_stats && list.count && report_stats(&list) && !ext_code) {
+        ext_code = 1;
+    }
+
+    for (size_t i = 0; i < list.count; i++) {
+        free(list.jobs[i].path);
+    }
+    free(list.jobs);
+    free_arenas();
+
+    exit(ext_code);
+}
+
+// assemble_file turns one .asm file into its .hack sibling and returns the
+// exit status the assembler has for it.
+static int assemble_file(const char *file_name, Stats *stats)
+{
+    if (stats) {
+        stats_init(stats);
+    }
+
+    Arena *arena = acquire_arena();
+    if (!arena)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        return 1;
+    }
+
+    // "-" is stdin, read once: the two-pass mode keeps the IR, not the text.
+    Parser *parser = strcmp(file_name, "-") ? init_parser(file_name, arena, NULL) : init_parser_stream(stdin, arena);
     if (!parser)
     {
-        exit(1);
+        release_arena(arena);
+        return 1;
     }
 
-    Code *c = init_code(parser, file_name);
+    Code *c = init_code(parser, file_name, arena);
     if (c == NULL) {
-        printf("init error\n");
+        fprintf(stderr, "Err out of memory\n");
         free_parser(parser);
-        exit(1);
+        release_arena(arena);
+        return 1;
     }
 
+    code_set_options(c, &options);
+    code_set_stats(c, stats);
+    code_set_output_name(c, output_name);
+
     int ext_code = 0;
-    if (assemble(c)) {
+    double start = now_ms();
+    int errnum = single_pass ? assemble_single_pass(c) : assemble(c);
+    if (errnum) {
         ext_code = 1;
     }
 
+    if (options.optimize && !errnum) {
+        report_optimized(c, file_name);
+    }
+
     free_code(c);
-    exit(ext_code);
+
+    if (stats)
+    {
+        stats->bytes_allocated += arena_used(arena);
+        stats->peak_rss_kb = stats_peak_rss_kb();
+    }
+
+    if (print_time) {
+        fprintf(stderr, "%s: %.3f ms (%s), %zu arena bytes\n", file_name, now_ms() - start,
+            single_pass ? "single-pass" : "two-pass", arena_used(arena));
+    }
+
+    release_arena(arena);
+
+    return ext_code;
+}
+
+static void report_optimized(Code *c, const char *file_name)
+{
+    size_t removed, rom_size;
+
+    if (code_optimized(c, &removed, &rom_size) == OPT_ABSOLUTE_JUMP) {
+        fprintf(stderr, "%s: -O left the program as it is, it may jump to a numeric address\n", file_name);
+    } else {
+        fprintf(stderr, "%s: -O removed %zu of %zu instructions\n", file_name, removed, removed + rom_size);
+    }
+}
+
+// translate_vm assembles the .vm files and directories in paths as one
+// program, named after the directory when it is the only path. The
+// bootstrap comes first when one of the files is Sys.vm.
+static int translate_vm(char **paths, size_t count)
+{
+    char **files = NULL;
+    size_t file_count = 0;
+    int errnum = 0;
+
+    for (size_t i = 0; i < count && !errnum; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+            errnum = add_vm_files(paths[i], &files, &file_count);
+        } else {
+            char **grown = realloc(files, (file_count + 1) * sizeof(char*));
+            errnum = !grown || !(grown[file_count] = strdup(paths[i]));
+            if (grown) files = grown;
+            if (!errnum) file_count++;
+        }
+    }
+
+    if (!errnum && !file_count)
+    {
+        fprintf(stderr, "no .vm files found\n");
+        errnum = 1;
+    }
+
+    // Dir/ is assembled to Dir/Dir.hack, a file list after its first file.
+    char name[4096];
+    struct stat st;
+    if (count == 1 && stat(paths[0], &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        size_t len = strlen(paths[0]);
+        while (len > 1 && paths[0][len - 1] == '/') len--;
+        const char *base = paths[0] + len;
+        while (base > paths[0] && base[-1] != '/') base--;
+        snprintf(name, sizeof(name), "%.*s/%.*s.vm", (int)len, paths[0], (int)(paths[0] + len - base), base);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "%s", file_count ? files[0] : paths[0]);
+    }
+
+    int bootstrap = 0;
+    for (size_t i = 0; i < file_count; i++)
+    {
+        const char *base = strrchr(files[i], '/');
+        if (!strcmp(base ? base + 1 : files[i], "Sys.vm")) bootstrap = 1;
+    }
+
+    Arena *arena = errnum ? NULL : acquire_arena();
+    Code *c = arena ? init_code(NULL, name, arena) : NULL;
+    FILE *dump = NULL;
+
+    if (!errnum && !c)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        errnum = 1;
+    }
+
+    if (!errnum && dump_asm && !(dump = fopen(dump_asm, "w")))
+    {
+        fprintf(stderr, "can not open file:%s\n", dump_asm);
+        errnum = 1;
+    }
+
+    if (!errnum)
+    {
+        code_set_options(c, &options);
+        code_set_output_name(c, output_name);
+
+        double start = now_ms();
+        errnum = vm_translate(c, (const char *const *)files, file_count, bootstrap, dump, NULL) || assemble_emitted(c);
+
+        if (options.optimize && !errnum) {
+            report_optimized(c, name);
+        }
+
+        if (print_time) {
+            fprintf(stderr, "%s: %.3f ms (vm), %zu arena bytes\n", name, now_ms() - start, arena_used(arena));
+        }
+    }
+
+    if (dump && fclose(dump) && !errnum)
+    {
+        fprintf(stderr, "can not write file:%s\n", dump_asm);
+        errnum = 1;
+    }
+
+    free_code(c);
+    if (arena) release_arena(arena);
+    for (size_t i = 0; i < file_count; i++) {
+        free(files[i]);
+    }
+    free(files);
+
+    return errnum ? 1 : 0;
+}
+
+// link_objects links the .hobj files in paths, in order, into one program
+// written next to the first of them.
+static int link_objects(char **paths, size_t count)
+{
+    Arena *arena = acquire_arena();
+    Code *c = arena ? init_code(NULL, paths[0], arena) : NULL;
+
+    if (!c)
+    {
+        fprintf(stderr, "Err out of memory\n");
+        if (arena) release_arena(arena);
+        return 1;
+    }
+
+    code_set_options(c, &options);
+    code_set_output_name(c, output_name);
+
+    double start = now_ms();
+    int errnum = assemble_objects(c, (const char *const *)paths, count);
+
+    if (options.optimize && !errnum) {
+        report_optimized(c, paths[0]);
+    }
+
+    if (print_time) {
+        fprintf(stderr, "%s: %.3f ms (link), %zu arena bytes\n", paths[0], now_ms() - start, arena_used(arena));
+    }
+
+    free_code(c);
+    release_arena(arena);
+
+    return errnum ? 1 : 0;
+}
+
+// add_vm_files adds the .vm files of dir, sorted by name so the program
+// does not depend on the directory order.
+static int add_vm_files(const char *dir, char ***files, size_t *count)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        perror("Err opening directory");
+        return 1;
+    }
+
+    size_t first = *count;
+    struct dirent *entry;
+    while ((entry = readdir(d)))
+    {
+        size_t len = strlen(entry->d_name);
+        if (len <= 3 || strcmp(entry->d_name + len - 3, ".vm")) continue;
+
+        char **grown = realloc(*files, (*count + 1) * sizeof(char*));
+        if (!grown)
+        {
+            closedir(d);
+            return 1;
+        }
+        *files = grown;
+
+        size_t size = strlen(dir) + len + 2;
+        if (!((*files)[*count] = malloc(size)))
+        {
+            closedir(d);
+            return 1;
+        }
+        snprintf((*files)[*count], size, "%s/%s", dir, entry->d_name);
+        (*count)++;
+    }
+
+    closedir(d);
+    qsort(*files + first, *count - first, sizeof(char*), compare_names);
+
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+// report_stats prints the stats of every job to stderr, or writes them
+// to the --stats file as a JSON array.
+static int report_stats(JobList *list)
+{
+    if (!stats_file)
+    {
+        for (size_t i = 0; i < list->count; i++) {
+            stats_print(stderr, list->jobs[i].path, &list->jobs[i].stats);
+        }
+        return 0;
+    }
+
+    FILE *out = fopen(stats_file, "w");
+    if (!out)
+    {
+        fprintf(stderr, "can not open file:%s\n", stats_file);
+        return 1;
+    }
+
+    fprintf(out, "[");
+    for (size_t i = 0; i < list->count; i++)
+    {
+        fprintf(out, i ? ",\n " : "");
+        stats_json(out, list->jobs[i].path, &list->jobs[i].stats);
+    }
+    fprintf(out, "]\n");
+
+    return fclose(out) ? 1 : 0;
+}
+
+static Arena* acquire_arena(void)
+{
+    Arena *arena = NULL;
+
+    pthread_mutex_lock(&arenas.lock);
+    if (arenas.count) {
+        arena = arenas.free[--arenas.count];
+    }
+    pthread_mutex_unlock(&arenas.lock);
+
+    return arena ? arena : arena_init(ARENA_BLOCK_SIZE);
+}
+
+static void release_arena(Arena *arena)
+{
+    pthread_mutex_lock(&arenas.lock);
+
+    if (arena_peak(arena) > arenas.peak) {
+        arenas.peak = arena_peak(arena);
+    }
+
+    if (arenas.count == arenas.capacity)
+    {
+        size_t capacity = arenas.capacity ? arenas.capacity * 2 : 8;
+        Arena **grown = realloc(arenas.free, capacity * sizeof(Arena*));
+        if (!grown)
+        {
+            pthread_mutex_unlock(&arenas.lock);
+            arena_free(arena);
+            return;
+        }
+        arenas.free = grown;
+        arenas.capacity = capacity;
+    }
+
+    arena_reset(arena);
+    arenas.free[arenas.count++] = arena;
+
+    pthread_mutex_unlock(&arenas.lock);
+}
+
+static void free_arenas(void)
+{
+    for (size_t i = 0; i < arenas.count; i++) {
+        arena_free(arenas.free[i]);
+    }
+    free(arenas.free);
+    arenas.free = NULL;
+    arenas.count = arenas.capacity = 0;
+}
+
+static void run_job(void *arg)
+{
+    Job *job = arg;
+    job->status = assemble_file(job->path, print_stats ? &job->stats : NULL);
+}
+
+// run_batch assembles every job on a pool of workers, biggest files first
+// so the long ones do not end up last, and reports the failures.
+static int run_batch(JobList *list, size_t workers)
+{
+    if (list->count == 0)
+    {
+        fprintf(stderr, "no .asm files found\n");
+        return 1;
+    }
+
+    qsort(list->jobs, list->count, sizeof(Job), compare_jobs);
+
+    Pool *pool = pool_init(workers);
+    if (!pool)
+    {
+        fprintf(stderr, "Err can not start the worker pool\n");
+        return 1;
+    }
+
+    // workers pop their own deque from the tail, so the smallest files are
+    // queued first and every worker starts on its biggest one.
+    double start = now_ms();
+    for (size_t i = list->count; i-- > 0;)
+    {
+        if (pool_submit(pool, run_job, &list->jobs[i])) {
+            run_job(&list->jobs[i]);
+        }
+    }
+
+    pool_wait(pool);
+    pool_free(pool);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < list->count; i++) {
+        if (list->jobs[i].status) failed++;
+    }
+
+    if (print_time) {
+        fprintf(stderr, "batch: %zu files on %zu workers in %.3f ms, arena peak %zu bytes\n",
+            list->count, workers, now_ms() - start, arenas.peak);
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "%zu of %zu files failed:\n", failed, list->count);
+        for (size_t i = 0; i < list->count; i++)
+        {
+            if (list->jobs[i].status) {
+                fprintf(stderr, "  %s (exit %d)\n", list->jobs[i].path, list->jobs[i].status);
+            }
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+// add_input adds a file, or every .asm file found under a directory.
+static int add_input(JobList *list, const char *path)
+{
+    struct stat st;
+    int found = stat(path, &st) == 0;
+    if (!found || !S_ISDIR(st.st_mode)) {
+        return add_job(list, path, found ? st.st_size : 0);
+    }
+
+    DIR *dir = opendir(path);
+    if (!dir)
+    {
+        perror("Err opening directory");
+        return 1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)))
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) continue;
+
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char *child = malloc(len);
+        if (!child)
+        {
+            closedir(dir);
+            return 1;
+        }
+        snprintf(child, len, "%s/%s", path, entry->d_name);
+
+        int errnum = 0;
+        size_t name_len = strlen(entry->d_name);
+        if (stat(child, &st) == 0)
+        {
+            if (S_ISDIR(st.st_mode)) {
+                errnum = add_input(list, child);
+            } else if (name_len > 4 && !strcmp(entry->d_name + name_len - 4, ".asm")) {
+                errnum = add_job(list, child, st.st_size);
+            }
+        }
+
+        free(child);
+        if (errnum)
+        {
+            closedir(dir);
+            return errnum;
+        }
+    }
+
+    closedir(dir);
+
+    return 0;
+}
+
+static int add_job(JobList *list, const char *path, off_t size)
+{
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        Job *jobs = realloc(list->jobs, capacity * sizeof(Job));
+        if (!jobs) return 1;
+
+        list->jobs = jobs;
+        list->capacity = capacity;
+    }
+
+    Job *job = &list->jobs[list->count];
+    job->path = strdup(path);
+    if (!job->path) return 1;
+
+    job->size = size;
+    job->status = 0;
+    list->count++;
+
+    return 0;
+}
+
+static int compare_jobs(const void *a, const void *b)
+{
+    off_t sa = ((const Job*)a)->size;
+    off_t sb = ((const Job*)b)->size;
+
+    return (sa < sb) - (sa > sb);
+}
+
+static int parse_format(const char *name)
+{
+    if (!strcmp(name, "hack")) {
+        options.format = FORMAT_HACK;
+    } else if (!strcmp(name, "bin")) {
+        options.format = FORMAT_BIN;
+    } else if (!strcmp(name, "ihex")) {
+        options.format = FORMAT_IHEX;
+    } else if (!strcmp(name, "c")) {
+        options.format = FORMAT_C;
+    } else {
+        fprintf(stderr, "unknown output format: %s\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
 }
@@ -0,0 +1,215 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<sys/stat.h>
+#include "./obj.h"
+
+// An object file is little endian whatever the host:
+//
+//   "HOBJ" version word_count wide_count symbol_count reloc_count
+//   names_size                                                      (u32)
+//   word_count words                                                (u16)
+//   wide_count indices of wide A-instruction words                  (u32)
+//   symbol_count symbols: name len value flags                     (u32)
+//   reloc_count relocations: word symbol                            (u32)
+//   names_size bytes of symbol names
+//
+// obj_decode() checks every offset and count against the file, so a
+// truncated or foreign file is OBJ_BAD and never read out of bounds.
+
+#define OBJ_MAGIC "HOBJ"
+#define OBJ_VERSION 1
+#define OBJ_HEADER_SIZE 28
+#define OBJ_SYMBOL_SIZE 16
+#define OBJ_RELOC_SIZE 8
+
+static char* put32(char *out, uint32_t v);
+static uint32_t get32(const char *in);
+
+// obj_size is the size of obj once encoded.
+size_t obj_size(const Object *obj)
+{
+    return OBJ_HEADER_SIZE + (size_t)obj->word_count * 2 + (size_t)obj->wide_count * 4 + (size_t)obj->symbol_count * OBJ_SYMBOL_SIZE
+        + (size_t)obj->reloc_count * OBJ_RELOC_SIZE + obj->names_size;
+}
+
+// obj_encode writes obj to out, which holds obj_size() bytes, and returns
+// the bytes written.
+size_t obj_encode(const Object *obj, char *out)
+{
+    char *c = out;
+
+    memcpy(c, OBJ_MAGIC, 4);
+    c = put32(c + 4, OBJ_VERSION);
+    c = put32(c, obj->word_count);
+    c = put32(c, obj->wide_count);
+    c = put32(c, obj->symbol_count);
+    c = put32(c, obj->reloc_count);
+    c = put32(c, obj->names_size);
+
+    for (uint32_t i = 0; i < obj->word_count; i++)
+    {
+        *c++ = obj->words[i] & 0xFF;
+        *c++ = obj->words[i] >> 8;
+    }
+
+    for (uint32_t i = 0; i < obj->wide_count; i++) {
+        c = put32(c, obj->wide[i]);
+    }
+
+    for (uint32_t i = 0; i < obj->symbol_count; i++)
+    {
+        c = put32(c, obj->symbols[i].name);
+        c = put32(c, obj->symbols[i].len);
+        c = put32(c, obj->symbols[i].value);
+        c = put32(c, obj->symbols[i].flags);
+    }
+
+    for (uint32_t i = 0; i < obj->reloc_count; i++)
+    {
+        c = put32(c, obj->relocs[i].word);
+        c = put32(c, obj->relocs[i].symbol);
+    }
+
+    memcpy(c, obj->names, obj->names_size);
+
+    return c + obj->names_size - out;
+}
+
+// obj_decode reads the size bytes at data into obj, whose arrays are then
+// the caller's to release with obj_free().
+int obj_decode(const char *data, size_t size, Object *obj)
+{
+    memset(obj, 0, sizeof(Object));
+
+    if (size < OBJ_HEADER_SIZE || memcmp(data, OBJ_MAGIC, 4) || get32(data + 4) != OBJ_VERSION) {
+        return OBJ_BAD;
+    }
+
+    obj->word_count = get32(data + 8);
+    obj->wide_count = get32(data + 12);
+    obj->symbol_count = get32(data + 16);
+    obj->reloc_count = get32(data + 20);
+    obj->names_size = get32(data + 24);
+
+    if (obj_size(obj) != size) return OBJ_BAD;
+
+    obj->words = malloc(((size_t)obj->word_count + 1) * sizeof(uint16_t));
+    obj->wide = malloc(((size_t)obj->wide_count + 1) * sizeof(uint32_t));
+    obj->symbols = malloc(((size_t)obj->symbol_count + 1) * sizeof(ObjSymbol));
+    obj->relocs = malloc(((size_t)obj->reloc_count + 1) * sizeof(ObjReloc));
+    obj->names = malloc((size_t)obj->names_size + 1);
+    if (!obj->words || !obj->wide || !obj->symbols || !obj->relocs || !obj->names)
+    {
+        obj_free(obj);
+        return OBJ_NO_MEMORY;
+    }
+
+    const unsigned char *c = (const unsigned char*)data + OBJ_HEADER_SIZE;
+    for (uint32_t i = 0; i < obj->word_count; i++, c += 2) {
+        obj->words[i] = c[0] | c[1] << 8;
+    }
+
+    for (uint32_t i = 0; i < obj->wide_count; i++, c += 4)
+    {
+        obj->wide[i] = get32((const char*)c);
+        if (obj->wide[i] >= obj->word_count || (i && obj->wide[i] <= obj->wide[i - 1]))
+        {
+            obj_free(obj);
+            return OBJ_BAD;
+        }
+    }
+
+    for (uint32_t i = 0; i < obj->symbol_count; i++, c += OBJ_SYMBOL_SIZE)
+    {
+        ObjSymbol *s = &obj->symbols[i];
+        s->name = get32((const char*)c);
+        s->len = get32((const char*)c + 4);
+        s->value = get32((const char*)c + 8);
+        s->flags = get32((const char*)c + 12);
+
+        if (s->name > obj->names_size || s->len > obj->names_size - s->name || s->len == 0
+            || ((s->flags & OBJ_LABEL) && s->value > obj->word_count))
+        {
+            obj_free(obj);
+            return OBJ_BAD;
+        }
+    }
+
+    for (uint32_t i = 0; i < obj->reloc_count; i++, c += OBJ_RELOC_SIZE)
+    {
+        ObjReloc *r = &obj->relocs[i];
+        r->word = get32((const char*)c);
+        r->symbol = get32((const char*)c + 4);
+
+        // the linker walks the words and the relocations side by side.
+        if (r->word >= obj->word_count || r->symbol >= obj->symbol_count || (i && r->word <= obj->relocs[i - 1].word))
+        {
+            obj_free(obj);
+            return OBJ_BAD;
+        }
+    }
+
+    memcpy(obj->names, c, obj->names_size);
+
+    return OBJ_OK;
+}
+
+// obj_read loads the object file at path into obj.
+int obj_read(const char *path, Object *obj)
+{
+    memset(obj, 0, sizeof(Object));
+
+    FILE *file = fopen(path, "rb");
+    if (!file) return OBJ_IO;
+
+    struct stat st;
+    if (fstat(fileno(file), &st) || !S_ISREG(st.st_mode))
+    {
+        fclose(file);
+        return OBJ_IO;
+    }
+
+    size_t size = st.st_size;
+    char *data = malloc(size ? size : 1);
+    if (!data)
+    {
+        fclose(file);
+        return OBJ_NO_MEMORY;
+    }
+
+    int status = fread(data, 1, size, file) == size ? obj_decode(data, size, obj) : OBJ_IO;
+
+    free(data);
+    fclose(file);
+
+    return status;
+}
+
+void obj_free(Object *obj)
+{
+    free(obj->words);
+    free(obj->wide);
+    free(obj->symbols);
+    free(obj->relocs);
+    free(obj->names);
+    memset(obj, 0, sizeof(Object));
+}
+
+static char* put32(char *out, uint32_t v)
+{
+    out[0] = v & 0xFF;
+    out[1] = (v >> 8) & 0xFF;
+    out[2] = (v >> 16) & 0xFF;
+    out[3] = v >> 24;
+
+    return out + 4;
+}
+
+static uint32_t get32(const char *in)
+{
+    const unsigned char *c = (const unsigned char*)in;
+
+    return c[0] | c[1] << 8 | c[2] << 16 | (uint32_t)c[3] << 24;
+}
@@ -0,0 +1,56 @@
+#ifndef OBJ_H
+#define OBJ_H
+
+#include<stddef.h>
+#include<stdint.h>
+
+#define OBJ_OK 0
+#define OBJ_IO 1            // the file could not be read
+#define OBJ_BAD 2           // not an object of this version, or a corrupt one
+#define OBJ_NO_MEMORY 3
+
+// flags of an ObjSymbol.
+#define OBJ_LABEL 1         // a label of the module, value is its ROM offset in it
+#define OBJ_VARIABLE 2      // used before the module defines it, asks for a RAM slot
+
+// ObjSymbol is a symbol the module defines or refers to, in the order the
+// module first saw them. name and len point into the names.
+typedef struct {
+    uint32_t name;
+    uint32_t len;
+    uint32_t value;
+    uint32_t flags;
+}ObjSymbol;
+
+// ObjReloc says the word at index word is the value of symbol, the word
+// itself is 0 until the linker patches it.
+typedef struct {
+    uint32_t word;
+    uint32_t symbol;
+}ObjReloc;
+
+// Object is a module assembled on its own by -c: its encoded ROM words,
+// the symbols it defines or needs, and the words to patch once the linker
+// knows their values. wide lists the A-instructions whose constant has bit
+// 15 set, like @-1, which would read as C-instructions. Relocations and
+// wide are sorted by word.
+typedef struct {
+    uint16_t *words;
+    uint32_t word_count;
+    uint32_t *wide;
+    uint32_t wide_count;
+    ObjSymbol *symbols;
+    uint32_t symbol_count;
+    ObjReloc *relocs;
+    uint32_t reloc_count;
+    char *names;
+    uint32_t names_size;
+}Object;
+
+size_t obj_size(const Object *obj);
+size_t obj_encode(const Object *obj, char *out);
+int obj_decode(const char *data, size_t size, Object *obj);
+int obj_read(const char *path, Object *obj);
+void obj_free(Object *obj);
+
+#endif
@@ -0,0 +1,409 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./opt.h"
+#include "./hack.h"
+
+// opt is a peephole pass over the IR between scan() and generate(). It
+// walks the instructions once per round, keeping what is known about A and
+// D since the last label, and drops or rewrites what does not change the
+// machine: loads of a value A already holds, loads overwritten before any
+// use, C-instructions that store what the registers already hold, pairs
+// like M=M+1 M=M-1 that undo each other, jumps that are never taken or go
+// to the next instruction and code no jump can reach. Every label starts
+// a block with nothing known, since any label can be a jump target, and
+// the labels get their ROM addresses again at the end.
+//
+// Only labels move, so a program that jumps to a numeric address or to one
+// computed from a label, or reads RAM at a label address, is left as it is.
+// Such a value is not followed through RAM or over a label, so a program
+// that lets one get there and jumps where the pass can not see is left as
+// it is too.
+
+#define C_WORD(comp, dest, jump) (0xE000 | (comp) << 6 | (dest) << 3 | (jump))
+
+// comp fields of the increments and decrements the undo rules look for.
+#define COMP_D_PLUS_1 0x1F
+#define COMP_D_MINUS_1 0x0E
+#define COMP_A_PLUS_1 0x37
+#define COMP_A_MINUS_1 0x32
+#define COMP_M_PLUS_1 0x77
+#define COMP_M_MINUS_1 0x72
+#define COMP_M 0x70
+
+// keys at or above LABEL_KEY stand for the address of label key - LABEL_KEY,
+// which is not known until the pass is done.
+#define LABEL_KEY 0x10000u
+// the rounds stop early once one changes nothing.
+#define OPT_MAX_ROUNDS 8
+
+// Value is what is known about a register.
+typedef enum{
+    VALUE_UNKNOWN,
+    VALUE_KNOWN,    // it holds key
+    VALUE_DERIVED   // it was computed from a label address
+}value_state;
+
+typedef struct {
+    value_state state;
+    uint32_t key;
+}Value;
+
+static const Value unknown = { VALUE_UNKNOWN, 0 };
+
+static size_t run_round(IR *ir, const uint8_t *labels);
+static int absolute_jump(IR *ir, const uint8_t *labels);
+static void place_labels(IR *ir);
+static Value eval(uint8_t comp, Value d, Value a);
+static int jumps(uint8_t jump, uint16_t value);
+static int undoes(uint8_t first, uint8_t second, uint8_t dest);
+static int reads_a(uint16_t word);
+static int a_dead_after(IR *ir, size_t i);
+static int label_follows(IR *ir, size_t i, uint32_t id);
+static uint32_t key_of(IR *ir, const uint8_t *labels, size_t i);
+
+// opt_peephole rewrites ir in place and sets removed to the instructions
+// it took out. It returns OPT_ABSOLUTE_JUMP, changing nothing, when the
+// program jumps to an address that is not a label.
+int opt_peephole(IR *ir, size_t *removed)
+{
+    *removed = 0;
+
+    uint8_t *labels = calloc(ir->symbol_count ? ir->symbol_count : 1, 1);
+    if (!labels) return OPT_NO_MEMORY;
+
+    for (size_t i = 0; i < ir->count; i++) {
+        if (ir->kinds[i] == IR_LABEL) labels[ir->operands[i]] = 1;
+    }
+
+    if (absolute_jump(ir, labels))
+    {
+        free(labels);
+        return OPT_ABSOLUTE_JUMP;
+    }
+
+    for (int round = 0; round < OPT_MAX_ROUNDS; round++)
+    {
+        size_t count = run_round(ir, labels);
+        if (!count) break;
+        *removed += count;
+    }
+
+    place_labels(ir);
+    free(labels);
+
+    return OPT_OK;
+}
+
+// run_round makes one pass over ir, compacting it as it goes, and returns
+// the instructions it removed. The rules that look back look at what was
+// already kept, so a removal can make the instruction before the next one.
+static size_t run_round(IR *ir, const uint8_t *labels)
+{
+    Value a = unknown, d = unknown;
+    int reachable = 1;
+    size_t removed = 0;
+    size_t w = 0;
+
+    for (size_t r = 0; r < ir->count; r++)
+    {
+        uint8_t kind = ir->kinds[r];
+        uint32_t operand = ir->operands[r];
+        // kept is the last instruction written in this block, if any.
+        int kept = w > 0 && ir->kinds[w - 1] != IR_LABEL;
+
+        if (kind == IR_LABEL)
+        {
+            a = d = unknown;
+            reachable = 1;
+        }
+        else if (!reachable)
+        {
+            removed++;
+            continue;
+        }
+        else if (kind != IR_C)
+        {
+            uint32_t key = key_of(ir, labels, r);
+            if (a.state == VALUE_KNOWN && a.key == key)
+            {
+                removed++;
+                continue;
+            }
+
+            // an A-instruction right before this one is never used.
+            if (kept && ir->kinds[w - 1] != IR_C)
+            {
+                w--;
+                removed++;
+            }
+
+            a.state = VALUE_KNOWN;
+            a.key = key;
+        }
+        else
+        {
+            uint8_t comp = COMP(operand), dest = DEST(operand), jump = JUMP(operand);
+            Value result = eval(comp, d, a);
+
+            if (jump && result.state == VALUE_KNOWN && result.key < LABEL_KEY)
+            {
+                if (!jumps(jump, result.key)) {
+                    jump = 0;
+                } else {
+                    jump = JUMP_ALWAYS;
+                }
+                operand = C_WORD(comp, dest, jump);
+            }
+
+            // @L 0;JMP (L) and the like: taken or not, the next instruction
+            // runs, only A is left different.
+            if (jump && !dest && kept && ir->kinds[w - 1] == IR_A_SYMBOL
+                && label_follows(ir, r + 1, ir->operands[w - 1]) && a_dead_after(ir, r + 1))
+            {
+                w--;
+                removed += 2;
+                a = unknown;
+                continue;
+            }
+
+            int same_a = !(dest & DEST_A) || (a.state == VALUE_KNOWN && result.state == VALUE_KNOWN && a.key == result.key);
+            int same_d = !(dest & DEST_D) || (d.state == VALUE_KNOWN && result.state == VALUE_KNOWN && d.key == result.key);
+            if (!jump && !(dest & DEST_M) && same_a && same_d)
+            {
+                removed++;
+                continue;
+            }
+
+            if (!jump && kept && ir->kinds[w - 1] == IR_C && !JUMP(ir->operands[w - 1]))
+            {
+                uint16_t prev = ir->operands[w - 1];
+
+                if (DEST(prev) == dest && undoes(COMP(prev), comp, dest))
+                {
+                    w--;
+                    removed += 2;
+                    if (dest & DEST_A) a = eval(comp, d, a);
+                    if (dest & DEST_D) d = eval(comp, d, a);
+                    continue;
+                }
+
+                // M=M+1 AM=M-1 leaves M as it was and A at it: A=M.
+                if (prev == C_WORD(COMP_M_PLUS_1, DEST_M, 0) && comp == COMP_M_MINUS_1 && dest == (DEST_A | DEST_M))
+                {
+                    ir->operands[w - 1] = C_WORD(COMP_M, DEST_A, 0);
+                    removed++;
+                    a = unknown;
+                    continue;
+                }
+            }
+
+            if (dest & DEST_A) a = result;
+            if (dest & DEST_D) d = result;
+            if (jump == JUMP_ALWAYS) reachable = 0;
+        }
+
+        ir->kinds[w] = kind;
+        ir->operands[w] = operand;
+        ir->lines[w] = ir->lines[r];
+        w++;
+    }
+
+    ir->count = w;
+
+    return removed;
+}
+
+// absolute_jump tells whether any jump goes to a numeric address or to one
+// computed from a label, or a label address is used as a RAM address,
+// which the pass can not move along. A number, however it was computed,
+// or a label-derived address is followed no further once it is stored to
+// RAM or is still in D or A at a label, or in D at a jump, so when one of
+// them escaped and the program has a jump whose target is not known here,
+// the jump is taken to be absolute.
+static int absolute_jump(IR *ir, const uint8_t *labels)
+{
+    Value a = unknown, d = unknown;
+    int d_moved = 0, escaped = 0, indirect = 0;
+
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        if (ir->kinds[i] == IR_LABEL)
+        {
+            escaped |= d_moved || a.state == VALUE_DERIVED || (a.state == VALUE_KNOWN && a.key < LABEL_KEY);
+            a = d = unknown;
+            d_moved = 0;
+            continue;
+        }
+
+        if (ir->kinds[i] != IR_C)
+        {
+            a.state = VALUE_KNOWN;
+            a.key = key_of(ir, labels, i);
+            continue;
+        }
+
+        uint16_t word = ir->operands[i];
+        int label_a = a.state == VALUE_DERIVED || (a.state == VALUE_KNOWN && a.key >= LABEL_KEY);
+        int number_a = a.state == VALUE_KNOWN && a.key < LABEL_KEY;
+        if (JUMP(word) && (a.state == VALUE_DERIVED || number_a)) {
+            return 1;
+        }
+
+        int uses_m = ((COMP(word) & 0x40) && !(COMP(word) & 0x08)) || (DEST(word) & DEST_M);
+        if (uses_m && label_a) {
+            return 1;
+        }
+
+        if (JUMP(word))
+        {
+            indirect |= a.state == VALUE_UNKNOWN;
+            escaped |= d_moved;
+        }
+
+        // the result may be a jump target when it is a number, even one
+        // made of constants like D=1 D=D+1, or reads A or D holding one.
+        // Only a plain label address moves along with the code.
+        Value result = eval(COMP(word), d, a);
+        int reads_a = !(COMP(word) & 0x08) && !(COMP(word) & 0x40);
+        int reads_d = !(COMP(word) & 0x20);
+        int moved = result.state == VALUE_DERIVED || (result.state == VALUE_KNOWN && result.key < LABEL_KEY)
+            || (reads_a && (number_a || a.state == VALUE_DERIVED)) || (reads_d && d_moved);
+
+        if ((DEST(word) & DEST_M) && moved) escaped = 1;
+        if (DEST(word) & DEST_A) a = result;
+        if (DEST(word) & DEST_D)
+        {
+            d = result;
+            d_moved = moved;
+        }
+    }
+
+    return escaped && indirect;
+}
+
+// place_labels gives every label the ROM address of the instruction after
+// it, as scan() did before the pass.
+static void place_labels(IR *ir)
+{
+    size_t rom = 0;
+
+    for (size_t i = 0; i < ir->count; i++)
+    {
+        if (ir->kinds[i] == IR_LABEL) {
+            ir->values[ir->operands[i]] = rom;
+        } else {
+            rom++;
+        }
+    }
+
+    ir->rom_size = rom;
+}
+
+// eval is what comp computes from d and a. A computation that reads M is
+// unknown, as is one of a label address but a plain copy of it.
+static Value eval(uint8_t comp, Value d, Value a)
+{
+    uint8_t bits = comp & 0x3F;
+    int uses_x = !(bits & 0x20);
+    int uses_y = !(bits & 0x08);
+    Value result = unknown;
+
+    if (uses_y && (comp & 0x40)) return result;
+
+    if (bits == 0x0C) return d;
+    if (bits == 0x30) return a;
+
+    Value inputs[2] = { uses_x ? d : (Value){ VALUE_KNOWN, 0 }, uses_y ? a : (Value){ VALUE_KNOWN, 0 } };
+    for (int i = 0; i < 2; i++)
+    {
+        if (inputs[i].state == VALUE_UNKNOWN) return result;
+        if (inputs[i].state == VALUE_DERIVED || inputs[i].key >= LABEL_KEY) result.state = VALUE_DERIVED;
+    }
+
+    if (result.state == VALUE_DERIVED) return result;
+
+    result.state = VALUE_KNOWN;
+    result.key = hack_alu(inputs[0].key, inputs[1].key, bits);
+
+    return result;
+}
+
+// jumps tells whether jump is taken on value.
+static int jumps(uint8_t jump, uint16_t value)
+{
+    int16_t v = (int16_t)value;
+
+    return ((jump & 4) && v < 0) || ((jump & 2) && v == 0) || ((jump & 1) && v > 0);
+}
+
+// undoes tells whether second takes back what first did to the register
+// both store to alone.
+static int undoes(uint8_t first, uint8_t second, uint8_t dest)
+{
+    uint8_t plus, minus;
+
+    switch (dest)
+    {
+    case DEST_D:
+        plus = COMP_D_PLUS_1, minus = COMP_D_MINUS_1;
+        break;
+    case DEST_A:
+        plus = COMP_A_PLUS_1, minus = COMP_A_MINUS_1;
+        break;
+    case DEST_M:
+        plus = COMP_M_PLUS_1, minus = COMP_M_MINUS_1;
+        break;
+    default:
+        return 0;
+    }
+
+    return (first == plus && second == minus) || (first == minus && second == plus);
+}
+
+// reads_a tells whether a C-instruction needs A: as an operand, as the
+// address of M or as its jump target.
+static int reads_a(uint16_t word)
+{
+    return !(COMP(word) & 0x08) || (DEST(word) & DEST_M) || JUMP(word);
+}
+
+// a_dead_after tells whether the value of A at i is overwritten before
+// anything reads it.
+static int a_dead_after(IR *ir, size_t i)
+{
+    for (; i < ir->count; i++)
+    {
+        if (ir->kinds[i] == IR_LABEL) continue;
+        if (ir->kinds[i] != IR_C) return 1;
+
+        uint16_t word = ir->operands[i];
+        if (reads_a(word)) return 0;
+        if (DEST(word) & DEST_A) return 1;
+    }
+
+    return 1;
+}
+
+// label_follows tells whether label id is among the labels starting at i.
+static int label_follows(IR *ir, size_t i, uint32_t id)
+{
+    for (; i < ir->count && ir->kinds[i] == IR_LABEL; i++) {
+        if (ir->operands[i] == id) return 1;
+    }
+
+    return 0;
+}
+
+// key_of is the value the A-instruction at i loads: its number, or for a
+// label a key of its own.
+static uint32_t key_of(IR *ir, const uint8_t *labels, size_t i)
+{
+    uint32_t operand = ir->operands[i];
+
+    if (ir->kinds[i] == IR_A_CONST) return operand;
+
+    return labels[operand] ? LABEL_KEY + operand : ir->values[operand];
+}
+
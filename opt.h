@@ -0,0 +1,13 @@
+#ifndef OPT_H
+#define OPT_H
+
+#include<stddef.h>
+#include "./ir.h"
+
+#define OPT_OK 0
+#define OPT_NO_MEMORY 1
+#define OPT_ABSOLUTE_JUMP 2     // the program may jump to a numeric address, left as it is
+
+int opt_peephole(IR *ir, size_t *removed);
+
+#endif
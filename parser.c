@@ -1,16 +1,23 @@
+#include<errno.h>
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
-#include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "./arena.h"
+#include "./diag.h"
+#include "./lex.h"
 
 #define PARSE_OK 0
 #define PARSE_INVALID 1
 #define PARSE_EOF -1
+// read_till_none_blank() could not read the input, next_line() reported it.
+#define PARSE_READ_ERROR 2
 
 typedef enum{
     INVALID,
     A_INSTRUCTION,
-    C_INSTRUCTION,  
+    C_INSTRUCTION,
     L_INSTRUCTION
 }instruction_type;
 
@@ -22,91 +29,195 @@ const char* instruction_type_names[] = {
 };
 
 typedef struct {
+    const char *ptr;
+    size_t len;
+}Slice;
+
+typedef enum{
+    PARSER_STDIO,
+    PARSER_MMAP,
+    PARSER_BUFFER   // the caller's memory, sliced like a mapping
+}parser_backend;
+
+#define PART_SYMBOL 0
+#define PART_DEST 1
+#define PART_COMP 2
+#define PART_JUMP 3
+#define PART_COUNT 4
+
+typedef struct {
+    parser_backend backend;
     FILE *file;
+    const char *map;
+    size_t map_size;
+    size_t pos;
     int hasNext;
     size_t line_number;
-    char  line_buffer[512];
-    char* line;
+    size_t source_line;
+    // the stdio backend reads whole lines of any length into line_buffer,
+    // grown by getline() and never from the arena.
+    char *line_buffer;
+    size_t line_capacity;
+    Slice line;
+    // lex marks the raw line last returned by next_line(), window holds
+    // what the lexer read of the mapping past it.
+    LineLex lex;
+    LexWindow window;
     instruction_type current_instruction_type;
-    char* symbol;
-    char* dest;
-    char* comp;
-    char* jump;
+    Slice parts[PART_COUNT];
+    const char* part_strings[PART_COUNT];
+    // scratch holds parts that needed whitespace removed and the NUL
+    // terminated copies handed out by symbol()/dest()/comp()/jump().
+    char *scratch;
+    size_t scratch_size;
+    size_t scratch_used;
+    // the parser and its scratch come from arena when there is one.
+    Arena *arena;
+    Diagnostics *diag;
+    // a stream handed to init_parser_stream() is left open.
+    int borrowed;
 }Parser;
 
 static void parse_symbol_parts(Parser *p);
 static void parse_instruction_parts(Parser* p);
 static int read_till_none_blank(Parser *p);
-static short int is_comment(const char* s);
-static char* trim(char* s);
-void remove_whitespace(const char* src, char* dest);
-static instruction_type parse_instruction_type(const char* instruction);
+static int next_line(Parser *p, Slice *line);
+static short int is_comment(Slice s);
+static Slice trim(Slice s);
+static Slice trim_line(Parser *p, Slice s);
+static Slice compact(Parser *p, Slice s);
+static Slice compact_part(Parser *p, Slice s, int spaced);
+static int reserve_scratch(Parser *p, size_t size);
+static const char* part_string(Parser *p, int part);
+static instruction_type parse_instruction_type(Slice instruction, const LineLex *lex);
+static Parser* new_parser(Arena *arena);
+static Parser* open_stream(FILE *file, Arena *arena);
+
+static inline int is_blank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
 
-Parser* init_parser(const char *filename)
+// init_parser opens the .asm file at filename, reporting why it can not
+// to diag.
+Parser* init_parser(const char *filename, Arena *arena, Diagnostics *diag)
 {
     const char *ext = ".asm";
     size_t ext_size = strlen(ext);
     size_t file_size = strlen(filename);
-    
+
     if (file_size < ext_size)
-    {   
-        fprintf(stderr, "Err: input file should have .asm extention");
+    {
+        diag_report(diag, 0, "Err: input file should have .asm extention");
         return NULL;
     }
 
     if (strcmp(filename + (file_size - ext_size), ext))
     {
-        fprintf(stderr, "Err: input file should have .asm extention");
+        diag_report(diag, 0, "Err: input file should have .asm extention");
         return NULL;
     }
 
     FILE *file = fopen(filename, "r");
     if (!file)
-    {   
-        perror( "Err opening file");
+    {
+        diag_report(diag, 0, "Err opening file: %s", strerror(errno));
         return NULL;
     }
 
-    Parser *p = malloc(sizeof(Parser));
+    Parser *p = open_stream(file, arena);
+    if (!p) {
+        fclose(file);
+        return NULL;
+    }
+
+    return p;
+}
+
+// init_parser_stream parses an open stream such as stdin, which stays
+// open. A pipe is read once from start to end and never seeked, so it can
+// only be assembled by a mode that does not read its input twice.
+Parser* init_parser_stream(FILE *file, Arena *arena)
+{
+    Parser *p = open_stream(file, arena);
     if (!p) return NULL;
 
-    p->file = file;
-    p->line_number = 0;
-    p->hasNext = 1;
-    p->symbol = NULL;
-    p->dest = NULL;
-    p->comp = NULL;
-    p->jump = NULL;
-    p->line = NULL;
+    p->borrowed = 1;
+
+    return p;
+}
+
+// init_parser_buffer parses len bytes at src, which have to stay put
+// until the parser is freed. Nothing is opened or read.
+Parser* init_parser_buffer(const char *src, size_t len, Arena *arena)
+{
+    Parser *p = new_parser(arena);
+    if (!p) return NULL;
+
+    p->backend = PARSER_BUFFER;
+    p->map = src;
+    p->map_size = len;
 
     return p;
 }
 
+// parser_input gives the whole input of a parser that holds it in memory,
+// a mapped file or a buffer. It returns 0 for a stream read line by line.
+int parser_input(Parser *p, const char **data, size_t *len)
+{
+    if (p->backend == PARSER_STDIO) return 0;
+
+    *data = p->map;
+    *len = p->map_size;
+
+    return 1;
+}
+
+// parser_set_diagnostics sends the syntax errors to diag instead of stderr.
+void parser_set_diagnostics(Parser *p, Diagnostics *diag)
+{
+    p->diag = diag;
+}
+
 int hasMoreLines(Parser *p)
 {
     return p->hasNext;
 }
 
 int advance(Parser *p)
-{   
+{
     int result = read_till_none_blank(p);
 
     if (result == PARSE_EOF) return PARSE_EOF;
+    if (result == PARSE_READ_ERROR) return PARSE_INVALID;
 
     if (result == PARSE_INVALID)
     {
-        fprintf(stderr, "Syntax error at line %zu: \"%s\"\n", p->line_number, p->line);
+        diag_report(p->diag, p->source_line, "Syntax error at line %zu: \"%.*s\"", p->line_number, (int)p->line.len, p->line.ptr);
         return PARSE_INVALID;
     }
 
-   instruction_type instyp = parse_instruction_type(p->line);
+   instruction_type instyp = parse_instruction_type(p->line, &p->lex);
    if (instyp == INVALID)
-   {    
-        fprintf(stderr, "Invalid instruction at line %zu: \"%s\"\n", p->line_number, p->line);
+   {
+        diag_report(p->diag, p->source_line, "Invalid instruction at line %zu: \"%.*s\"", p->line_number, (int)p->line.len, p->line.ptr);
         return PARSE_INVALID;
    }
    p->current_instruction_type = instyp;
 
+   if (reserve_scratch(p, 2 * p->line.len + PART_COUNT))
+   {
+        diag_report(p->diag, p->source_line, "Err out of memory at line %zu", p->line_number);
+        return PARSE_INVALID;
+   }
+
+   for (int i = 0; i < PART_COUNT; i++)
+   {
+        p->parts[i].ptr = NULL;
+        p->parts[i].len = 0;
+        p->part_strings[i] = NULL;
+   }
+
    if (instyp == A_INSTRUCTION || instyp == L_INSTRUCTION)
    {
         parse_symbol_parts(p);
@@ -119,7 +230,7 @@ int advance(Parser *p)
 }
 
 instruction_type instructionType(Parser *p)
-{   
+{
     return p->current_instruction_type;
 }
 
@@ -129,118 +240,319 @@ size_t current_line_number(Parser *p)
     return p->line_number;
 }
 
+size_t current_source_line(Parser *p)
+{
+    return p->source_line;
+}
+
 const char *symbol(Parser *p)
 {
-    return p->symbol;
+    return part_string(p, PART_SYMBOL);
 }
 
 const char* dest(Parser *p)
 {
-    return p->dest;
+    return part_string(p, PART_DEST);
 }
 
 const char* comp(Parser *p)
 {
-    return p->comp;
+    return part_string(p, PART_COMP);
 }
 
 const char* jump(Parser *p)
-{   
-  return p->jump;
+{
+    return part_string(p, PART_JUMP);
+}
+
+Slice symbol_slice(Parser *p)
+{
+    return p->parts[PART_SYMBOL];
+}
+
+Slice dest_slice(Parser *p)
+{
+    return p->parts[PART_DEST];
+}
+
+Slice comp_slice(Parser *p)
+{
+    return p->parts[PART_COMP];
+}
+
+Slice jump_slice(Parser *p)
+{
+    return p->parts[PART_JUMP];
 }
 
 void free_parser(Parser* p) {
     if (!p) return;
-    if (p->file) fclose(p->file);
+    if (p->backend == PARSER_MMAP && p->map) munmap((void*)p->map, p->map_size);
+    if (p->file && !p->borrowed) fclose(p->file);
+    free(p->line_buffer);
+    if (p->arena) return;
+    free(p->scratch);
     free(p);
 }
 
 void reset(Parser* p)
-{   
+{
     if (!p) return;
 
-    if (p->file) 
+    // a stream still at its start needs no seek, which a pipe could not do.
+    if (p->backend == PARSER_STDIO && p->file && p->source_line)
     {
         fseek(p->file, 0, SEEK_SET);
     }
-    
-    p->line = NULL;
+
+    p->pos = 0;
+    p->window.base = NULL;
+    p->line.ptr = NULL;
+    p->line.len = 0;
     p->line_number = 0;
+    p->source_line = 0;
     p->hasNext = 1;
-    p->symbol = NULL;
-    p->dest = NULL;
-    p->comp = NULL;
-    p->jump = NULL;
-    p->line = NULL;
+
+    for (int i = 0; i < PART_COUNT; i++)
+    {
+        p->parts[i].ptr = NULL;
+        p->parts[i].len = 0;
+        p->part_strings[i] = NULL;
+    }
 }
 
-static instruction_type parse_instruction_type(const char* instruction)
-{   
-    if(!instruction || !*instruction) return INVALID;
+static Parser* new_parser(Arena *arena)
+{
+    Parser *p = arena ? arena_alloc(arena, sizeof(Parser)) : malloc(sizeof(Parser));
+    if (!p) return NULL;
+
+    memset(p, 0, sizeof(Parser));
+    p->hasNext = 1;
+    p->arena = arena;
 
-    if (instruction[0] == '@') return A_INSTRUCTION;
-    
-    if (strstr(instruction, "=") || strstr(instruction, ";")) return C_INSTRUCTION;
+    return p;
+}
 
-    size_t len = strlen(instruction);
-    if (len > 2 && (instruction[0] == '(') && (instruction[len - 1] == ')')) return L_INSTRUCTION;
+// open_stream makes a parser for file. Regular files are mapped whole and
+// sliced in place, anything else (pipes, devices) is read line by line.
+static Parser* open_stream(FILE *file, Arena *arena)
+{
+    Parser *p = new_parser(arena);
+    if (!p) return NULL;
+
+    p->backend = PARSER_STDIO;
+    p->file = file;
+
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        p->backend = PARSER_MMAP;
+        p->map_size = st.st_size;
+
+        if (p->map_size > 0)
+        {
+            void *map = mmap(NULL, p->map_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+            if (map == MAP_FAILED) {
+                p->backend = PARSER_STDIO;
+                p->map_size = 0;
+            } else {
+                madvise(map, p->map_size, MADV_SEQUENTIAL);
+                p->map = map;
+            }
+        }
+    }
+
+    return p;
+}
+
+// parse_instruction_type classifies the trimmed line, lex tells whether
+// it has a '=' or ';' since both are kept by trimming.
+static instruction_type parse_instruction_type(Slice instruction, const LineLex *lex)
+{
+    if(!instruction.len) return INVALID;
+
+    if (instruction.ptr[0] == '@') return A_INSTRUCTION;
+
+    if (lex->eq != lex->end || lex->semi != lex->end) return C_INSTRUCTION;
+
+    size_t len = instruction.len;
+    if (len > 2 && (instruction.ptr[0] == '(') && (instruction.ptr[len - 1] == ')')) return L_INSTRUCTION;
 
     return INVALID;
 }
 
-static char* trim(char* s) {
-    while (isspace((unsigned char)*s)) s++;
-    if (*s == 0) return s;
-    
-    char* end;
-    if ((end = strstr(s, "//")) != NULL) {
-        *end = 0;
+// trim drops leading whitespace, anything from the first "//" on and
+// trailing whitespace or slashes.
+static Slice trim(Slice s) {
+    while (s.len && is_blank(*s.ptr)) {
+        s.ptr++;
+        s.len--;
     }
+    if (!s.len) return s;
 
-    end = s + strlen(s) - 1;
-    while (end > s && (isspace((unsigned char)*end) || *end == '/')) end--;
+    for (size_t i = 0; i + 1 < s.len; i++)
+    {
+        if (s.ptr[i] == '/' && s.ptr[i + 1] == '/') {
+            s.len = i;
+            break;
+        }
+    }
+
+    while (s.len > 1 && (is_blank(s.ptr[s.len - 1]) || s.ptr[s.len - 1] == '/')) s.len--;
 
-    end[1] = '\0';
     return s;
 }
 
-void remove_whitespace(const char* src, char* dest) {
-    while (*src) {
-        if (!isspace((unsigned char)*src)) {
-            *dest++ = *src;
-        }
-        src++;
+// trim_line trims a raw line like trim(), with the comment lex_line()
+// already found.
+static Slice trim_line(Parser *p, Slice s) {
+    while (s.len && is_blank(*s.ptr)) {
+        s.ptr++;
+        s.len--;
+    }
+    if (!s.len) return s;
+
+    if (p->lex.comment < s.ptr + s.len) s.len = p->lex.comment - s.ptr;
+
+    while (s.len > 1 && (is_blank(s.ptr[s.len - 1]) || s.ptr[s.len - 1] == '/')) s.len--;
+
+    return s;
+}
+
+// compact returns s itself unless it has whitespace inside, in which case
+// the remaining characters are copied into the scratch area.
+static Slice compact(Parser *p, Slice s)
+{
+    size_t i = 0;
+    while (i < s.len && !is_blank(s.ptr[i])) i++;
+    if (i == s.len) return s;
+
+    char *out = p->scratch + p->scratch_used;
+    size_t len = 0;
+    for (i = 0; i < s.len; i++)
+    {
+        if (!is_blank(s.ptr[i])) out[len++] = s.ptr[i];
+    }
+
+    p->scratch_used += len;
+    s.ptr = out;
+    s.len = len;
+
+    return s;
+}
+
+// compact_part trims a part of a C-instruction and compacts it when the
+// line has whitespace inside.
+static Slice compact_part(Parser *p, Slice s, int spaced)
+{
+    s = trim(s);
+
+    return spaced ? compact(p, s) : s;
+}
+
+static int reserve_scratch(Parser *p, size_t size)
+{
+    p->scratch_used = 0;
+    if (size <= p->scratch_size) return 0;
+
+    // the old scratch holds nothing live, an arena just hands out a new one.
+    char *grown = p->arena ? arena_alloc(p->arena, size) : realloc(p->scratch, size);
+    if (!grown) return 1;
+
+    p->scratch = grown;
+    p->scratch_size = size;
+
+    return 0;
+}
+
+static const char* part_string(Parser *p, int part)
+{
+    Slice s = p->parts[part];
+    if (!s.ptr) return NULL;
+
+    if (!p->part_strings[part])
+    {
+        char *out = p->scratch + p->scratch_used;
+        memcpy(out, s.ptr, s.len);
+        out[s.len] = '\0';
+        p->scratch_used += s.len + 1;
+        p->part_strings[part] = out;
     }
-    *dest = '\0';
+
+    return p->part_strings[part];
 }
 
 // is_comment takes and string line and check if it
 // it is a comment line means start with two contineus '//'
-// returns 0 if not comment, 1 if comment and -1 if its a invalid line. 
-static short int is_comment(const char* s)
-{   
+// returns 0 if not comment, 1 if comment and -1 if its a invalid line.
+static short int is_comment(Slice s)
+{
     // empty line is not comment line.
-    if (!*s) return 0;
+    if (!s.len) return 0;
 
-    if (*s++ != '/')
+    if (s.ptr[0] != '/')
     {
        return 0;
     }
 
-    return (*s && *s == '/') ? 1 : -1;
+    return (s.len > 1 && s.ptr[1] == '/') ? 1 : -1;
+}
+
+// next_line returns the next raw line without its newline, either sliced
+// straight out of the mapping or read whole into line_buffer. It returns 0
+// at the end of the input and -1, once reported, when it can not be read.
+static int next_line(Parser *p, Slice *line)
+{
+    if (p->backend != PARSER_STDIO)
+    {
+        if (p->pos >= p->map_size) return 0;
+
+        const char *start = p->map + p->pos;
+        const char *end = p->map + p->map_size;
+        lex_line(&p->window, start, end, &p->lex);
+
+        line->ptr = start;
+        line->len = p->lex.end - start;
+        p->pos += line->len + (p->lex.end < end);
+        p->source_line++;
+
+        return 1;
+    }
+
+    errno = 0;
+    ssize_t len = getline(&p->line_buffer, &p->line_capacity, p->file);
+    if (len < 0)
+    {
+        if (!errno && !ferror(p->file)) return 0;
+
+        diag_report(p->diag, p->source_line + 1, "Err reading line %zu: %s", p->source_line + 1, strerror(errno ? errno : EIO));
+        return -1;
+    }
+
+    line->ptr = p->line_buffer;
+    line->len = len;
+    // line_buffer is refilled, nothing of the window is left in it.
+    p->window.base = NULL;
+    lex_line(&p->window, line->ptr, line->ptr + line->len, &p->lex);
+    p->source_line++;
+
+    return 1;
 }
 
 static int read_till_none_blank(Parser *p)
-{   
-    while((fgets(p->line_buffer, sizeof(p->line_buffer), p->file)))
-    {   
-        p->line = trim(p->line_buffer);
+{
+    Slice raw;
+    int got;
+
+    while((got = next_line(p, &raw)) > 0)
+    {
+        p->line = trim_line(p, raw);
 
         short int cmt = is_comment(p->line);
 
         if (cmt < 0) return PARSE_INVALID;
-        
-        if (!cmt && *p->line)
+
+        if (!cmt && p->line.len)
         {
             p-> hasNext = 1;
 
@@ -249,67 +561,57 @@ static int read_till_none_blank(Parser *p)
     }
 
     p-> hasNext = 0;
-    return PARSE_EOF;
+    return got < 0 ? PARSE_READ_ERROR : PARSE_EOF;
 }
 
 static void parse_instruction_parts(Parser* p)
 {
-    p->dest = NULL;
-    p->comp = NULL;
-    p->jump = NULL;
+    // the lexer found the first '=' and ';', and whether there is any
+    // whitespace to compact out of the parts.
+    const char* end = p->line.ptr + p->line.len;
+    const char* ptr = p->lex.eq < p->lex.semi ? p->lex.eq : p->lex.semi;
+    if (ptr > end) ptr = end;
+    int spaced = p->lex.blank < end;
 
-    char* ptr = p->line;
-    while(*ptr && (*ptr != ';') && (*ptr != '=')) ptr++;
-    
-    size_t len;
+    Slice before = { p->line.ptr, ptr - p->line.ptr };
+    Slice after = { ptr + 1, end - ptr - 1 };
 
-    if (*ptr && *ptr == '=')
+    if (ptr < end && *ptr == '=')
     {
-        *ptr = '\0';
-        p->dest = trim(p->line);
-        len = strlen(p->dest);
-        char destbuff[len];
-        remove_whitespace(p->dest, destbuff);
-        p->dest = destbuff;
-
-        p->comp = trim(++ptr);
-        len = strlen(p->comp);
-        char compBuff[len];
-        remove_whitespace(p->comp, compBuff);
-        p->comp = compBuff;
-    }else if (*ptr && *ptr == ';')
+        // dest=comp;jump
+        const char *semicolon = p->lex.semi < end ? p->lex.semi : end;
+
+        p->parts[PART_DEST] = compact_part(p, before, spaced);
+        if (semicolon < end)
+        {
+            Slice comp = { ptr + 1, semicolon - ptr - 1 };
+            Slice jump = { semicolon + 1, end - semicolon - 1 };
+            p->parts[PART_COMP] = compact_part(p, comp, spaced);
+            p->parts[PART_JUMP] = compact_part(p, jump, spaced);
+        } else {
+            p->parts[PART_COMP] = compact_part(p, after, spaced);
+        }
+    }else if (ptr < end && *ptr == ';')
     {
-        *ptr = '\0';
-        p->comp = trim(p->line);
-        len = strlen(p->comp);
-        char compBuff[len];
-        remove_whitespace(p->comp, compBuff);
-        p->comp = compBuff;
-
-        p->jump = trim(++ptr);
-        len = strlen(p->jump);
-        char jumpBuff[len];
-        remove_whitespace(p->jump, jumpBuff);
-        p->jump = jumpBuff;
+        p->parts[PART_COMP] = compact_part(p, before, spaced);
+        p->parts[PART_JUMP] = compact_part(p, after, spaced);
     }
 
     p->line_number++;
 }
 
 static void parse_symbol_parts(Parser *p)
-{   
-    p->symbol = NULL;
-
+{
     if (p->current_instruction_type == A_INSTRUCTION)
-    {   
-        p->symbol = p->line + 1;
+    {
+        p->parts[PART_SYMBOL].ptr = p->line.ptr + 1;
+        p->parts[PART_SYMBOL].len = p->line.len - 1;
         p->line_number++;
-    }  
+    }
 
     if (p->current_instruction_type == L_INSTRUCTION)
     {
-        size_t len = strlen(p->line);
-        p->line[len - 1] = '\0';   
-        p->symbol = p->line + 1;
+        p->parts[PART_SYMBOL].ptr = p->line.ptr + 1;
+        p->parts[PART_SYMBOL].len = p->line.len - 2;
     }
 }
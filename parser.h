@@ -1,6 +1,11 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include<stdio.h>
+#include<stddef.h>
+#include "./arena.h"
+#include "./diag.h"
+
 #define PARSE_OK 0
 #define PARSE_INVALID 1
 #define PARSE_EOF -1
@@ -14,9 +19,20 @@ typedef enum{
 
 extern const char* instruction_type_names[];
 
+// Slice is a view into the parser input, it is not NUL terminated and is
+// valid until the next call to advance().
+typedef struct {
+    const char *ptr;
+    size_t len;
+}Slice;
+
 typedef struct Parser Parser;
 
-Parser* init_parser(const char *filename);
+Parser* init_parser(const char *filename, Arena *arena, Diagnostics *diag);
+Parser* init_parser_stream(FILE *file, Arena *arena);
+Parser* init_parser_buffer(const char *src, size_t len, Arena *arena);
+void parser_set_diagnostics(Parser *p, Diagnostics *diag);
+int parser_input(Parser *p, const char **data, size_t *len);
 int advance(Parser *p);
 int hasMoreLines(Parser *p);
 instruction_type instructionType(Parser *p);
@@ -24,7 +40,12 @@ const char* symbol(Parser *p);
 const char* dest(Parser *p);
 const char* comp(Parser *p);
 const char* jump(Parser *p);
+Slice symbol_slice(Parser *p);
+Slice dest_slice(Parser *p);
+Slice comp_slice(Parser *p);
+Slice jump_slice(Parser *p);
 size_t current_line_number(Parser *p);
+size_t current_source_line(Parser *p);
 void free_parser(Parser* p);
 void reset(Parser* p);
 
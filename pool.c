@@ -0,0 +1,329 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include<time.h>
+#include<unistd.h>
+#include "./pool.h"
+
+// Every worker owns a deque: it pushes and pops its own tasks at the tail
+// and, once it runs dry, steals from the head of the others. Tasks
+// submitted from outside the pool are dealt round robin.
+
+typedef struct {
+    pool_task_fn fn;
+    void *arg;
+}Task;
+
+typedef struct {
+    Task *tasks;
+    size_t head;
+    size_t tail;
+    size_t capacity;
+    pthread_mutex_t lock;
+}Deque;
+
+typedef struct {
+    Pool *pool;
+    size_t index;
+}Worker;
+
+struct Pool {
+    pthread_t *threads;
+    Worker *args;
+    Deque *deques;
+    size_t workers;
+    size_t next;
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+    size_t queued;
+    size_t pending;
+    // CPU time the workers spent in tasks, see pool_cpu_ms().
+    double cpu_ms;
+    int shutdown;
+};
+
+static __thread Pool *current_pool;
+static __thread size_t current_worker;
+
+static void* worker_main(void *arg);
+static int deque_push(Deque *d, Task task);
+static int deque_pop(Deque *d, Task *task);
+static int deque_steal(Deque *d, Task *task);
+static int take_task(Pool *p, size_t self, Task *task);
+static double thread_cpu_ms(void);
+
+Pool* pool_init(size_t workers)
+{
+    if (workers == 0) workers = 1;
+
+    Pool *p = malloc(sizeof(Pool));
+    if (!p) return NULL;
+
+    memset(p, 0, sizeof(Pool));
+    p->workers = workers;
+    p->threads = calloc(workers, sizeof(pthread_t));
+    p->deques = calloc(workers, sizeof(Deque));
+    p->args = calloc(workers, sizeof(Worker));
+    if (!p->threads || !p->deques || !p->args)
+    {
+        free(p->threads);
+        free(p->deques);
+        free(p->args);
+        free(p);
+        return NULL;
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_ready, NULL);
+    pthread_cond_init(&p->all_done, NULL);
+
+    for (size_t i = 0; i < workers; i++) {
+        pthread_mutex_init(&p->deques[i].lock, NULL);
+    }
+
+    for (size_t i = 0; i < workers; i++)
+    {
+        p->args[i].pool = p;
+        p->args[i].index = i;
+        if (pthread_create(&p->threads[i], NULL, worker_main, &p->args[i]))
+        {
+            fprintf(stderr, "Err can not start worker thread\n");
+            p->workers = i;
+            break;
+        }
+    }
+
+    if (p->workers == 0)
+    {
+        pool_free(p);
+        return NULL;
+    }
+
+    return p;
+}
+
+// pool_submit queues fn(arg). From inside a task the work goes on the
+// calling worker's own deque so it stays hot there unless stolen.
+int pool_submit(Pool *p, pool_task_fn fn, void *arg)
+{
+    Task task = { fn, arg };
+    size_t index;
+
+    // the task is counted before it can be taken, so a worker finishing it
+    // never brings pending to 0 while pool_wait() should still block.
+    pthread_mutex_lock(&p->lock);
+    index = current_pool == p ? current_worker : p->next++ % p->workers;
+    p->queued++;
+    p->pending++;
+    pthread_mutex_unlock(&p->lock);
+
+    if (deque_push(&p->deques[index], task))
+    {
+        pthread_mutex_lock(&p->lock);
+        p->queued--;
+        if (--p->pending == 0) pthread_cond_broadcast(&p->all_done);
+        pthread_mutex_unlock(&p->lock);
+        return 1;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&p->work_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    return 0;
+}
+
+// pool_wait blocks until every submitted task, including the ones
+// submitted by tasks, has finished.
+void pool_wait(Pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->pending) pthread_cond_wait(&p->all_done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// pool_cpu_ms is the CPU time the workers have spent running tasks, which
+// the clock of the thread that submitted them does not see. A NULL pool
+// spent none.
+double pool_cpu_ms(Pool *p)
+{
+    if (!p) return 0;
+
+    pthread_mutex_lock(&p->lock);
+    double ms = p->cpu_ms;
+    pthread_mutex_unlock(&p->lock);
+
+    return ms;
+}
+
+size_t pool_workers(Pool *p)
+{
+    return p->workers;
+}
+
+// pool_worker_index is the index, below pool_workers(), of the worker
+// running the calling task, so a task can use per worker state without
+// locking it. Outside of a worker it is 0.
+size_t pool_worker_index(void)
+{
+    return current_worker;
+}
+
+void pool_free(Pool *p)
+{
+    if (!p) return;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = 1;
+    pthread_cond_broadcast(&p->work_ready);
+    pthread_mutex_unlock(&p->lock);
+
+    for (size_t i = 0; i < p->workers; i++) {
+        pthread_join(p->threads[i], NULL);
+    }
+
+    for (size_t i = 0; i < p->workers; i++)
+    {
+        free(p->deques[i].tasks);
+        pthread_mutex_destroy(&p->deques[i].lock);
+    }
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work_ready);
+    pthread_cond_destroy(&p->all_done);
+    free(p->threads);
+    free(p->deques);
+    free(p->args);
+    free(p);
+}
+
+size_t pool_default_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (size_t)n : 1;
+}
+
+static void* worker_main(void *arg)
+{
+    Worker *w = arg;
+    Pool *p = w->pool;
+    size_t self = w->index;
+    Task task;
+
+    current_pool = p;
+    current_worker = self;
+
+    for (;;)
+    {
+        if (take_task(p, self, &task))
+        {
+            pthread_mutex_lock(&p->lock);
+            p->queued--;
+            pthread_mutex_unlock(&p->lock);
+
+            double start = thread_cpu_ms();
+            task.fn(task.arg);
+            double spent = thread_cpu_ms() - start;
+
+            pthread_mutex_lock(&p->lock);
+            p->cpu_ms += spent;
+            if (--p->pending == 0) pthread_cond_broadcast(&p->all_done);
+            pthread_mutex_unlock(&p->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        while (!p->queued && !p->shutdown) pthread_cond_wait(&p->work_ready, &p->lock);
+        int done = p->shutdown && !p->queued;
+        pthread_mutex_unlock(&p->lock);
+
+        if (done) break;
+    }
+
+    return NULL;
+}
+
+static int take_task(Pool *p, size_t self, Task *task)
+{
+    if (deque_pop(&p->deques[self], task)) return 1;
+
+    for (size_t i = 1; i < p->workers; i++)
+    {
+        if (deque_steal(&p->deques[(self + i) % p->workers], task)) return 1;
+    }
+
+    return 0;
+}
+
+static int deque_push(Deque *d, Task task)
+{
+    pthread_mutex_lock(&d->lock);
+
+    if (d->tail - d->head == d->capacity)
+    {
+        size_t capacity = d->capacity ? d->capacity * 2 : 64;
+        Task *tasks = malloc(capacity * sizeof(Task));
+        if (!tasks)
+        {
+            pthread_mutex_unlock(&d->lock);
+            return 1;
+        }
+
+        for (size_t i = d->head; i < d->tail; i++) {
+            tasks[i - d->head] = d->tasks[i % d->capacity];
+        }
+
+        free(d->tasks);
+        d->tasks = tasks;
+        d->tail -= d->head;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+
+    d->tasks[d->tail++ % d->capacity] = task;
+
+    pthread_mutex_unlock(&d->lock);
+
+    return 0;
+}
+
+static int deque_pop(Deque *d, Task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head)
+    {
+        *task = d->tasks[--d->tail % d->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static int deque_steal(Deque *d, Task *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->tail != d->head)
+    {
+        *task = d->tasks[d->head++ % d->capacity];
+        found = 1;
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    return found;
+}
+
+static double thread_cpu_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
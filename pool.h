@@ -0,0 +1,19 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include<stddef.h>
+
+typedef void (*pool_task_fn)(void *arg);
+
+typedef struct Pool Pool;
+
+Pool* pool_init(size_t workers);
+int pool_submit(Pool *p, pool_task_fn fn, void *arg);
+void pool_wait(Pool *p);
+double pool_cpu_ms(Pool *p);
+size_t pool_workers(Pool *p);
+size_t pool_worker_index(void);
+void pool_free(Pool *p);
+size_t pool_default_workers(void);
+
+#endif
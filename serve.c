@@ -0,0 +1,622 @@
+#include<stdio.h>
+#include<stdlib.h>
+#include<string.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<signal.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<poll.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/un.h>
+#include "./serve.h"
+#include "./parser.h"
+#include "./code.h"
+#include "./arena.h"
+#include "./pool.h"
+#include "./diag.h"
+#include "./io.h"
+
+// The server listens on a Unix domain socket. The main thread polls the
+// listener and the idle connections and hands a connection to the worker
+// pool once a job arrives on it, so a worker is only held while a job runs
+// and a client that stays silent costs nothing but its descriptor. A
+// client sends jobs one after another on a connection and gets one reply
+// per job, in order:
+//
+//   asm FORMAT LEN\n<LEN bytes of source>
+//   file FORMAT INLEN OUTLEN\n<INLEN bytes of input path><OUTLEN bytes of output path>
+//
+// FORMAT is hack, bin, ihex or c. A file job reads and writes the files
+// itself, the output goes next to the input when OUTLEN is 0. The reply
+// is one of
+//
+//   ok LEN\n<LEN bytes of output>          LEN is 0 for a file job
+//   error COUNT\n<COUNT lines of LINE: message>
+//
+// Every worker keeps its arena, source and output buffers from job to job
+// and connection to connection, so once they have grown a job allocates
+// nothing but what the arena already holds.
+
+#define SERVE_ARENA_BLOCK (256 * 1024)
+#define SERVE_BACKLOG 64
+#define SERVE_HEADER_SIZE 256
+#define SERVE_MAX_DIAGNOSTICS 16
+// jobs bigger than this are refused.
+#define SERVE_MAX_SOURCE (256 * 1024 * 1024)
+// a job whose bytes stop coming for this long is dropped with its
+// connection, so it does not hold a worker.
+#define SERVE_READ_TIMEOUT 10
+
+typedef struct {
+    Arena *arena;
+    char *source;
+    size_t source_capacity;
+    char *output;
+    size_t output_capacity;
+}WorkerState;
+
+typedef struct Server Server;
+
+// Connection is a client's socket with the bytes read past the last job,
+// the start of the next one.
+typedef struct {
+    Server *server;
+    int fd;
+    char buffer[SERVE_HEADER_SIZE];
+    size_t start;
+    size_t end;
+}Connection;
+
+struct Server {
+    CodeOptions options;
+    WorkerState *states;
+    Pool *pool;
+    // the connections being served, shut down when the server stops.
+    int *open;
+    size_t open_count;
+    size_t open_capacity;
+    // idle connections are polled by the main thread alone; the workers
+    // hand theirs back through done and a byte on the wake pipe.
+    Connection **idle;
+    size_t idle_count;
+    size_t idle_capacity;
+    Connection **done;
+    size_t done_count;
+    size_t done_capacity;
+    int wake[2];
+    pthread_mutex_t lock;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void on_signal(int signum);
+static int poll_connections(Server *server, int listener);
+static void serve_job(void *arg);
+static int read_header(Connection *conn, char *header);
+static int read_exact(Connection *conn, char *out, size_t size);
+static int run_job(Server *server, WorkerState *state, Connection *conn, const char *header);
+static int assemble_source(Server *server, WorkerState *state, output_format format, size_t len, Diagnostics *diag, size_t *size);
+static int assemble_path(Server *server, WorkerState *state, output_format format, const char *input, const char *output, Diagnostics *diag);
+static int reply_error(int fd, Diagnostics *diag);
+static int parse_format(const char *name, output_format *format);
+static int reserve(char **buffer, size_t *capacity, size_t size);
+static int track(Server *server, int fd);
+static void untrack(Server *server, int fd);
+static void close_connection(Connection *conn);
+
+// serve answers jobs on socket_path until SIGINT or SIGTERM, options are
+// the defaults of every job. A stale socket left at the path is replaced.
+int serve(const char *socket_path, size_t workers, const CodeOptions *options)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Err socket path too long: %s\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    struct stat st;
+    if (stat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path);
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) || listen(listener, SERVE_BACKLOG))
+    {
+        perror("Err listening on socket");
+        if (listener >= 0) close(listener);
+        return 1;
+    }
+
+    Server server;
+    memset(&server, 0, sizeof(Server));
+    server.options = *options;
+    server.states = calloc(workers, sizeof(WorkerState));
+    server.wake[0] = server.wake[1] = -1;
+    pthread_mutex_init(&server.lock, NULL);
+
+    // the wake pipe never blocks a worker: when it is full the main thread
+    // is about to look at done anyway.
+    int errnum = !server.states || pipe(server.wake) || fcntl(server.wake[0], F_SETFL, O_NONBLOCK)
+        || fcntl(server.wake[1], F_SETFL, O_NONBLOCK);
+    for (size_t i = 0; i < workers && !errnum; i++) {
+        errnum = !(server.states[i].arena = arena_init(SERVE_ARENA_BLOCK));
+    }
+
+    // the workers start with the signals blocked so they reach this thread
+    // and interrupt poll().
+    sigset_t signals, previous;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+    server.pool = errnum ? NULL : pool_init(workers);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (!server.pool)
+    {
+        fprintf(stderr, "Err can not start the worker pool\n");
+        errnum = 1;
+    }
+    else
+    {
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        fprintf(stderr, "serving on %s with %zu workers\n", socket_path, workers);
+        errnum = poll_connections(&server, listener);
+    }
+
+    close(listener);
+    unlink(socket_path);
+
+    // connections waiting for their next job are cut, a job being
+    // assembled still gets its reply.
+    pthread_mutex_lock(&server.lock);
+    for (size_t i = 0; i < server.open_count; i++) {
+        shutdown(server.open[i], SHUT_RD);
+    }
+    pthread_mutex_unlock(&server.lock);
+
+    if (server.pool)
+    {
+        pool_wait(server.pool);
+        pool_free(server.pool);
+    }
+
+    for (size_t i = 0; i < server.idle_count; i++) {
+        close_connection(server.idle[i]);
+    }
+    for (size_t i = 0; i < server.done_count; i++) {
+        close_connection(server.done[i]);
+    }
+
+    for (size_t i = 0; server.states && i < workers; i++)
+    {
+        arena_free(server.states[i].arena);
+        free(server.states[i].source);
+        free(server.states[i].output);
+    }
+    free(server.states);
+    free(server.open);
+    free(server.idle);
+    free(server.done);
+    if (server.wake[0] >= 0) close(server.wake[0]);
+    if (server.wake[1] >= 0) close(server.wake[1]);
+    pthread_mutex_destroy(&server.lock);
+
+    return errnum;
+}
+
+// poll_connections accepts clients and submits a job for every idle
+// connection that has one waiting, until the server is stopped. It
+// returns nonzero when it had to give up.
+static int poll_connections(Server *server, int listener)
+{
+    struct pollfd *fds = NULL;
+    size_t fds_capacity = 0;
+    int errnum = 0;
+
+    while (!stopping && !errnum)
+    {
+        if (reserve((char**)&fds, &fds_capacity, (server->idle_count + 2) * sizeof(struct pollfd)))
+        {
+            fprintf(stderr, "Err out of memory\n");
+            errnum = 1;
+            break;
+        }
+
+        size_t count = server->idle_count;
+        fds[0] = (struct pollfd){ listener, POLLIN, 0 };
+        fds[1] = (struct pollfd){ server->wake[0], POLLIN, 0 };
+        for (size_t i = 0; i < count; i++) {
+            fds[i + 2] = (struct pollfd){ server->idle[i]->fd, POLLIN, 0 };
+        }
+
+        if (poll(fds, count + 2, -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            perror("Err polling connections");
+            errnum = 1;
+            break;
+        }
+
+        // backwards, so the connection moved into a freed place was already
+        // looked at.
+        for (size_t i = count; i-- > 0;)
+        {
+            if (!fds[i + 2].revents) continue;
+
+            Connection *conn = server->idle[i];
+            server->idle[i] = server->idle[--server->idle_count];
+            if (pool_submit(server->pool, serve_job, conn)) close_connection(conn);
+        }
+
+        if (fds[1].revents)
+        {
+            char drain[64];
+            while (read(server->wake[0], drain, sizeof(drain)) > 0);
+
+            pthread_mutex_lock(&server->lock);
+            int failed = reserve((char**)&server->idle, &server->idle_capacity,
+                (server->idle_count + server->done_count) * sizeof(Connection*));
+            for (size_t i = 0; i < server->done_count; i++)
+            {
+                if (failed) {
+                    close_connection(server->done[i]);
+                } else {
+                    server->idle[server->idle_count++] = server->done[i];
+                }
+            }
+            server->done_count = 0;
+            pthread_mutex_unlock(&server->lock);
+        }
+
+        if (fds[0].revents)
+        {
+            int fd = accept(listener, NULL, NULL);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                perror("Err accepting connection");
+                errnum = 1;
+                break;
+            }
+
+            struct timeval timeout = { SERVE_READ_TIMEOUT, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            Connection *conn = calloc(1, sizeof(Connection));
+            if (!conn || reserve((char**)&server->idle, &server->idle_capacity, (server->idle_count + 1) * sizeof(Connection*))
+                || track(server, fd))
+            {
+                free(conn);
+                close(fd);
+                continue;
+            }
+
+            conn->server = server;
+            conn->fd = fd;
+            server->idle[server->idle_count++] = conn;
+        }
+    }
+
+    free(fds);
+
+    return errnum;
+}
+
+static void on_signal(int signum)
+{
+    (void)signum;
+    stopping = 1;
+}
+
+// serve_job runs the job waiting on a connection, and the ones read along
+// with it since poll() would not report them, then hands the connection
+// back to the main thread.
+static void serve_job(void *arg)
+{
+    Connection *conn = arg;
+    Server *server = conn->server;
+    WorkerState *state = &server->states[pool_worker_index()];
+    char header[SERVE_HEADER_SIZE + 1];
+
+    do
+    {
+        if (stopping || read_header(conn, header) || run_job(server, state, conn, header))
+        {
+            close_connection(conn);
+            return;
+        }
+    }
+    while (conn->start < conn->end);
+
+    pthread_mutex_lock(&server->lock);
+    int failed = reserve((char**)&server->done, &server->done_capacity, (server->done_count + 1) * sizeof(Connection*));
+    if (!failed) server->done[server->done_count++] = conn;
+    pthread_mutex_unlock(&server->lock);
+
+    if (failed)
+    {
+        close_connection(conn);
+        return;
+    }
+
+    // a full pipe already wakes the main thread.
+    ssize_t woken = write(server->wake[1], "", 1);
+    (void)woken;
+}
+
+// read_header reads the line that starts the next job into header. It
+// fails when the client hangs up, stalls or sends a line too long for a
+// header.
+static int read_header(Connection *conn, char *header)
+{
+    for (;;)
+    {
+        char *start = conn->buffer + conn->start;
+        char *nl = memchr(start, '\n', conn->end - conn->start);
+        if (nl)
+        {
+            size_t len = nl - start + 1;
+            memcpy(header, start, len);
+            header[len] = '\0';
+            conn->start += len;
+            return 0;
+        }
+
+        if (conn->end - conn->start == sizeof(conn->buffer)) return 1;
+
+        memmove(conn->buffer, start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+
+        ssize_t got = read(conn->fd, conn->buffer + conn->end, sizeof(conn->buffer) - conn->end);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        conn->end += got;
+    }
+}
+
+// read_exact reads size bytes of a job, the ones already buffered first.
+static int read_exact(Connection *conn, char *out, size_t size)
+{
+    size_t buffered = conn->end - conn->start;
+    if (buffered > size) buffered = size;
+
+    memcpy(out, conn->buffer + conn->start, buffered);
+    conn->start += buffered;
+    out += buffered;
+    size -= buffered;
+
+    while (size)
+    {
+        ssize_t got = read(conn->fd, out, size);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return 1;
+        out += got;
+        size -= got;
+    }
+
+    return 0;
+}
+
+// run_job reads the rest of the job that header starts and replies to it.
+// It returns nonzero when the connection can not go on.
+static int run_job(Server *server, WorkerState *state, Connection *conn, const char *header)
+{
+    int fd = conn->fd;
+    Diagnostic items[SERVE_MAX_DIAGNOSTICS];
+    Diagnostics diag = { items, SERVE_MAX_DIAGNOSTICS, 0, 0 };
+    char kind[8], format_name[8];
+    size_t len = 0, out_len = 0;
+    output_format format;
+
+    int fields = sscanf(header, "%7s %7s %zu %zu", kind, format_name, &len, &out_len);
+    int is_asm = fields == 3 && !strcmp(kind, "asm");
+    int is_file = fields == 4 && !strcmp(kind, "file");
+
+    // each length is bounded before they are added, so the sum can not wrap.
+    if ((!is_asm && !is_file) || parse_format(format_name, &format) || len > SERVE_MAX_SOURCE
+        || out_len > SERVE_MAX_SOURCE - len || reserve(&state->source, &state->source_capacity, len + out_len + 2))
+    {
+        diag_report(&diag, 0, "bad job: %.*s", (int)strcspn(header, "\n"), header);
+        reply_error(fd, &diag);
+        return 1;
+    }
+
+    if (read_exact(conn, state->source, len + out_len)) return 1;
+
+    if (is_asm)
+    {
+        size_t size = 0;
+        if (assemble_source(server, state, format, len, &diag, &size)) {
+            return reply_error(fd, &diag);
+        }
+
+        char line[64];
+        int n = snprintf(line, sizeof(line), "ok %zu\n", size);
+        return write_all(fd, line, n) || write_all(fd, state->output, size);
+    }
+
+    // the two paths side by side, each NUL terminated.
+    char *input = state->source;
+    char *output = state->source + len + 1;
+    memmove(output, state->source + len, out_len);
+    output[out_len] = '\0';
+    input[len] = '\0';
+
+    if (assemble_path(server, state, format, input, out_len ? output : NULL, &diag)) {
+        return reply_error(fd, &diag);
+    }
+
+    return write_all(fd, "ok 0\n", 5);
+}
+
+// assemble_source assembles the len bytes of state->source into
+// state->output, growing it and assembling again when it was too small.
+static int assemble_source(Server *server, WorkerState *state, output_format format, size_t len, Diagnostics *diag, size_t *size)
+{
+    CodeOptions options = server->options;
+    options.format = format;
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        arena_reset(state->arena);
+
+        Parser *parser = init_parser_buffer(state->source, len, state->arena);
+        Code *c = parser ? init_code(parser, "input", state->arena) : NULL;
+        if (!c)
+        {
+            diag_report(diag, 0, "Err out of memory");
+            return 1;
+        }
+
+        code_set_options(c, &options);
+        code_set_diagnostics(c, diag);
+        code_set_output_buffer(c, state->output, state->output_capacity);
+
+        int errnum = assemble(c);
+        *size = code_output_size(c);
+        free_code(c);
+
+        if (errnum != CODE_NO_SPACE) return errnum;
+
+        if (reserve(&state->output, &state->output_capacity, *size))
+        {
+            diag_report(diag, 0, "Err out of memory");
+            return 1;
+        }
+    }
+
+    return 1;
+}
+
+static int assemble_path(Server *server, WorkerState *state, output_format format, const char *input, const char *output, Diagnostics *diag)
+{
+    CodeOptions options = server->options;
+    options.format = format;
+
+    arena_reset(state->arena);
+
+    Parser *parser = init_parser(input, state->arena, diag);
+    if (!parser)
+    {
+        if (!diag->count) diag_report(diag, 0, "can not open file:%s", input);
+        return 1;
+    }
+
+    Code *c = init_code(parser, input, state->arena);
+    if (!c)
+    {
+        free_parser(parser);
+        diag_report(diag, 0, "Err out of memory");
+        return 1;
+    }
+
+    code_set_options(c, &options);
+    code_set_diagnostics(c, diag);
+    code_set_output_name(c, output);
+
+    int errnum = assemble(c);
+    free_code(c);
+
+    if (errnum && !diag->count) {
+        diag_report(diag, 0, "can not assemble %s", input);
+    }
+
+    return errnum;
+}
+
+static int reply_error(int fd, Diagnostics *diag)
+{
+    char text[SERVE_MAX_DIAGNOSTICS * (DIAG_MESSAGE_SIZE + 24) + 32];
+    size_t used = snprintf(text, sizeof(text), "error %zu\n", diag->count);
+
+    for (size_t i = 0; i < diag->count; i++) {
+        used += snprintf(text + used, sizeof(text) - used, "%zu: %s\n", diag->items[i].line, diag->items[i].message);
+    }
+
+    return write_all(fd, text, used);
+}
+
+static int parse_format(const char *name, output_format *format)
+{
+    static const char *names[] = { "hack", "bin", "ihex", "c" };
+
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+    {
+        if (!strcmp(name, names[i]))
+        {
+            *format = (output_format)i;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int reserve(char **buffer, size_t *capacity, size_t size)
+{
+    if (size <= *capacity) return 0;
+
+    size_t grown = *capacity ? *capacity : 4096;
+    while (grown < size) grown *= 2;
+
+    char *resized = realloc(*buffer, grown);
+    if (!resized) return 1;
+
+    *buffer = resized;
+    *capacity = grown;
+
+    return 0;
+}
+
+static int track(Server *server, int fd)
+{
+    pthread_mutex_lock(&server->lock);
+
+    int errnum = reserve((char**)&server->open, &server->open_capacity, (server->open_count + 1) * sizeof(int));
+    if (!errnum) {
+        server->open[server->open_count++] = fd;
+    }
+
+    pthread_mutex_unlock(&server->lock);
+
+    return errnum;
+}
+
+// close_connection closes a connection no one else holds.
+static void close_connection(Connection *conn)
+{
+    untrack(conn->server, conn->fd);
+    close(conn->fd);
+    free(conn);
+}
+
+static void untrack(Server *server, int fd)
+{
+    pthread_mutex_lock(&server->lock);
+
+    for (size_t i = 0; i < server->open_count; i++)
+    {
+        if (server->open[i] == fd)
+        {
+            server->open[i] = server->open[--server->open_count];
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&server->lock);
+}
+
@@ -0,0 +1,9 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include<stddef.h>
+#include "./code.h"
+
+int serve(const char *socket_path, size_t workers, const CodeOptions *options);
+
+#endif
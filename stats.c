@@ -0,0 +1,145 @@
+#include<stdio.h>
+#include<string.h>
+#include<time.h>
+#include<sys/resource.h>
+#include "./parser.h"
+#include "./stats.h"
+
+static const char *phase_names[PHASE_COUNT] = { "scan", "generate", "output" };
+
+static double clock_ms(clockid_t clock);
+static void print_table(FILE *out, const char *name, const TableStats *t);
+static void json_table(FILE *out, const char *name, const TableStats *t);
+static void json_string(FILE *out, const char *s);
+
+void stats_init(Stats *s)
+{
+    memset(s, 0, sizeof(Stats));
+    s->phase = PHASE_NONE;
+}
+
+// stats_phase_begin ends the running phase, adding its wall and CPU time
+// to the totals, and starts phase. PHASE_NONE only ends the running one.
+// The CPU time is the calling thread's, so files assembled side by side in
+// batch mode do not count each other's. A NULL s does nothing, so callers
+// need no check of their own.
+void stats_phase_begin(Stats *s, stats_phase phase)
+{
+    if (!s) return;
+
+    double wall = clock_ms(CLOCK_MONOTONIC);
+    double cpu = clock_ms(CLOCK_THREAD_CPUTIME_ID);
+
+    if (s->phase != PHASE_NONE)
+    {
+        s->wall_ms[s->phase] += wall - s->phase_wall;
+        s->cpu_ms[s->phase] += cpu - s->phase_cpu;
+    }
+
+    s->phase = phase;
+    s->phase_wall = wall;
+    s->phase_cpu = cpu;
+}
+
+// stats_add_cpu counts ms of CPU time that other threads spent for the
+// running phase, such as the scan and encode helpers.
+void stats_add_cpu(Stats *s, double ms)
+{
+    if (!s || s->phase == PHASE_NONE) return;
+
+    s->cpu_ms[s->phase] += ms;
+}
+
+void stats_print(FILE *out, const char *name, const Stats *s)
+{
+    fprintf(out, "%s:\n", name);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(out, "  %-9s %10.3f ms wall %10.3f ms cpu\n", phase_names[i], s->wall_ms[i], s->cpu_ms[i]);
+    }
+
+    fprintf(out, "  lines read %zu, instructions emitted %zu, removed %zu\n", s->lines_read, s->instructions,
+        s->instructions_removed);
+    fprintf(out, "  %s %zu, %s %zu, %s %zu\n",
+        instruction_type_names[A_INSTRUCTION], s->types[A_INSTRUCTION],
+        instruction_type_names[C_INSTRUCTION], s->types[C_INSTRUCTION],
+        instruction_type_names[L_INSTRUCTION], s->types[L_INSTRUCTION]);
+
+    print_table(out, "symbol table", &s->symbol_table);
+    print_table(out, "ir symbols", &s->ir_symbols);
+
+    fprintf(out, "  allocated %zu bytes, peak rss %ld KB\n", s->bytes_allocated, s->peak_rss_kb);
+}
+
+// stats_json writes s as one JSON object, without a trailing newline so
+// the caller can put several in an array.
+void stats_json(FILE *out, const char *name, const Stats *s)
+{
+    fprintf(out, "{\"file\": ");
+    json_string(out, name);
+
+    fprintf(out, ", \"phases\": {");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", i ? ", " : "",
+            phase_names[i], s->wall_ms[i], s->cpu_ms[i]);
+    }
+    fprintf(out, "}");
+
+    fprintf(out, ", \"lines_read\": %zu, \"instructions\": %zu, \"instructions_removed\": %zu",
+        s->lines_read, s->instructions, s->instructions_removed);
+    fprintf(out, ", \"types\": {\"%s\": %zu, \"%s\": %zu, \"%s\": %zu}",
+        instruction_type_names[A_INSTRUCTION], s->types[A_INSTRUCTION],
+        instruction_type_names[C_INSTRUCTION], s->types[C_INSTRUCTION],
+        instruction_type_names[L_INSTRUCTION], s->types[L_INSTRUCTION]);
+
+    json_table(out, "symbol_table", &s->symbol_table);
+    json_table(out, "ir_symbols", &s->ir_symbols);
+
+    fprintf(out, ", \"bytes_allocated\": %zu, \"peak_rss_kb\": %ld}", s->bytes_allocated, s->peak_rss_kb);
+}
+
+// stats_peak_rss_kb is the peak resident set of the whole process so far.
+long stats_peak_rss_kb(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage)) return 0;
+
+    return usage.ru_maxrss;
+}
+
+static double clock_ms(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void print_table(FILE *out, const char *name, const TableStats *t)
+{
+    fprintf(out, "  %s: %zu of %zu slots used (%.1f%%), %zu tombstones, longest probe %zu, average probe %.2f\n",
+        name, t->used, t->capacity, t->capacity ? 100.0 * t->used / t->capacity : 0.0,
+        t->tombstones, t->longest_probe, t->average_probe);
+}
+
+static void json_table(FILE *out, const char *name, const TableStats *t)
+{
+    fprintf(out, ", \"%s\": {\"capacity\": %zu, \"used\": %zu, \"tombstones\": %zu, \"longest_probe\": %zu, \"average_probe\": %.3f}",
+        name, t->capacity, t->used, t->tombstones, t->longest_probe, t->average_probe);
+}
+
+static void json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s; s++)
+    {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
@@ -0,0 +1,53 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include<stdio.h>
+#include<stddef.h>
+
+// phases of an assembly run, only one is running at a time.
+typedef enum{
+    PHASE_SCAN,         // reading and encoding the source
+    PHASE_GENERATE,     // resolving symbols and formatting the output
+    PHASE_OUTPUT,       // opening and writing the output file
+    PHASE_COUNT,
+    PHASE_NONE = PHASE_COUNT
+}stats_phase;
+
+// TableStats describes the health of an open addressing table. A probe is
+// one group of control bytes for the symbol table and one slot for the IR
+// symbols, a key found where its hash points took 1 probe.
+typedef struct {
+    size_t capacity;
+    size_t used;
+    size_t tombstones;
+    size_t longest_probe;
+    double average_probe;
+}TableStats;
+
+// Stats is what --stats reports for one file. The assembler only touches
+// it through a pointer that is NULL when --stats is off.
+typedef struct {
+    double wall_ms[PHASE_COUNT];
+    double cpu_ms[PHASE_COUNT];
+    stats_phase phase;
+    double phase_wall;
+    double phase_cpu;
+
+    size_t lines_read;
+    size_t instructions;
+    size_t instructions_removed;    // by -O
+    size_t types[4];        // indexed by instruction_type
+    TableStats symbol_table;
+    TableStats ir_symbols;
+    size_t bytes_allocated;
+    long peak_rss_kb;
+}Stats;
+
+void stats_init(Stats *s);
+void stats_phase_begin(Stats *s, stats_phase phase);
+void stats_add_cpu(Stats *s, double ms);
+void stats_print(FILE *out, const char *name, const Stats *s);
+void stats_json(FILE *out, const char *name, const Stats *s);
+long stats_peak_rss_kb(void);
+
+#endif
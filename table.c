@@ -1,150 +1,421 @@
-#include<stdio.h>
+#include<stdint.h>
 #include<stdlib.h>
 #include<string.h>
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+#include "./table.h"
+
+// The symbol table is an open addressing hash table. Next to the slots it
+// keeps one control byte per slot: EMPTY, DELETED or, for a used slot, the
+// low 7 bits of the key's hash. A lookup loads a whole group of 16 control
+// bytes, compares them with the 7 hash bits at once and only looks at the
+// slots that match, where the stored hash and length are checked before the
+// key itself is compared.
+//
+// When the table gets too full a bigger one is allocated and the entries
+// are moved over a few groups per insert, so no single set pays for the
+// whole rehash. Until the move is done lookups check both tables.
+//
+// A table made with an arena takes its slots and keys from it and frees
+// nothing, the arena is reset once the run is over.
+
+#define GROUP_SIZE 16
+#define MIN_CAPACITY 64
+#define MIGRATE_GROUPS 2
+
+#define CTRL_EMPTY ((int8_t)0x80)
+#define CTRL_DELETED ((int8_t)0xFE)
 
-#define MAX_TABLE_SIZE 256
-#define MAX_KEY_SIZE 50
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
-
-static unsigned int hash_index(const char *key);
-
-typedef struct Symbol
-{   const char* key;
+typedef struct
+{
+    const char* key;
+    uint32_t hash;
+    uint32_t len;
     uint16_t val;
-    struct Symbol *next;
 }Symbol;
 
 typedef struct
 {
-   Symbol* hash_table[MAX_TABLE_SIZE];
-}SymbolTable;
-
-SymbolTable* symbol_table_init(void)
-{       
-    SymbolTable *st = (SymbolTable*) malloc(sizeof(SymbolTable));
+    int8_t *ctrl;
+    Symbol *slots;
+    size_t capacity;    // a power of two, never less than GROUP_SIZE
+    size_t used;        // slots holding a symbol
+    size_t deleted;     // tombstones, they count against the load
+}Slots;
+
+struct SymbolTable
+{
+    Slots current;
+    Slots old;          // entries not yet moved to current, empty when not resizing
+    size_t migrated;    // groups of old already moved
+    Arena *arena;       // NULL when the table lives on the heap
+};
+
+static int slots_init(Slots *s, size_t capacity, Arena *arena);
+static void slots_free(Slots *s, int free_keys, Arena *arena);
+static Symbol* slots_find(Slots *s, const char *key, size_t len, uint32_t hash);
+static void slots_insert(Slots *s, Symbol symbol);
+static void slots_remove(Slots *s, Symbol *symbol);
+static unsigned int group_match(const int8_t *ctrl, int8_t byte);
+static int grow(SymbolTable *t);
+static void migrate(SymbolTable *t, size_t groups);
+static void slots_stats(Slots *s, TableStats *stats, size_t *total_probes);
+
+SymbolTable* symbol_table_init(Arena *arena)
+{
+    SymbolTable *st = arena ? arena_alloc(arena, sizeof(SymbolTable)) : malloc(sizeof(SymbolTable));
+    if (!st) return NULL;
 
-    for(int i =0; i < MAX_TABLE_SIZE; i++){
-        st->hash_table[i] = NULL;
+    memset(st, 0, sizeof(SymbolTable));
+    st->arena = arena;
+    if (slots_init(&st->current, MIN_CAPACITY, arena))
+    {
+        if (!arena) free(st);
+        return NULL;
     }
 
     return st;
 }
 
 int symbol_table_get(SymbolTable *t, const char *key, uint16_t *targetVal)
+{
+    return symbol_table_getn(t, key, strlen(key), targetVal);
+}
+
+int symbol_table_getn(SymbolTable *t, const char *key, size_t len, uint16_t *targetVal)
 {
     if (!t) return 0;
 
-    unsigned int index = hash_index(key);
+    uint32_t hash = table_hash(key, len);
 
-    Symbol* head = t->hash_table[index];
-    while (head && strncmp(head->key, key, MAX_KEY_SIZE))
-    {
-        head = head->next;
+    Symbol *s = slots_find(&t->current, key, len, hash);
+    if (!s && t->old.capacity) {
+        s = slots_find(&t->old, key, len, hash);
     }
 
-    if (head){
-        *targetVal = head-> val;
+    if (s){
+        *targetVal = s->val;
         return 1;
     }
-    
+
     return 0;
-}   
+}
 
-void symbol_table_set(SymbolTable *t, const char *key, uint16_t val)
-{   
-    if (!t) return;
+int symbol_table_set(SymbolTable *t, const char *key, uint16_t val)
+{
+    return symbol_table_setn(t, key, strlen(key), val);
+}
+
+// symbol_table_setn returns nonzero when the table could not grow to take
+// a new key.
+int symbol_table_setn(SymbolTable *t, const char *key, size_t len, uint16_t val)
+{
+    if (!t) return 1;
 
-    unsigned int index = hash_index(key);
-    Symbol *head = t->hash_table[index];
+    uint32_t hash = table_hash(key, len);
 
-    while (head && strncmp(head->key, key, MAX_KEY_SIZE))
-    {   
-        head = head->next;
+    Symbol *s = slots_find(&t->current, key, len, hash);
+    if (!s && t->old.capacity) {
+        s = slots_find(&t->old, key, len, hash);
     }
 
-    if (head) {
-        head->val = val;
-        return;
+    if (s) {
+        s->val = val;
+        return 0;
+    }
+
+    if (t->old.capacity) {
+        migrate(t, MIGRATE_GROUPS);
     }
 
-    Symbol* s = (Symbol*) malloc(sizeof(Symbol));
-    s->key = strdup(key);
-    s->val = val;
-    s->next = t->hash_table[index];
-    t->hash_table[index] = s;
+    // keep the load, tombstones included, under 7/8.
+    Slots *cur = &t->current;
+    if ((cur->used + cur->deleted + 1) * 8 > cur->capacity * 7 && grow(t)) {
+        return 1;
+    }
+
+    char *copy = t->arena ? arena_strndup(t->arena, key, len) : strndup(key, len);
+    if (!copy) {
+        return 1;
+    }
+
+    Symbol symbol = { copy, hash, (uint32_t)len, val };
+    slots_insert(&t->current, symbol);
+
+    return 0;
 }
 
 int symbol_table_delete(SymbolTable *t,const char *key, uint16_t* val)
+{
+    return symbol_table_deleten(t, key, strlen(key), val);
+}
+
+int symbol_table_deleten(SymbolTable *t, const char *key, size_t len, uint16_t* val)
 {
     if (!t) return 0;
 
-    unsigned int index = hash_index(key);
+    uint32_t hash = table_hash(key, len);
 
-    Symbol* head = t->hash_table[index];
-    Symbol *prev;
-    while (head && strncmp(head->key, key, MAX_KEY_SIZE))
-    {   
-       prev = head;
-       head = head->next;
+    Slots *owner = &t->current;
+    Symbol *s = slots_find(owner, key, len, hash);
+    if (!s && t->old.capacity)
+    {
+        owner = &t->old;
+        s = slots_find(owner, key, len, hash);
     }
 
-    uint16_t value;
-    int exist = 0;
+    if (s == NULL) return 0;
 
-    if (head == NULL) return exist;
-    
-    if (prev == NULL) {
-        value = head->val;
-        t->hash_table[index] = head->next;
-        exist = 1;
-    }else {
-        value = head->val;
-        prev->next = head->next;
-        exist = 1;
+    if (val) {
+        *val = s->val;
     }
 
-    if (val) {
-        *val = value;
+    if (!t->arena) {
+        free((void*)s->key);
     }
+    slots_remove(owner, s);
 
+    return 1;
+}
 
-    return exist;
+void symbol_table_free(SymbolTable* t, int free_keys) {
+    // a table in an arena goes away with the arena.
+    if (!t || t->arena) return;
+
+    slots_free(&t->current, free_keys, NULL);
+    slots_free(&t->old, free_keys, NULL);
+
+    free(t);
 }
 
+// symbol_table_stats reports both tables together while a resize is
+// moving entries.
+void symbol_table_stats(SymbolTable *t, TableStats *stats)
+{
+    size_t total_probes = 0;
 
-static unsigned int hash_index(const char *key)
-{   
-    if (!key) return 0;
+    memset(stats, 0, sizeof(TableStats));
+    if (!t) return;
+
+    slots_stats(&t->current, stats, &total_probes);
+    slots_stats(&t->old, stats, &total_probes);
 
-    size_t key_len = strlen(key);
-    size_t len =  MIN(key_len, MAX_KEY_SIZE);
+    stats->average_probe = stats->used ? (double)total_probes / stats->used : 0;
+}
 
-    unsigned int index = 0;
-    for (size_t i= 0; i < len; i++)
+static int slots_init(Slots *s, size_t capacity, Arena *arena)
+{
+    if (arena) {
+        s->ctrl = arena_alloc(arena, capacity);
+        s->slots = arena_alloc(arena, capacity * sizeof(Symbol));
+    } else {
+        s->ctrl = malloc(capacity);
+        s->slots = malloc(capacity * sizeof(Symbol));
+    }
+
+    if (!s->ctrl || !s->slots)
     {
-        index += ((unsigned int) key[i]) * i;
+        if (!arena) {
+            free(s->ctrl);
+            free(s->slots);
+        }
+        memset(s, 0, sizeof(Slots));
+        return 1;
     }
 
-    return index;
+    memset(s->ctrl, CTRL_EMPTY, capacity);
+    s->capacity = capacity;
+    s->used = 0;
+    s->deleted = 0;
+
+    return 0;
 }
 
-void symbol_table_free(SymbolTable* t, int free_keys) {
-    if (!t) return;
+static void slots_free(Slots *s, int free_keys, Arena *arena)
+{
+    if (arena)
+    {
+        memset(s, 0, sizeof(Slots));
+        return;
+    }
 
-    for (int i = 0; i < MAX_TABLE_SIZE; i++) {
-        Symbol* current = t->hash_table[i];
-        while (current) {
-            Symbol* next = current->next;
+    if (free_keys)
+    {
+        for (size_t i = 0; i < s->capacity; i++) {
+            if (s->ctrl[i] >= 0) free((void*)s->slots[i].key);
+        }
+    }
+
+    free(s->ctrl);
+    free(s->slots);
+    memset(s, 0, sizeof(Slots));
+}
 
-            if (free_keys) {
-                free((void*)current->key);
+// slots_find walks the groups in triangular order starting at the one the
+// hash picks; a group with an empty slot ends the search.
+static Symbol* slots_find(Slots *s, const char *key, size_t len, uint32_t hash)
+{
+    size_t mask = s->capacity / GROUP_SIZE - 1;
+    size_t group = (hash >> 7) & mask;
+    int8_t tag = hash & 0x7F;
+
+    for (size_t step = 1; step <= mask + 1; step++)
+    {
+        const int8_t *ctrl = s->ctrl + group * GROUP_SIZE;
+
+        unsigned int match = group_match(ctrl, tag);
+        while (match)
+        {
+            size_t i = group * GROUP_SIZE + __builtin_ctz(match);
+            Symbol *candidate = &s->slots[i];
+            if (candidate->hash == hash && candidate->len == len && !memcmp(candidate->key, key, len)) {
+                return candidate;
             }
-            free(current);
+            match &= match - 1;
+        }
+
+        if (group_match(ctrl, CTRL_EMPTY)) return NULL;
+
+        group = (group + step) & mask;
+    }
+
+    return NULL;
+}
+
+// slots_insert puts a symbol known not to be there yet in the first empty
+// or deleted slot along its probe sequence, the caller made sure there is one.
+static void slots_insert(Slots *s, Symbol symbol)
+{
+    size_t mask = s->capacity / GROUP_SIZE - 1;
+    size_t group = (symbol.hash >> 7) & mask;
 
-            current = next;
+    for (size_t step = 1; ; step++)
+    {
+        int8_t *ctrl = s->ctrl + group * GROUP_SIZE;
+
+        unsigned int free_slots = group_match(ctrl, CTRL_EMPTY) | group_match(ctrl, CTRL_DELETED);
+        if (free_slots)
+        {
+            size_t i = __builtin_ctz(free_slots);
+            if (ctrl[i] == CTRL_DELETED) {
+                s->deleted--;
+            }
+            ctrl[i] = symbol.hash & 0x7F;
+            s->slots[group * GROUP_SIZE + i] = symbol;
+            s->used++;
+            return;
         }
-        t->hash_table[i] = NULL;
+
+        group = (group + step) & mask;
     }
+}
 
-    free(t);
+// slots_remove leaves a tombstone so probe sequences running through the
+// slot still reach the entries behind it, unless its group still has an
+// empty slot, in which case no probe ever went past it.
+static void slots_remove(Slots *s, Symbol *symbol)
+{
+    size_t i = symbol - s->slots;
+    const int8_t *group = s->ctrl + (i & ~(size_t)(GROUP_SIZE - 1));
+
+    if (group_match(group, CTRL_EMPTY)) {
+        s->ctrl[i] = CTRL_EMPTY;
+    } else {
+        s->ctrl[i] = CTRL_DELETED;
+        s->deleted++;
+    }
+    s->used--;
+}
+
+// group_match returns a bit mask of the control bytes in the group equal to byte.
+static unsigned int group_match(const int8_t *ctrl, int8_t byte)
+{
+#ifdef __SSE2__
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(byte)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < GROUP_SIZE; i++) {
+        mask |= (unsigned int)(ctrl[i] == byte) << i;
+    }
+
+    return mask;
+#endif
+}
+
+// grow starts moving the entries into a table twice the size, or the same
+// size when it is mostly tombstones. A move still going on is finished first.
+static int grow(SymbolTable *t)
+{
+    if (t->old.capacity) {
+        migrate(t, t->old.capacity / GROUP_SIZE);
+    }
+
+    size_t capacity = t->current.capacity;
+    if (t->current.used * 2 >= capacity) {
+        capacity *= 2;
+    }
+
+    Slots next;
+    if (slots_init(&next, capacity, t->arena)) return 1;
+
+    t->old = t->current;
+    t->current = next;
+    t->migrated = 0;
+
+    // a little work now so an insert never has to wait for a full rehash.
+    migrate(t, MIGRATE_GROUPS);
+
+    return 0;
+}
+
+// migrate moves up to groups groups of the old table over to the current one.
+static void migrate(SymbolTable *t, size_t groups)
+{
+    size_t total = t->old.capacity / GROUP_SIZE;
+
+    while (groups-- && t->migrated < total)
+    {
+        size_t base = t->migrated++ * GROUP_SIZE;
+        for (size_t i = base; i < base + GROUP_SIZE; i++)
+        {
+            // a moved slot becomes a tombstone so lookups still probe past
+            // it but never find the stale copy.
+            if (t->old.ctrl[i] >= 0)
+            {
+                slots_insert(&t->current, t->old.slots[i]);
+                t->old.ctrl[i] = CTRL_DELETED;
+            }
+        }
+    }
+
+    if (t->migrated == total) {
+        slots_free(&t->old, 0, t->arena);
+    }
+}
+
+// slots_stats counts the groups a lookup of every stored key goes through.
+static void slots_stats(Slots *s, TableStats *stats, size_t *total_probes)
+{
+    size_t mask = s->capacity / GROUP_SIZE - 1;
+
+    stats->capacity += s->capacity;
+    stats->used += s->used;
+    stats->tombstones += s->deleted;
+
+    for (size_t i = 0; i < s->capacity; i++)
+    {
+        if (s->ctrl[i] < 0) continue;
+
+        size_t group = (s->slots[i].hash >> 7) & mask;
+        size_t probes = 1;
+        while (group != i / GROUP_SIZE) {
+            group = (group + probes++) & mask;
+        }
+
+        *total_probes += probes;
+        if (probes > stats->longest_probe) stats->longest_probe = probes;
+    }
 }
@@ -1,13 +1,52 @@
 #ifndef TABLE_H
 #define TABLE_H
 
+#include<stddef.h>
+#include<stdint.h>
+#include<string.h>
+#include "./arena.h"
+#include "./stats.h"
+
+// table_hash mixes the key eight bytes at a time, every key byte ends up
+// affecting all the bits. The symbol table puts the low 7 in its control
+// bytes, the IR indexes its interned names with it too.
+static inline uint32_t table_hash(const char *key, size_t key_len)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    uint64_t h = k ^ key_len;
+    uint64_t w;
+
+    while (key_len >= 8)
+    {
+        memcpy(&w, key, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+        key += 8;
+        key_len -= 8;
+    }
+
+    w = 0;
+    memcpy(&w, key, key_len);
+    h = (h ^ w) * k;
+
+    h ^= h >> 32;
+    h *= 0xD6E8FEB86659FD93ull;
+    h ^= h >> 32;
+
+    return (uint32_t)h;
+}
+
 typedef struct SymbolTable SymbolTable;
 
-SymbolTable* symbol_table_init(void);
+SymbolTable* symbol_table_init(Arena *arena);
 int symbol_table_get(SymbolTable *t, const char *key, uint16_t *targetVal);
-void symbol_table_set(SymbolTable *t, const char *key, uint16_t val);
+int symbol_table_set(SymbolTable *t, const char *key, uint16_t val);
 int symbol_table_delete(SymbolTable *t,const char *key, uint16_t* val);
+int symbol_table_getn(SymbolTable *t, const char *key, size_t len, uint16_t *targetVal);
+int symbol_table_setn(SymbolTable *t, const char *key, size_t len, uint16_t val);
+int symbol_table_deleten(SymbolTable *t, const char *key, size_t len, uint16_t* val);
 void symbol_table_free(SymbolTable* t, int free_keys);
+void symbol_table_stats(SymbolTable *t, TableStats *stats);
 
 #endif
 
@@ -0,0 +1,749 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include "./parser.h"
+#include "./hackasm.h"
+#include "./cpu.h"
+#include "./tst.h"
+
+// tst_run interprets the test scripts of the book's CPU emulator: load,
+// output-file, compare-to, output-list, set, repeat, while, ticktock,
+// output and echo. Every output line is compared with the same line of
+// the compare-to file as soon as it is written.
+
+#define MAX_COLUMNS 64
+#define MAX_PATH 4096
+
+typedef struct {
+    char name[32];
+    char format;        // D, X, B or S
+    int pad_left;
+    int len;
+    int pad_right;
+}Column;
+
+typedef struct {
+    Cpu *cpu;
+    const char *filename;
+    char dir[MAX_PATH];
+    char *text;
+    Slice *tokens;
+    size_t count;
+    FILE *output;
+    char *compare;
+    char **compare_lines;
+    size_t compare_count;
+    size_t output_lines;
+    Column columns[MAX_COLUMNS];
+    size_t column_count;
+}Script;
+
+static int tokenize(Script *s);
+static int exec_range(Script *s, size_t start, size_t end);
+static int exec_statement(Script *s, size_t *pos, size_t end);
+static int exec_command(Script *s, Slice *args, size_t count);
+static int find_block(Script *s, size_t pos, size_t end, size_t *close);
+static int is_token(Slice t, const char *text);
+static int resolve(Script *s, Slice name, char *path);
+static int read_compare(Script *s, const char *path);
+static int parse_column(Slice spec, Column *column);
+static int parse_value(Slice t, int32_t *value);
+static int variable(Script *s, Slice name, uint16_t **reg, uint64_t *time);
+static int get_variable(Script *s, Slice name, int32_t *value);
+static int set_variable(Script *s, Slice name, int32_t value);
+static int condition(Script *s, Slice *cond, int *result);
+static int output_line(Script *s, const char *line);
+static void format_value(const Column *column, int32_t value, char *out);
+static void free_script(Script *s);
+
+// load_program loads a .hack file, or assembles a .asm file in memory
+// and loads the result.
+int load_program(Cpu *cpu, const char *filename)
+{
+    size_t len = strlen(filename);
+    if (len < 4 || strcmp(filename + len - 4, ".asm")) {
+        return cpu_load_file(cpu, filename);
+    }
+
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", filename);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    char *src = malloc(size > 0 ? size : 1);
+    uint8_t *bytes = malloc(ROM_SIZE * 2);
+    int errnum = !src || !bytes || fread(src, 1, size, file) != (size_t)size;
+    fclose(file);
+    if (errnum)
+    {
+        free(src);
+        free(bytes);
+        fprintf(stderr, "can not read file:%s\n", filename);
+        return 1;
+    }
+
+    Diagnostic items[8];
+    Diagnostics diag = { items, 8, 0, 0 };
+    HackOptions options = { HACKASM_BIN, 0, 0, 0, filename };
+    HackBuffer out = { (char*)bytes, ROM_SIZE * 2, 0 };
+
+    int result = hack_assemble(src, size, &options, &out, &diag);
+    for (size_t i = 0; i < diag.count; i++) {
+        fprintf(stderr, "%s\n", items[i].message);
+    }
+
+    if (result == HACKASM_NO_SPACE) {
+        fprintf(stderr, "Err %s: program does not fit the ROM\n", filename);
+    }
+
+    if (result == HACKASM_OK)
+    {
+        // the bin format is big endian, two bytes a word.
+        uint16_t *words = (uint16_t*)bytes;
+        size_t count = out.size / 2;
+        for (size_t i = 0; i < count; i++) {
+            words[i] = bytes[2 * i] << 8 | bytes[2 * i + 1];
+        }
+        cpu_load(cpu, words, count);
+    }
+
+    free(src);
+    free(bytes);
+
+    return result != HACKASM_OK;
+}
+
+int tst_run(const char *filename)
+{
+    Script s;
+    memset(&s, 0, sizeof(Script));
+    s.filename = filename;
+
+    const char *slash = strrchr(filename, '/');
+    size_t dir_len = slash ? (size_t)(slash - filename + 1) : 0;
+    if (dir_len >= MAX_PATH)
+    {
+        fprintf(stderr, "Err path too long: %s\n", filename);
+        return 1;
+    }
+    memcpy(s.dir, filename, dir_len);
+    s.dir[dir_len] = '\0';
+
+    FILE *file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", filename);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    s.text = malloc(size + 1);
+    s.cpu = cpu_init();
+    if (!s.text || !s.cpu || fread(s.text, 1, size, file) != (size_t)size)
+    {
+        fclose(file);
+        free_script(&s);
+        return 1;
+    }
+    s.text[size] = '\0';
+    fclose(file);
+
+    int errnum = tokenize(&s);
+    if (!errnum) {
+        errnum = exec_range(&s, 0, s.count);
+    }
+
+    if (!errnum && s.compare) {
+        printf("End of script - Comparison ended successfully\n");
+    } else if (!errnum) {
+        printf("End of script\n");
+    }
+
+    free_script(&s);
+
+    return errnum;
+}
+
+// tokenize splits the script into words, strings and the , ; { }
+// punctuation, dropping // and /* */ comments.
+static int tokenize(Script *s)
+{
+    size_t capacity = 256;
+    s->tokens = malloc(capacity * sizeof(Slice));
+    if (!s->tokens) return 1;
+
+    const char *p = s->text;
+    while (*p)
+    {
+        if (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+            p++;
+            continue;
+        }
+
+        if (p[0] == '/' && p[1] == '/')
+        {
+            while (*p && *p != '\n') p++;
+            continue;
+        }
+
+        if (p[0] == '/' && p[1] == '*')
+        {
+            const char *end = strstr(p + 2, "*/");
+            p = end ? end + 2 : p + strlen(p);
+            continue;
+        }
+
+        Slice t = { p, 1 };
+        if (*p == '"')
+        {
+            const char *end = strchr(p + 1, '"');
+            t.len = end ? (size_t)(end - p + 1) : strlen(p);
+        }
+        else if (!strchr(",;{}", *p))
+        {
+            while (p[t.len] && !strchr(" \t\r\n,;{}", p[t.len])) t.len++;
+        }
+        p += t.len;
+
+        if (s->count == capacity)
+        {
+            capacity *= 2;
+            Slice *grown = realloc(s->tokens, capacity * sizeof(Slice));
+            if (!grown) return 1;
+            s->tokens = grown;
+        }
+        s->tokens[s->count++] = t;
+    }
+
+    return 0;
+}
+
+static int exec_range(Script *s, size_t start, size_t end)
+{
+    size_t pos = start;
+    while (pos < end)
+    {
+        if (exec_statement(s, &pos, end)) return 1;
+    }
+
+    return 0;
+}
+
+static int exec_statement(Script *s, size_t *pos, size_t end)
+{
+    Slice *t = &s->tokens[*pos];
+
+    if (is_token(*t, ",") || is_token(*t, ";"))
+    {
+        (*pos)++;
+        return 0;
+    }
+
+    if (is_token(*t, "repeat"))
+    {
+        int32_t n;
+        size_t close;
+        if (*pos + 2 >= end || parse_value(t[1], &n) || !is_token(t[2], "{"))
+        {
+            fprintf(stderr, "Err %s: repeat needs a count and a block\n", s->filename);
+            return 1;
+        }
+        if (find_block(s, *pos + 2, end, &close)) return 1;
+
+        size_t body = *pos + 3;
+        *pos = close + 1;
+
+        // the usual repeat n { ticktock; } runs without going through the script.
+        if (close - body <= 2 && is_token(s->tokens[body], "ticktock")
+            && (close - body == 1 || is_token(s->tokens[body + 1], ";") || is_token(s->tokens[body + 1], ",")))
+        {
+            cpu_run(s->cpu, n > 0 ? n : 0);
+            return 0;
+        }
+
+        for (int32_t i = 0; i < n; i++)
+        {
+            if (exec_range(s, body, close)) return 1;
+        }
+        return 0;
+    }
+
+    if (is_token(*t, "while"))
+    {
+        size_t close;
+        if (*pos + 4 >= end || !is_token(t[4], "{"))
+        {
+            fprintf(stderr, "Err %s: while needs a condition and a block\n", s->filename);
+            return 1;
+        }
+        if (find_block(s, *pos + 4, end, &close)) return 1;
+
+        size_t body = *pos + 5;
+        *pos = close + 1;
+
+        for (;;)
+        {
+            int result;
+            if (condition(s, t + 1, &result)) return 1;
+            if (!result) return 0;
+            if (exec_range(s, body, close)) return 1;
+        }
+    }
+
+    size_t start = *pos;
+    while (*pos < end && !is_token(s->tokens[*pos], ",") && !is_token(s->tokens[*pos], ";")) (*pos)++;
+
+    return exec_command(s, &s->tokens[start], *pos - start);
+}
+
+static int exec_command(Script *s, Slice *args, size_t count)
+{
+    char path[MAX_PATH];
+    Slice cmd = args[0];
+
+    if (is_token(cmd, "ticktock") || is_token(cmd, "tock"))
+    {
+        cpu_run(s->cpu, 1);
+        return 0;
+    }
+
+    if (is_token(cmd, "tick") || is_token(cmd, "clear-echo") || is_token(cmd, "breakpoint")
+        || is_token(cmd, "clear-breakpoints")) {
+        return 0;
+    }
+
+    if (is_token(cmd, "output"))
+    {
+        char line[MAX_COLUMNS * 64 + 2];
+        char *out = line;
+        *out++ = '|';
+        for (size_t i = 0; i < s->column_count; i++)
+        {
+            int32_t value;
+            Slice name = { s->columns[i].name, strlen(s->columns[i].name) };
+            if (get_variable(s, name, &value)) return 1;
+
+            format_value(&s->columns[i], value, out);
+            out += strlen(out);
+            *out++ = '|';
+        }
+        *out = '\0';
+
+        return output_line(s, line);
+    }
+
+    if (is_token(cmd, "echo"))
+    {
+        for (size_t i = 1; i < count; i++)
+        {
+            Slice t = args[i];
+            if (t.len >= 2 && t.ptr[0] == '"') {
+                t.ptr++;
+                t.len -= 2;
+            }
+            printf("%s%.*s", i > 1 ? " " : "", (int)t.len, t.ptr);
+        }
+        printf("\n");
+        return 0;
+    }
+
+    if (is_token(cmd, "load"))
+    {
+        if (count < 2) return 0;
+        if (resolve(s, args[1], path)) return 1;
+
+        return load_program(s->cpu, path);
+    }
+
+    if (is_token(cmd, "output-file"))
+    {
+        if (count < 2 || resolve(s, args[1], path)) return 1;
+
+        if (s->output) fclose(s->output);
+        s->output = fopen(path, "w");
+        if (!s->output)
+        {
+            fprintf(stderr, "can not open file:%s\n", path);
+            return 1;
+        }
+        return 0;
+    }
+
+    if (is_token(cmd, "compare-to"))
+    {
+        if (count < 2 || resolve(s, args[1], path)) return 1;
+
+        return read_compare(s, path);
+    }
+
+    if (is_token(cmd, "output-list"))
+    {
+        char line[MAX_COLUMNS * 64 + 2];
+        char *out = line;
+
+        if (count - 1 > MAX_COLUMNS)
+        {
+            fprintf(stderr, "Err %s: output-list takes at most %d columns\n", s->filename, MAX_COLUMNS);
+            return 1;
+        }
+
+        s->column_count = 0;
+        *out++ = '|';
+        for (size_t i = 1; i < count; i++)
+        {
+            Column *column = &s->columns[s->column_count++];
+            if (parse_column(args[i], column))
+            {
+                fprintf(stderr, "Err %s: bad output-list entry: %.*s\n", s->filename, (int)args[i].len, args[i].ptr);
+                return 1;
+            }
+
+            // the header centers each name in its column, cut to fit.
+            int width = column->pad_left + column->len + column->pad_right;
+            int name_len = strlen(column->name);
+            if (name_len > width) name_len = width;
+            int left = (width - name_len) / 2;
+            sprintf(out, "%*s%.*s%*s|", left, "", name_len, column->name, width - name_len - left, "");
+            out += strlen(out);
+        }
+        *out = '\0';
+
+        return output_line(s, line);
+    }
+
+    if (is_token(cmd, "set"))
+    {
+        int32_t value;
+        if (count < 3 || parse_value(args[2], &value))
+        {
+            fprintf(stderr, "Err %s: set needs a variable and a value\n", s->filename);
+            return 1;
+        }
+
+        return set_variable(s, args[1], value);
+    }
+
+    fprintf(stderr, "Err %s: unknown command: %.*s\n", s->filename, (int)cmd.len, cmd.ptr);
+
+    return 1;
+}
+
+// find_block finds the } closing the { at pos.
+static int find_block(Script *s, size_t pos, size_t end, size_t *close)
+{
+    int depth = 0;
+    for (size_t i = pos; i < end; i++)
+    {
+        if (is_token(s->tokens[i], "{")) depth++;
+        if (is_token(s->tokens[i], "}") && --depth == 0)
+        {
+            *close = i;
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "Err %s: missing }\n", s->filename);
+
+    return 1;
+}
+
+static int is_token(Slice t, const char *text)
+{
+    return strlen(text) == t.len && !memcmp(t.ptr, text, t.len);
+}
+
+// resolve makes name relative to the directory of the script.
+static int resolve(Script *s, Slice name, char *path)
+{
+    if (strlen(s->dir) + name.len + 1 > MAX_PATH)
+    {
+        fprintf(stderr, "Err path too long: %.*s\n", (int)name.len, name.ptr);
+        return 1;
+    }
+
+    size_t dir_len = name.ptr[0] == '/' ? 0 : strlen(s->dir);
+    memcpy(path, s->dir, dir_len);
+    memcpy(path + dir_len, name.ptr, name.len);
+    path[dir_len + name.len] = '\0';
+
+    return 0;
+}
+
+static int read_compare(Script *s, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        fprintf(stderr, "can not open file:%s\n", path);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    free(s->compare);
+    free(s->compare_lines);
+    s->compare_lines = NULL;
+    s->compare_count = 0;
+
+    s->compare = malloc(size + 1);
+    if (!s->compare || fread(s->compare, 1, size, file) != (size_t)size)
+    {
+        fclose(file);
+        return 1;
+    }
+    s->compare[size] = '\0';
+    fclose(file);
+
+    size_t lines = 1;
+    for (char *p = s->compare; *p; p++) lines += *p == '\n';
+
+    s->compare_lines = malloc(lines * sizeof(char*));
+    if (!s->compare_lines) return 1;
+
+    char *line = s->compare;
+    while (*line)
+    {
+        char *next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        s->compare_lines[s->compare_count++] = line;
+        if (!next) break;
+        line = next;
+    }
+
+    return 0;
+}
+
+// parse_column reads name%Fl.w.r, a name alone is printed as %D1.6.1.
+static int parse_column(Slice spec, Column *column)
+{
+    size_t name_len = 0;
+    while (name_len < spec.len && spec.ptr[name_len] != '%') name_len++;
+    if (name_len == 0 || name_len >= sizeof(column->name)) return 1;
+
+    memcpy(column->name, spec.ptr, name_len);
+    column->name[name_len] = '\0';
+    column->format = 'D';
+    column->pad_left = 1;
+    column->len = 6;
+    column->pad_right = 1;
+
+    if (name_len == spec.len) return 0;
+
+    char format[32];
+    size_t len = spec.len - name_len - 1;
+    if (len == 0 || len >= sizeof(format)) return 1;
+    memcpy(format, spec.ptr + name_len + 1, len);
+    format[len] = '\0';
+
+    column->format = format[0];
+    if (!strchr("DXBS", column->format)) return 1;
+    if (sscanf(format + 1, "%d.%d.%d", &column->pad_left, &column->len, &column->pad_right) != 3) return 1;
+
+    return column->pad_left < 0 || column->len < 1 || column->len > 40 || column->pad_right < 0
+        || column->pad_left > 10 || column->pad_right > 10;
+}
+
+// parse_value reads a decimal, or a %X hex, %B binary or %D decimal value.
+static int parse_value(Slice t, int32_t *value)
+{
+    char text[32];
+    int base = 10;
+
+    if (t.len >= 2 && t.ptr[0] == '%')
+    {
+        if (t.ptr[1] == 'X') base = 16;
+        else if (t.ptr[1] == 'B') base = 2;
+        else if (t.ptr[1] != 'D') return 1;
+        t.ptr += 2;
+        t.len -= 2;
+    }
+
+    if (t.len == 0 || t.len >= sizeof(text)) return 1;
+    memcpy(text, t.ptr, t.len);
+    text[t.len] = '\0';
+
+    char *end;
+    long v = strtol(text, &end, base);
+    if (*end) return 1;
+
+    *value = (int32_t)v;
+
+    return 0;
+}
+
+// variable finds the register or memory word name stands for, time is
+// the only read only one and comes back through *time.
+static int variable(Script *s, Slice name, uint16_t **reg, uint64_t *time)
+{
+    Cpu *cpu = s->cpu;
+    *reg = NULL;
+
+    if (is_token(name, "A")) *reg = &cpu->a;
+    else if (is_token(name, "D")) *reg = &cpu->d;
+    else if (is_token(name, "PC")) *reg = &cpu->pc;
+    else if (is_token(name, "time")) *time = cpu->cycles;
+    else if (name.len > 5 && (!memcmp(name.ptr, "RAM[", 4) || !memcmp(name.ptr, "ROM[", 4)) && name.ptr[name.len - 1] == ']')
+    {
+        char text[16];
+        if (name.len - 5 >= sizeof(text)) return 1;
+        memcpy(text, name.ptr + 4, name.len - 5);
+        text[name.len - 5] = '\0';
+
+        char *end;
+        long address = strtol(text, &end, 10);
+        if (*end || address < 0 || address >= (name.ptr[1] == 'A' ? RAM_SIZE : ROM_SIZE)) return 1;
+
+        *reg = name.ptr[1] == 'A' ? &cpu->ram[address] : &cpu->rom[address];
+    }
+    else return 1;
+
+    return 0;
+}
+
+static int get_variable(Script *s, Slice name, int32_t *value)
+{
+    uint16_t *reg;
+    uint64_t time = 0;
+
+    if (variable(s, name, &reg, &time))
+    {
+        fprintf(stderr, "Err %s: unknown variable: %.*s\n", s->filename, (int)name.len, name.ptr);
+        return 1;
+    }
+
+    *value = reg ? (int16_t)*reg : (int32_t)time;
+
+    return 0;
+}
+
+static int set_variable(Script *s, Slice name, int32_t value)
+{
+    uint16_t *reg;
+    uint64_t time;
+
+    if (variable(s, name, &reg, &time) || !reg)
+    {
+        fprintf(stderr, "Err %s: can not set: %.*s\n", s->filename, (int)name.len, name.ptr);
+        return 1;
+    }
+
+    *reg = (uint16_t)value;
+
+    // the decoded copy has to follow a changed ROM word.
+    Cpu *cpu = s->cpu;
+    if (reg >= cpu->rom && reg < cpu->rom + ROM_SIZE)
+    {
+        size_t count = reg - cpu->rom + 1;
+        uint16_t a = cpu->a, d = cpu->d, pc = cpu->pc;
+        uint64_t cycles = cpu->cycles;
+
+        cpu_load(cpu, cpu->rom, count > cpu->rom_size ? count : cpu->rom_size);
+        cpu->a = a;
+        cpu->d = d;
+        cpu->pc = pc;
+        cpu->cycles = cycles;
+    }
+
+    return 0;
+}
+
+// condition evaluates "variable op value", op being = <> < > <= or >=.
+static int condition(Script *s, Slice *cond, int *result)
+{
+    int32_t left, right;
+    if (get_variable(s, cond[0], &left) || parse_value(cond[2], &right))
+    {
+        fprintf(stderr, "Err %s: bad while condition\n", s->filename);
+        return 1;
+    }
+
+    Slice op = cond[1];
+    if (is_token(op, "=")) *result = left == right;
+    else if (is_token(op, "<>")) *result = left != right;
+    else if (is_token(op, "<")) *result = left < right;
+    else if (is_token(op, ">")) *result = left > right;
+    else if (is_token(op, "<=")) *result = left <= right;
+    else if (is_token(op, ">=")) *result = left >= right;
+    else
+    {
+        fprintf(stderr, "Err %s: bad while condition\n", s->filename);
+        return 1;
+    }
+
+    return 0;
+}
+
+// output_line writes line to the output file and checks it against the
+// compare file, trailing blanks aside.
+static int output_line(Script *s, const char *line)
+{
+    if (s->output) fprintf(s->output, "%s\n", line);
+
+    size_t index = s->output_lines++;
+    if (!s->compare) return 0;
+
+    if (index < s->compare_count)
+    {
+        const char *expected = s->compare_lines[index];
+        size_t a = strlen(line), b = strlen(expected);
+        while (a && (line[a - 1] == ' ' || line[a - 1] == '\r')) a--;
+        while (b && (expected[b - 1] == ' ' || expected[b - 1] == '\r')) b--;
+
+        if (a == b && !memcmp(line, expected, a)) return 0;
+    }
+
+    fprintf(stderr, "Comparison failure at line %zu\n", index + 1);
+    fprintf(stderr, "  expected: %s\n", index < s->compare_count ? s->compare_lines[index] : "(end of file)");
+    fprintf(stderr, "  got:      %s\n", line);
+
+    return 1;
+}
+
+static void format_value(const Column *column, int32_t value, char *out)
+{
+    char digits[48];
+    uint16_t word = (uint16_t)value;
+
+    switch (column->format)
+    {
+    case 'X':
+        snprintf(digits, sizeof(digits), "%04X", word);
+        break;
+    case 'B':
+        for (int i = 0; i < 16; i++) {
+            digits[i] = (word >> (15 - i)) & 1 ? '1' : '0';
+        }
+        digits[16] = '\0';
+        break;
+    default:
+        snprintf(digits, sizeof(digits), "%d", (int)value);
+    }
+
+    // numbers are right aligned, a value wider than its column keeps its
+    // low digits.
+    int len = strlen(digits);
+    const char *shown = len > column->len ? digits + len - column->len : digits;
+    sprintf(out, "%*s%*s%*s", column->pad_left, "", column->len, shown, column->pad_right, "");
+}
+
+static void free_script(Script *s)
+{
+    if (s->output) fclose(s->output);
+    free(s->compare);
+    free(s->compare_lines);
+    free(s->tokens);
+    free(s->text);
+    cpu_free(s->cpu);
+}
@@ -0,0 +1,9 @@
+#ifndef TST_H
+#define TST_H
+
+#include "./cpu.h"
+
+int load_program(Cpu *cpu, const char *filename);
+int tst_run(const char *filename);
+
+#endif
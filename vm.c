@@ -0,0 +1,483 @@
+#include<stdio.h>
+#include<stdint.h>
+#include<stdlib.h>
+#include<string.h>
+#include<stdarg.h>
+#include "./vm.h"
+
+// vm translates programs of the nand2tetris VM language straight into the
+// assembler's IR through the code_emit_ functions, so no .asm text is
+// written or parsed again. The code is that of the book's translator with
+// the calling convention in two shared routines: a call sets R13 to the
+// argument count, R14 to the callee and D to the return address and jumps
+// to $call, a return jumps to $return. Both are emitted once, after the
+// last file, when anything uses them.
+
+#define VM_LINE_SIZE 512
+#define VM_SYMBOL_SIZE 256
+#define VM_MAX_TOKENS 3
+
+#define TEMP_BASE 5
+
+typedef struct {
+    Code *code;
+    FILE *dump;
+    Diagnostics *diag;
+    const char *file;
+    // class is the file name without directory and extension, the prefix
+    // of its static variables.
+    char class[VM_SYMBOL_SIZE];
+    char function[VM_SYMBOL_SIZE];
+    uint32_t line;
+    size_t labels;
+    int uses_call;
+    int uses_return;
+}Vm;
+
+// the segments whose base address is held in a register.
+static const struct { const char *name; const char *base; } pointerSegments[] = {
+    { "local", "LCL" }, { "argument", "ARG" }, { "this", "THIS" }, { "that", "THAT" },
+};
+
+static const struct { const char *name; const char *op; } binaryOps[] = {
+    { "add", "M=D+M" }, { "sub", "M=M-D" }, { "and", "M=D&M" }, { "or", "M=D|M" },
+};
+
+static const struct { const char *name; const char *op; } unaryOps[] = {
+    { "neg", "M=-M" }, { "not", "M=!M" },
+};
+
+static const struct { const char *name; const char *jump; } compareOps[] = {
+    { "eq", "D;JEQ" }, { "gt", "D;JGT" }, { "lt", "D;JLT" },
+};
+
+static int translate_file(Vm *vm, const char *path);
+static int translate_line(Vm *vm, char **tokens, int count);
+static int push(Vm *vm, const char *segment, const char *index);
+static int pop(Vm *vm, const char *segment, const char *index);
+static int call(Vm *vm, const char *function, const char *args);
+static int function(Vm *vm, const char *name, const char *locals);
+static int emit_routines(Vm *vm);
+static int emit(Vm *vm, const char *text);
+static int emitf(Vm *vm, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static int emit_ref(Vm *vm, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static int parse_index(Vm *vm, const char *text, size_t *index);
+static int tokenize(char *line, char **tokens);
+
+// vm_translate emits the VM files in order into c, with the bootstrap
+// first when asked for. dump, when not NULL, gets the same program as
+// .asm text.
+int vm_translate(Code *c, const char *const *files, size_t count, int bootstrap, FILE *dump, Diagnostics *diag)
+{
+    Vm vm;
+    memset(&vm, 0, sizeof(Vm));
+    vm.code = c;
+    vm.dump = dump;
+    vm.diag = diag;
+    vm.file = "bootstrap";
+
+    // SP=256, call Sys.init 0.
+    if (bootstrap && (emit(&vm, "@256") || emit(&vm, "D=A") || emit(&vm, "@SP") || emit(&vm, "M=D")
+        || call(&vm, "Sys.init", "0"))) {
+        return VM_ERROR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (translate_file(&vm, files[i])) return VM_ERROR;
+    }
+
+    return emit_routines(&vm);
+}
+
+static int translate_file(Vm *vm, const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        diag_report(vm->diag, 0, "can not open file:%s", path);
+        return VM_ERROR;
+    }
+
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    size_t len = strcspn(base, ".");
+    snprintf(vm->class, sizeof(vm->class), "%.*s", (int)len, base);
+    snprintf(vm->function, sizeof(vm->function), "%s", vm->class);
+    vm->file = path;
+    vm->line = 0;
+
+    char line[VM_LINE_SIZE];
+    char *tokens[VM_MAX_TOKENS];
+    int errnum = 0;
+
+    while (!errnum && fgets(line, sizeof(line), file))
+    {
+        vm->line++;
+
+        int count = tokenize(line, tokens);
+        if (count < 0)
+        {
+            diag_report(vm->diag, vm->line, "%s:%u: too many words", path, vm->line);
+            errnum = VM_ERROR;
+        }
+        else if (count)
+        {
+            errnum = translate_line(vm, tokens, count);
+        }
+    }
+
+    fclose(file);
+
+    return errnum;
+}
+
+static int translate_line(Vm *vm, char **tokens, int count)
+{
+    const char *command = tokens[0];
+    int arity = count - 1;
+
+    if (arity == 0)
+    {
+        for (size_t i = 0; i < sizeof(binaryOps) / sizeof(binaryOps[0]); i++)
+        {
+            if (!strcmp(command, binaryOps[i].name)) {
+                return emit(vm, "@SP") || emit(vm, "AM=M-1") || emit(vm, "D=M") || emit(vm, "A=A-1") || emit(vm, binaryOps[i].op);
+            }
+        }
+
+        for (size_t i = 0; i < sizeof(unaryOps) / sizeof(unaryOps[0]); i++)
+        {
+            if (!strcmp(command, unaryOps[i].name)) {
+                return emit(vm, "@SP") || emit(vm, "A=M-1") || emit(vm, unaryOps[i].op);
+            }
+        }
+
+        // x-y is left in D and the result stored as true, then set back to
+        // false when the jump is not taken.
+        for (size_t i = 0; i < sizeof(compareOps) / sizeof(compareOps[0]); i++)
+        {
+            if (!strcmp(command, compareOps[i].name))
+            {
+                size_t label = vm->labels++;
+                return emit(vm, "@SP") || emit(vm, "AM=M-1") || emit(vm, "D=M") || emit(vm, "A=A-1")
+                    || emit(vm, "D=M-D") || emit(vm, "M=-1") || emit_ref(vm, "$cmp.%zu", label)
+                    || emit(vm, compareOps[i].jump) || emit(vm, "@SP") || emit(vm, "A=M-1") || emit(vm, "M=0")
+                    || emitf(vm, "($cmp.%zu)", label);
+            }
+        }
+
+        if (!strcmp(command, "return"))
+        {
+            vm->uses_return = 1;
+            return emit_ref(vm, "$return") || emit(vm, "0;JMP");
+        }
+    }
+    else if (arity == 1)
+    {
+        const char *label = tokens[1];
+
+        if (!strcmp(command, "label")) {
+            return emitf(vm, "(%s$%s)", vm->function, label);
+        }
+
+        if (!strcmp(command, "goto")) {
+            return emit_ref(vm, "%s$%s", vm->function, label) || emit(vm, "0;JMP");
+        }
+
+        if (!strcmp(command, "if-goto")) {
+            return emit(vm, "@SP") || emit(vm, "AM=M-1") || emit(vm, "D=M") || emit_ref(vm, "%s$%s", vm->function, label)
+                || emit(vm, "D;JNE");
+        }
+    }
+    else
+    {
+        if (!strcmp(command, "push")) return push(vm, tokens[1], tokens[2]);
+        if (!strcmp(command, "pop")) return pop(vm, tokens[1], tokens[2]);
+        if (!strcmp(command, "call")) return call(vm, tokens[1], tokens[2]);
+        if (!strcmp(command, "function")) return function(vm, tokens[1], tokens[2]);
+    }
+
+    diag_report(vm->diag, vm->line, "%s:%u: unknown command: %s with %d arguments", vm->file, vm->line, command, arity);
+
+    return VM_ERROR;
+}
+
+// push leaves the value in D and stores it on the stack.
+static int push(Vm *vm, const char *segment, const char *index)
+{
+    size_t i;
+    int errnum = parse_index(vm, index, &i);
+
+    if (errnum) {
+        return errnum;
+    } else if (!strcmp(segment, "constant")) {
+        errnum = emitf(vm, "@%zu", i) || emit(vm, "D=A");
+    } else if (!strcmp(segment, "static")) {
+        errnum = emitf(vm, "@%s.%zu", vm->class, i) || emit(vm, "D=M");
+    } else if (!strcmp(segment, "temp") && i < 8) {
+        errnum = emitf(vm, "@R%zu", TEMP_BASE + i) || emit(vm, "D=M");
+    } else if (!strcmp(segment, "pointer") && i < 2) {
+        errnum = emit(vm, i ? "@THAT" : "@THIS") || emit(vm, "D=M");
+    } else {
+        size_t s = 0;
+        while (s < sizeof(pointerSegments) / sizeof(pointerSegments[0]) && strcmp(segment, pointerSegments[s].name)) s++;
+
+        if (s == sizeof(pointerSegments) / sizeof(pointerSegments[0]))
+        {
+            diag_report(vm->diag, vm->line, "%s:%u: can not push %s %s", vm->file, vm->line, segment, index);
+            return VM_ERROR;
+        }
+
+        if (i < 2) {
+            errnum = emitf(vm, "@%s", pointerSegments[s].base) || emit(vm, i ? "A=M+1" : "A=M");
+        } else {
+            errnum = emitf(vm, "@%zu", i) || emit(vm, "D=A") || emitf(vm, "@%s", pointerSegments[s].base) || emit(vm, "A=D+M");
+        }
+        errnum = errnum || emit(vm, "D=M");
+    }
+
+    return errnum || emit(vm, "@SP") || emit(vm, "AM=M+1") || emit(vm, "A=A-1") || emit(vm, "M=D");
+}
+
+// pop stores the top of the stack at an address known up front, or for
+// the pointer segments at base+i: stepped to with A=A+1 for small i,
+// otherwise computed into R13 first.
+static int pop(Vm *vm, const char *segment, const char *index)
+{
+    size_t i;
+    int errnum = parse_index(vm, index, &i);
+    if (errnum) return errnum;
+
+    const char *pop_d = "@SP\nAM=M-1\nD=M";
+
+    if (!strcmp(segment, "static")) {
+        return emit(vm, pop_d) || emitf(vm, "@%s.%zu", vm->class, i) || emit(vm, "M=D");
+    } else if (!strcmp(segment, "temp") && i < 8) {
+        return emit(vm, pop_d) || emitf(vm, "@R%zu", TEMP_BASE + i) || emit(vm, "M=D");
+    } else if (!strcmp(segment, "pointer") && i < 2) {
+        return emit(vm, pop_d) || emit(vm, i ? "@THAT" : "@THIS") || emit(vm, "M=D");
+    }
+
+    size_t s = 0;
+    while (s < sizeof(pointerSegments) / sizeof(pointerSegments[0]) && strcmp(segment, pointerSegments[s].name)) s++;
+
+    if (s == sizeof(pointerSegments) / sizeof(pointerSegments[0]))
+    {
+        diag_report(vm->diag, vm->line, "%s:%u: can not pop %s %s", vm->file, vm->line, segment, index);
+        return VM_ERROR;
+    }
+
+    const char *base = pointerSegments[s].base;
+    if (i < 4)
+    {
+        errnum = emit(vm, pop_d) || emitf(vm, "@%s", base) || emit(vm, "A=M");
+        for (size_t k = 0; k < i && !errnum; k++) {
+            errnum = emit(vm, "A=A+1");
+        }
+        return errnum || emit(vm, "M=D");
+    }
+
+    return emitf(vm, "@%zu", i) || emit(vm, "D=A") || emitf(vm, "@%s", base) || emit(vm, "D=D+M") || emit(vm, "@R13")
+        || emit(vm, "M=D") || emit(vm, pop_d) || emit(vm, "@R13") || emit(vm, "A=M") || emit(vm, "M=D");
+}
+
+static int call(Vm *vm, const char *name, const char *args)
+{
+    size_t n;
+    if (parse_index(vm, args, &n)) return VM_ERROR;
+
+    size_t label = vm->labels++;
+    vm->uses_call = 1;
+
+    return emitf(vm, "@%zu", n) || emit(vm, "D=A") || emit(vm, "@R13") || emit(vm, "M=D")
+        || emit_ref(vm, "%s", name) || emit(vm, "D=A") || emit(vm, "@R14") || emit(vm, "M=D")
+        || emit_ref(vm, "%s$ret.%zu", vm->function, label) || emit(vm, "D=A") || emit_ref(vm, "$call") || emit(vm, "0;JMP")
+        || emitf(vm, "(%s$ret.%zu)", vm->function, label);
+}
+
+// function clears its locals on the stack and moves SP past them.
+static int function(Vm *vm, const char *name, const char *locals)
+{
+    size_t n;
+    if (parse_index(vm, locals, &n)) return VM_ERROR;
+
+    snprintf(vm->function, sizeof(vm->function), "%s", name);
+
+    int errnum = emitf(vm, "(%s)", name);
+    if (errnum || !n) return errnum;
+
+    errnum = emit(vm, "@SP") || emit(vm, "A=M") || emit(vm, "M=0");
+    for (size_t k = 1; k < n && !errnum; k++) {
+        errnum = emit(vm, "A=A+1") || emit(vm, "M=0");
+    }
+
+    return errnum || emit(vm, "D=A+1") || emit(vm, "@SP") || emit(vm, "M=D");
+}
+
+// emit_routines emits $call and $return when they are used. $call pushes
+// the return address in D and the caller's LCL, ARG, THIS and THAT, points
+// ARG at the R13 arguments and LCL at the new frame and jumps to R14.
+// $return copies the return value to ARG[0], restores the caller's frame
+// and jumps back.
+static int emit_routines(Vm *vm)
+{
+    static const char *frame[] = { "LCL", "ARG", "THIS", "THAT" };
+    int errnum = 0;
+
+    if (vm->uses_call)
+    {
+        errnum = emit(vm, "($call)") || emit(vm, "@SP") || emit(vm, "A=M") || emit(vm, "M=D");
+        for (int i = 0; i < 4 && !errnum; i++) {
+            errnum = emitf(vm, "@%s", frame[i]) || emit(vm, "D=M") || emit(vm, "@SP") || emit(vm, "AM=M+1") || emit(vm, "M=D");
+        }
+        errnum = errnum || emit(vm, "@SP") || emit(vm, "MD=M+1") || emit(vm, "@LCL") || emit(vm, "M=D")
+            || emit(vm, "@R13") || emit(vm, "D=D-M") || emit(vm, "@5") || emit(vm, "D=D-A") || emit(vm, "@ARG") || emit(vm, "M=D")
+            || emit(vm, "@R14") || emit(vm, "A=M") || emit(vm, "0;JMP");
+    }
+
+    if (vm->uses_return && !errnum)
+    {
+        errnum = emit(vm, "($return)") || emit(vm, "@LCL") || emit(vm, "D=M") || emit(vm, "@R13") || emit(vm, "M=D")
+            || emit(vm, "@5") || emit(vm, "A=D-A") || emit(vm, "D=M") || emit(vm, "@R14") || emit(vm, "M=D")
+            || emit(vm, "@SP") || emit(vm, "AM=M-1") || emit(vm, "D=M") || emit(vm, "@ARG") || emit(vm, "A=M") || emit(vm, "M=D")
+            || emit(vm, "@ARG") || emit(vm, "D=M+1") || emit(vm, "@SP") || emit(vm, "M=D");
+        for (int i = 3; i >= 0 && !errnum; i--) {
+            errnum = emit(vm, "@R13") || emit(vm, "AM=M-1") || emit(vm, "D=M") || emitf(vm, "@%s", frame[i]) || emit(vm, "M=D");
+        }
+        errnum = errnum || emit(vm, "@R14") || emit(vm, "A=M") || emit(vm, "0;JMP");
+    }
+
+    return errnum;
+}
+
+// emit adds the newline separated instructions of text to the program,
+// and to the dump.
+static int emit(Vm *vm, const char *text)
+{
+    while (*text)
+    {
+        size_t len = strcspn(text, "\n");
+        Slice whole = { text, len };
+        int errnum;
+
+        if (vm->dump) {
+            fprintf(vm->dump, "%s%.*s\n", text[0] == '(' ? "" : "    ", (int)len, text);
+        }
+
+        if (text[0] == '@')
+        {
+            Slice sym = { text + 1, len - 1 };
+            errnum = code_emit_a(vm->code, sym, vm->line);
+        }
+        else if (text[0] == '(')
+        {
+            Slice sym = { text + 1, len - 2 };
+            errnum = code_emit_label(vm->code, sym, vm->line);
+        }
+        else
+        {
+            const char *eq = memchr(text, '=', len);
+            const char *semi = memchr(text, ';', len);
+            const char *comp = eq ? eq + 1 : text;
+            const char *comp_end = semi ? semi : text + len;
+            Slice dest = { text, eq ? (size_t)(eq - text) : 0 };
+            Slice c = { comp, comp_end - comp };
+            Slice jump = { semi ? semi + 1 : text + len, semi ? (size_t)(text + len - semi - 1) : 0 };
+            errnum = code_emit_c(vm->code, dest, c, jump, vm->line);
+        }
+
+        if (errnum)
+        {
+            diag_report(vm->diag, vm->line, "%s:%u: can not emit %.*s", vm->file, vm->line, (int)whole.len, whole.ptr);
+            return VM_ERROR;
+        }
+
+        text += len;
+        if (*text) text++;
+    }
+
+    return 0;
+}
+
+static int emitf(Vm *vm, const char *format, ...)
+{
+    char text[VM_SYMBOL_SIZE * 2 + 32];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(text))
+    {
+        diag_report(vm->diag, vm->line, "%s:%u: symbol too long", vm->file, vm->line);
+        return VM_ERROR;
+    }
+
+    return emit(vm, text);
+}
+
+// emit_ref emits @label, a label which takes no RAM slot while it is
+// ahead.
+static int emit_ref(Vm *vm, const char *format, ...)
+{
+    char text[VM_SYMBOL_SIZE * 2 + 32];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(text))
+    {
+        diag_report(vm->diag, vm->line, "%s:%u: symbol too long", vm->file, vm->line);
+        return VM_ERROR;
+    }
+
+    if (vm->dump) {
+        fprintf(vm->dump, "    @%s\n", text);
+    }
+
+    Slice sym = { text, len };
+    if (code_emit_label_ref(vm->code, sym, vm->line))
+    {
+        diag_report(vm->diag, vm->line, "%s:%u: can not emit @%s", vm->file, vm->line, text);
+        return VM_ERROR;
+    }
+
+    return 0;
+}
+
+static int parse_index(Vm *vm, const char *text, size_t *index)
+{
+    char *end;
+    unsigned long value = strtoul(text, &end, 10);
+
+    if (*text < '0' || *text > '9' || *end || value > 32767)
+    {
+        diag_report(vm->diag, vm->line, "%s:%u: bad number: %s", vm->file, vm->line, text);
+        return VM_ERROR;
+    }
+
+    *index = value;
+
+    return 0;
+}
+
+// tokenize splits line into its words, comments dropped. It returns -1
+// when there are more than VM_MAX_TOKENS.
+static int tokenize(char *line, char **tokens)
+{
+    char *comment = strstr(line, "//");
+    if (comment) *comment = '\0';
+
+    char *save;
+    int count = 0;
+    for (char *word = strtok_r(line, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (count == VM_MAX_TOKENS) return -1;
+        tokens[count++] = word;
+    }
+
+    return count;
+}
@@ -0,0 +1,13 @@
+#ifndef VM_H
+#define VM_H
+
+#include<stdio.h>
+#include<stddef.h>
+#include "./code.h"
+#include "./diag.h"
+
+#define VM_ERROR 1
+
+int vm_translate(Code *c, const char *const *files, size_t count, int bootstrap, FILE *dump, Diagnostics *diag);
+
+#endif